@@ -0,0 +1,141 @@
+/* Dawson function with piecewise polynomials, cheap enough to be evaluated at every point of a fit */
+
+#ifndef DAWSON_H
+#define DAWSON_H
+
+#include <cmath>
+
+namespace sf {
+
+// Coefficients of D(x)/x on the intervals [j/4, (j+1)/4), as polynomials in t = 8 x - 2 j - 1 in [-1, 1]. They are
+// the Chebyshev interpolants of D(x)/x written in the monomial basis, with a relative accuracy of about 1e-16
+constexpr int kDawsonDegree = 11;
+constexpr double kDawsonTable[32][kDawsonDegree + 1] = {
+    {9.89648147862717820e-01, -2.05746524834278036e-02, -1.00303731922283725e-02, 2.54659966149034923e-04,
+     6.08145565184640882e-05, -1.68806462431780844e-06, -2.62982316614987133e-07, 7.73480388578097352e-09,
+     8.83514533901499205e-10, -2.71813590005594837e-11, -2.40945749910309174e-12, 7.69852612078085144e-14},
+    {9.11318013841626917e-01, -5.58754017448614762e-02, -7.23439456080668484e-03, 6.37311894139691430e-04,
+     3.11719781583232435e-05, -3.86987731789169592e-06, -8.07264299666969169e-08, 1.61555697302694530e-08,
+     9.50698069775728842e-11, -5.14354520899589649e-11, 2.00365357775590654e-13, 1.31270959902780741e-13},
+    {7.76099942732930259e-01, -7.64856045986063993e-02, -2.98056443141686339e-03, 7.27925832196979548e-04,
+     -7.93969283107908780e-06, -3.53731339547002196e-06, 1.24029264078505909e-07, 1.10978014089281333e-08,
+     -6.41747854548219841e-10, -2.37043452715223951e-11, 2.16927979335414915e-12, 3.10297205530427023e-14},
+    {6.16798837596033045e-01, -8.01817225235655212e-02, 9.49444015219652604e-04, 5.47731987391421207e-04,
+     -3.35480529653283831e-05, -1.43406140081336668e-06, 1.99069602846319356e-07, -4.59878394343850408e-10,
+     -6.76694173511017775e-10, 1.75672547217863401e-11, 1.53367686154622520e-12, -7.52420565743317208e-14},
+    {4.64044884460451279e-01, -7.09620553612187455e-02, 3.36230921369555600e-03, 2.52480765297911057e-04,
+     -3.67430472514264895e-05, 6.58410693194026611e-07, 1.32608780600316644e-07, -7.71528847165344941e-09,
+     -1.93287414838147327e-10, 2.99326717560256615e-11, -2.73958063515242748e-13, -7.03273117096412969e-14},
+    {3.37030501930150106e-01, -5.55842806685027530e-02, 4.07446147899115374e-03, 1.57720817788280826e-06,
+     -2.44649124340383504e-05, 1.57129564479326242e-06, 2.12288533823134299e-08, -7.07286727227905158e-09,
+     2.23052332103916190e-10, 1.36183717348340741e-11, -1.08296038214795815e-12, -1.93033516560109999e-15},
+    {2.41831763321409626e-01, -3.99235202586618668e-02, 3.62326246864371794e-03, -1.31398069540699633e-04,
+     -9.16831566869230082e-06, 1.35070345889434280e-06, -4.72073999763412669e-08, -2.54033876094299561e-09,
+     2.87358566977673914e-10, -4.82527298575190948e-12, -6.17157641713968250e-13, 3.47111941407362415e-14},
+    {1.75319841678019728e-01, -2.72024985651063873e-02, 2.71034045309908374e-03, -1.59211229284477178e-04,
+     1.09054630747872876e-06, 6.85890040516516505e-07, -5.53893444381113652e-08, 9.53145005806266325e-10,
+     1.34724156888805797e-10, -9.79548590545047517e-12, 6.85450763914759968e-14, 2.22720363978868140e-14},
+    {1.30518520420708078e-01, -1.81919945864839998e-02, 1.82366212750436621e-03, -1.31189107579312653e-04,
+     5.00613056641535821e-06, 1.43020186008374118e-07, -3.30306510593198988e-08, 1.85816879002454844e-09,
+     -7.50689135526808280e-12, -5.27263982689929750e-12, 2.93554868551038455e-13, -3.60100322659691889e-16},
+    {1.00462461193458946e-01, -1.23055053437983019e-02, 1.16140316263391250e-03, -8.97009339105365360e-05,
+     4.94898924587648706e-06, -1.08944431306881626e-07, -1.04480227474692692e-08, 1.24600390794591810e-09,
+     -5.40326787295923137e-11, -3.35033887453924323e-13, 1.70263222015842560e-13, -8.11216965591041599e-15},
+    {7.98546302601629704e-02, -8.58815493014447075e-03, 7.31490899401876981e-04, -5.55370715143349274e-05,
+     3.52162605903701752e-06, -1.53402130158565317e-07, 1.17369218765444287e-09, 4.55093186016187142e-10,
+     -3.96385198654479486e-11, 1.42333973541765068e-12, 1.94594629481744279e-14, -4.74484791476234871e-15},
+    {6.52115485342428802e-02, -6.22782435830198083e-03, 4.71038459169774481e-04, -3.31207722071826324e-05,
+     2.14687587515991091e-06, -1.15945765120700136e-07, 4.06734137254468492e-09, 2.40530583405592681e-11,
+     -1.52914233187883096e-11, 1.10494056112709370e-12, -3.48063552900357294e-14, -5.80186772004673405e-16},
+    {5.44059872293045366e-02, -4.68091701206635024e-03, 3.15532787405305767e-04, -1.99413651438386283e-05,
+     1.22503924846735613e-06, -7.00300850642451889e-08, 3.31332965010622164e-09, -9.58128365358716266e-11,
+     -1.75399259437355561e-12, 4.27603305790014783e-13, -2.75347611219295269e-14, 8.22582472263174880e-16},
+    {4.61643126313640850e-02, -3.62389110239359769e-03, 2.20412478069711331e-04, -1.24670090700703117e-05,
+     6.96135433942668356e-07, -3.84394419105626179e-08, 1.98272019055635193e-09, -8.43151365660376861e-11,
+     2.08671804342693276e-12, 5.76355774576266446e-14, -1.03366478613893679e-14, 6.21760525412500962e-16},
+    {3.97084690272161839e-02, -2.87229898788763554e-03, 1.59665614471859215e-04, -8.16156914147475826e-06,
+     4.09551144027005560e-07, -2.07446766020356825e-08, 1.04828548737455714e-09, -4.96896494104482440e-11,
+     1.94692654651023939e-12, -4.36219977466486377e-14, -1.39450243753198046e-15, 2.16934563372757839e-16},
+    {3.45431911499194458e-02, -2.31994839906251270e-03, 1.19087327491970547e-04, -5.57180630613461171e-06,
+     2.53082450087559100e-07, -1.15606377134629886e-08, 5.39332937285386277e-10, -2.52638892301938901e-11,
+     1.11747174212486422e-12, -4.12954472558896756e-14, 8.83198417051414959e-16, 2.52804630254824028e-17},
+    {3.03387801395172546e-02, -1.90319368977162964e-03, 9.09199029822681427e-05, -3.93563183351560571e-06,
+     1.63859856612457727e-07, -6.78582630289075924e-09, 2.86225503041609975e-10, -1.24201035912654889e-11,
+     5.44506661521120159e-13, -2.27572836047132315e-14, 8.08401160955073276e-16, -1.77764859860237991e-17},
+    {2.68670087856909337e-02, -1.58199111036920123e-03, 7.07571099408638539e-05, -2.85648014634761329e-06,
+     1.10225681365272838e-07, -4.19036935493567347e-09, 1.60481522433074479e-10, -6.30581015334009822e-12,
+     2.56200588757664452e-13, -1.05861278042822071e-14, 4.23108103405365339e-16, -1.46654766063881261e-17},
+    {2.39648422068725261e-02, -1.33002021269291331e-03, 5.59631087332676893e-05, -2.11973557484067923e-06,
+     7.64346119018420547e-08, -2.69783746505100069e-09, 9.50026154421378849e-11, -3.39452284358759894e-12,
+     1.24972096830324644e-13, -4.77550631478404385e-15, 1.87594599598864986e-16, -7.17357042185925194e-18},
+    {2.15128386302066779e-02, -1.12935768646712348e-03, 4.48840223935375647e-05, -1.60267182054521666e-06,
+     5.43288805789317442e-08, -1.79526741093829184e-09, 5.88023787106709011e-11, -1.93545937686445456e-12,
+     6.49027877951551599e-14, -2.24770280193547625e-15, 8.13482082558751996e-17, -3.02229384837503290e-18},
+    {1.94216533169693575e-02, -9.67448271317460236e-04, 3.64411819578814189e-05, -1.23142159758457732e-06,
+     3.94270237807904613e-08, -1.22709782567189127e-09, 3.76981549362640448e-11, -1.15635748214266772e-12,
+     3.57957301175879362e-14, -1.13133930460529412e-15, 3.70938776555926698e-17, -1.26385420473294381e-18},
+    {1.76232639679234464e-02, -8.35290351500001557e-04, 2.99090629280837756e-05, -9.59646592549965489e-07,
+     2.91301332042219790e-08, -8.57833368616370898e-10, 2.48659208568613562e-11, -7.16727303585520664e-13,
+     2.07189750529821804e-14, -6.05936880432526036e-16, 1.81626363112210963e-17, -5.61232485229284508e-19},
+    {1.60650824800479888e-02, -7.26301848235215626e-04, 2.47872006107800885e-05, -7.57307554246098240e-07,
+     2.18640551313956128e-08, -6.11455720935620823e-10, 1.67986025293535580e-11, -4.57648542724727242e-13,
+     1.24546453002184953e-14, -3.40885570425036000e-16, 9.47541897708296326e-18, -2.68580315071989443e-19},
+    {1.47059004034403099e-02, -6.35586970817643448e-04, 2.07229211253704868e-05, -6.04401227961168827e-07,
+     1.66419638926296895e-08, -4.43353478545663472e-10, 1.15855855607694085e-11, -2.99626383511571610e-13,
+     7.72002339367560878e-15, -1.99292950911192343e-16, 5.19429502758162436e-18, -1.36982436242110684e-19},
+    {1.35130357255984161e-02, -5.59448928814379291e-04, 1.74630447764030735e-05, -4.87300915915757296e-07,
+     1.28275760647040110e-08, -3.26400168159120365e-10, 8.13712772552432505e-12, -2.00466459311602320e-13,
+     4.91079045088730068e-15, -1.20219973276374484e-16, 2.96008496566399802e-18, -7.33861840403600011e-20},
+    {1.24602869324745603e-02, -4.95058512993575396e-04, 1.48228155684661361e-05, -3.96538438579051020e-07,
+     1.00007236354560622e-08, -2.43614312610058995e-10, 5.80876255096132628e-12, -1.36713756263825566e-13,
+     3.19482930772697620e-15, -7.44709513024361454e-17, 1.74130538826537868e-18, -4.08672172620333177e-20},
+    {1.15264414322156956e-02, -4.40224120828296064e-04, 1.26654207915185235e-05, -3.25419029830508535e-07,
+     7.87812611137007559e-09, -1.84099062988554481e-10, 4.20783707383360294e-12, -9.48446156558068021e-14,
+     2.12021344337588919e-15, -4.72100119703672238e-17, 1.05241229926808546e-18, -2.34963684748382594e-20},
+    {1.06941719380153951e-02, -3.93229326427876305e-04, 1.08882034528455892e-05, -2.69134281681834252e-07,
+     6.26524669853466964e-09, -1.40709454849669359e-10, 3.08896411930844299e-12, -6.68223285070730089e-14,
+     1.43234712009682362e-15, -3.05477842530866838e-17, 6.51257738475547668e-19, -1.38833145305827674e-20},
+    {9.94920895545431568e-03, -3.52716328314480138e-04, 9.41320580703966860e-06, -2.24181460553960410e-07,
+     5.02626899707807501e-09, -1.08669990671881387e-10, 2.29534290865278121e-12, -4.77456125704760029e-14,
+     9.83365041517593401e-16, -2.01332263653786804e-17, 4.11560796323485539e-19, -8.40215709626124262e-21},
+    {9.27971275426568015e-03, -3.17601115325918774e-04, 8.18057437156564052e-06, -1.87975930949427663e-07,
+     4.06494627617284715e-09, -8.47334651566368510e-11, 1.72477823829263677e-12, -3.45566555665676419e-14,
+     6.85106574410242686e-16, -1.34922739117800493e-17, 2.65040898730387664e-19, -5.19469790308879716e-21},
+    {8.67579144745333868e-03, -2.87010913059621649e-04, 7.14389071243868905e-06, -1.58587927520145480e-07,
+     3.31213872529986053e-09, -6.66571667899375920e-11, 1.30946863762410162e-12, -2.53087055011127651e-14,
+     4.83780195122010462e-16, -9.18044858743207137e-18, 1.73633264088928779e-19, -3.27406864169379238e-21},
+    {8.12912742263975467e-03, -2.60237508919471854e-04, 6.26681999494570231e-06, -1.34560942169407606e-07,
+     2.71755575699109620e-09, -5.28699406960952442e-11, 1.00369874551826510e-12, -1.87395173600631966e-14,
+     3.45880303403382364e-16, -6.33446354305061844e-18, 1.15546341604460272e-19, -2.09998498773774920e-21},
+};
+
+// Coefficients of x D(x) for x >= 8, as a polynomial in t = 128/x^2 - 1 in [-1, 1]
+constexpr double kDawsonTail[] = {
+    5.01976472891236369e-01, 2.00029363264189221e-03, 2.43072254695124311e-05, 5.00632177006096691e-07,
+    1.46864591611364417e-08, 5.63836035763895202e-10, 2.69416489043293290e-11, 1.55019503109410569e-12,
+    1.06819246283732444e-13, 8.42243774736849103e-15,
+};
+
+// Dawson function D(x) = exp(-x^2) int_0^x exp(t^2) dt, for which D(-x) = -D(x). Each point costs a table lookup and a
+// polynomial of low degree, so that the function can be evaluated at every point of a fit
+inline double Dawson(double x) {
+    const double ax = std::fabs(x);
+    if (ax < 8) {
+        const int j = ax * 4;
+        const double* c = kDawsonTable[j];
+        const double t = 8 * ax - 2 * j - 1;
+        double d = c[kDawsonDegree];
+        for (int k = kDawsonDegree - 1; k >= 0; k--) d = d * t + c[k];
+        return d * x;
+    }
+
+    const int n = sizeof(kDawsonTail) / sizeof(double);
+    const double t = 128 / (ax * ax) - 1;
+    double d = kDawsonTail[n - 1];
+    for (int k = n - 2; k >= 0; k--) d = d * t + kDawsonTail[k];
+    return std::copysign(d / ax, x);
+}
+
+}  // namespace sf
+
+#endif
@@ -0,0 +1,164 @@
+/* Dual numbers for forward-mode automatic differentiation of the fit functions */
+
+#ifndef DUAL_H
+#define DUAL_H
+
+#include <cmath>
+
+namespace sf {
+
+// Number carrying its value and the derivatives with respect to N variables
+template <int N>
+struct Dual {
+    double v;
+    double d[N];
+
+    Dual(double value = 0) : v(value) {
+        for (int k = 0; k < N; k++) d[k] = 0;
+    }
+
+    // Independent variable: derivative 1 with respect to itself and 0 with respect to the others
+    static Dual Variable(double value, int k) {
+        Dual x(value);
+        x.d[k] = 1;
+        return x;
+    }
+
+    Dual& operator+=(const Dual& b) {
+        v += b.v;
+        for (int k = 0; k < N; k++) d[k] += b.d[k];
+        return *this;
+    }
+
+    Dual& operator-=(const Dual& b) {
+        v -= b.v;
+        for (int k = 0; k < N; k++) d[k] -= b.d[k];
+        return *this;
+    }
+
+    Dual& operator*=(const Dual& b) {
+        for (int k = 0; k < N; k++) d[k] = d[k] * b.v + v * b.d[k];
+        v *= b.v;
+        return *this;
+    }
+
+    Dual& operator/=(const Dual& b) {
+        double inv = 1. / b.v;
+        for (int k = 0; k < N; k++) d[k] = (d[k] - v * inv * b.d[k]) * inv;
+        v *= inv;
+        return *this;
+    }
+};
+
+// Apply a function with value f and derivative df to a dual number (chain rule)
+template <int N>
+Dual<N> Chain(const Dual<N>& x, double f, double df) {
+    Dual<N> r(f);
+    for (int k = 0; k < N; k++) r.d[k] = df * x.d[k];
+    return r;
+}
+
+// Value of a number, regardless of whether it carries derivatives
+inline double Value(double x) { return x; }
+
+template <int N>
+double Value(const Dual<N>& x) {
+    return x.v;
+}
+
+// Arithmetic operators
+template <int N>
+Dual<N> operator-(const Dual<N>& a) {
+    return Chain(a, -a.v, -1.);
+}
+
+template <int N>
+Dual<N> operator+(Dual<N> a, const Dual<N>& b) {
+    return a += b;
+}
+
+template <int N>
+Dual<N> operator+(Dual<N> a, double b) {
+    a.v += b;
+    return a;
+}
+
+template <int N>
+Dual<N> operator+(double a, Dual<N> b) {
+    b.v += a;
+    return b;
+}
+
+template <int N>
+Dual<N> operator-(Dual<N> a, const Dual<N>& b) {
+    return a -= b;
+}
+
+template <int N>
+Dual<N> operator-(Dual<N> a, double b) {
+    a.v -= b;
+    return a;
+}
+
+template <int N>
+Dual<N> operator-(double a, const Dual<N>& b) {
+    return Chain(b, a - b.v, -1.);
+}
+
+template <int N>
+Dual<N> operator*(Dual<N> a, const Dual<N>& b) {
+    return a *= b;
+}
+
+template <int N>
+Dual<N> operator*(const Dual<N>& a, double b) {
+    return Chain(a, a.v * b, b);
+}
+
+template <int N>
+Dual<N> operator*(double a, const Dual<N>& b) {
+    return Chain(b, a * b.v, a);
+}
+
+template <int N>
+Dual<N> operator/(Dual<N> a, const Dual<N>& b) {
+    return a /= b;
+}
+
+template <int N>
+Dual<N> operator/(const Dual<N>& a, double b) {
+    return Chain(a, a.v / b, 1. / b);
+}
+
+template <int N>
+Dual<N> operator/(double a, const Dual<N>& b) {
+    return Chain(b, a / b.v, -a / (b.v * b.v));
+}
+
+// Mathematical functions
+template <int N>
+Dual<N> exp(const Dual<N>& x) {
+    double e = std::exp(x.v);
+    return Chain(x, e, e);
+}
+
+template <int N>
+Dual<N> sqrt(const Dual<N>& x) {
+    double s = std::sqrt(x.v);
+    return Chain(x, s, 0.5 / s);
+}
+
+template <int N>
+Dual<N> log(const Dual<N>& x) {
+    return Chain(x, std::log(x.v), 1. / x.v);
+}
+
+template <int N>
+Dual<N> pow(const Dual<N>& x, double n) {
+    double p = std::pow(x.v, n - 1);
+    return Chain(x, p * x.v, n * p);
+}
+
+}  // namespace sf
+
+#endif
@@ -5,28 +5,82 @@
 
 #include <cmath>
 
+// The sources are written as a normalization, which only depends on the parameters, times a function of the
+// coordinates. The batch versions compute the normalization once and evaluate the rest over arrays of coordinates
+
+// Normalization of the source function for 3 identical particles
+double _SourceAAANorm(double rho0) {
+    double invRho2 = 1 / (rho0 * rho0);
+    return invRho2 * invRho2 * invRho2;
+}
+
 // Source function for 3 identical particles
 // Ref.: PRC 109, 034006 (2024) (Eq. 40, 41)
 // DOI: https://doi.org/10.1103/PhysRevC.109.034006
 double _SourceAAA(double hyperRadius,  // Hyper-radius defined as in 3B NOTES
                   double rho0          // source size
 ) {
-    return exp(-hyperRadius * hyperRadius / rho0 / rho0) / pow(rho0, 6) * pow(hyperRadius, 5);
+    double hyperRadius2 = hyperRadius * hyperRadius;
+    return _SourceAAANorm(rho0) * hyperRadius2 * hyperRadius2 * hyperRadius * exp(-hyperRadius2 / rho0 / rho0);
 }
 
+// Source function for 3 identical particles evaluated over an array of hyper-radii
+void _SourceAAABatch(const double* hyperRadius, int n, double rho0, double* out) {
+    const double norm = _SourceAAANorm(rho0);
+    const double invRho2 = 1 / (rho0 * rho0);
+
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+        double hyperRadius2 = hyperRadius[i] * hyperRadius[i];
+        out[i] = norm * hyperRadius2 * hyperRadius2 * hyperRadius[i] * exp(-hyperRadius2 * invRho2);
+    }
+}
+
+// Normalization of the Gaussian source for 2B, including the 4 pi of the angular integral: 4 pi / (4 pi r0^2)^(3/2).
+// Like the other sources, it only depends on r0^2
+double _SourceGaussNorm(double r0) { return 1 / (2 * sqrt(M_PI) * r0 * r0 * std::fabs(r0)); }
+
 // Gaussian source for 2B
 double _SourceGauss(double rStar, double r0) {
-    return 4 * M_PI * rStar * rStar * exp(-rStar * rStar / 4 / r0 / r0) / pow(4 * M_PI * r0 * r0, 1.5);
+    return _SourceGaussNorm(r0) * rStar * rStar * exp(-rStar * rStar / 4 / r0 / r0);
+}
+
+// Gaussian source for 2B evaluated over an array of r*
+void _SourceGaussBatch(const double* rStar, int n, double r0, double* out) {
+    const double norm = _SourceGaussNorm(r0);
+    const double invWidth = 1 / (4 * r0 * r0);
+
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+        double rStar2 = rStar[i] * rStar[i];
+        out[i] = norm * rStar2 * exp(-rStar2 * invWidth);
+    }
+}
+
+// Normalization of the Gaussian source for 3 identical particles in Jacobi coordinates, including the 4 pi of each
+// angular integral: (4 pi)^2 / (2 sqrt(3) pi r0^2)^3
+double _SourceAAAJCNorm(double r0) {
+    double r02 = r0 * r0;
+    return 2 / (3 * sqrt(3) * M_PI * r02 * r02 * r02);
 }
 
 // Gaussian source for 3 identical particles expressed in Jacobi coordinates. Based on Mathematica calculation
 double _SourceAAAJC(double r12, double r312, double r0) {
     double arg = - (3 * r12 * r12 + 4 * r312 * r312) / 12 / r0 / r0;
-    double norm = pow(2 * sqrt(3) * M_PI * r0 * r0, -3);
-    double jacobianr12 = 4 * M_PI * r12 * r12;
-    double jacobianr312 = 4 * M_PI * r312 * r312;
+    return _SourceAAAJCNorm(r0) * r12 * r12 * r312 * r312 * exp(arg);
+}
+
+// Gaussian source for 3 identical particles in Jacobi coordinates evaluated over arrays of (r12, r312) pairs
+void _SourceAAAJCBatch(const double* r12, const double* r312, int n, double r0, double* out) {
+    const double norm = _SourceAAAJCNorm(r0);
+    const double invWidth = 1 / (12 * r0 * r0);
 
-    return jacobianr12 * jacobianr312 * norm * exp(arg);
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+        double r122 = r12[i] * r12[i];
+        double r3122 = r312[i] * r312[i];
+        out[i] = norm * r122 * r3122 * exp(-(3 * r122 + 4 * r3122) * invWidth);
+    }
 }
 
 #endif
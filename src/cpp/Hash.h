@@ -0,0 +1,53 @@
+/* Content hashes, used to recognize fits whose inputs did not change */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sf {
+
+// 64-bit FNV-1a hash of a sequence of values. Containers are prefixed with their size, so that the boundaries between
+// consecutive values are part of the hash
+class Hash {
+   private:
+    uint64_t fValue = 0xCBF29CE484222325ULL;
+
+   public:
+    Hash& Add(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            fValue ^= bytes[i];
+            fValue *= 0x100000001B3ULL;
+        }
+        return *this;
+    }
+
+    Hash& Add(long value) { return Add(&value, sizeof(value)); }
+
+    // Zeros of both signs give the same hash
+    Hash& Add(double value) {
+        if (value == 0) value = 0;
+        return Add(&value, sizeof(value));
+    }
+
+    Hash& Add(const std::string& value) {
+        Add((long)value.size());
+        return Add(value.data(), value.size());
+    }
+
+    Hash& Add(const std::vector<double>& values) {
+        Add((long)values.size());
+        for (double value : values) Add(value);
+        return *this;
+    }
+
+    uint64_t Get() const { return fValue; }
+};
+
+}  // namespace sf
+
+#endif
@@ -0,0 +1,296 @@
+/* Correlation functions from the Koonin-Pratt equation with tabulated wave functions */
+
+#ifndef KOONINPRATT_H
+#define KOONINPRATT_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Functions.hxx"
+#include "TFile.h"
+#include "TH2.h"
+
+namespace sf {
+
+// Allocator of memory aligned to the cache lines, so that the rows of the tables start at the boundary of a SIMD
+// register
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+// Index i of the interval [grid[i], grid[i + 1]] that contains x, and the position t in [0, 1] of x in it. Outside of
+// the grid, x is moved to the closest edge
+inline void Locate(const std::vector<double>& grid, double x, int& i, double& t) {
+    const int n = grid.size();
+    if (n < 2) {
+        i = 0;
+        t = 0;
+        return;
+    }
+    i = std::clamp(int(std::upper_bound(grid.begin(), grid.end(), x) - grid.begin()) - 1, 0, n - 2);
+    t = std::clamp((x - grid[i]) / (grid[i + 1] - grid[i]), 0., 1.);
+}
+
+// Squared wave function |psi(k*, r)|^2 on a grid of relative momenta in MeV/c and radii in fm. It is stored as a
+// k* x r matrix whose rows are padded to whole cache lines
+class WaveFunctionTable {
+   private:
+    std::vector<double> fKStar;   // Momenta of the rows, in increasing order
+    std::vector<double> fRadius;  // Radii of the columns
+    std::vector<double> fWidth;   // Width of the radial bins, used as integration weights
+    int fStride;                  // Distance between the rows
+    std::vector<double, AlignedAllocator<double>> fValues;
+
+   public:
+    // The values are given row by row, with one row per momentum
+    WaveFunctionTable(std::vector<double> kStar, std::vector<double> radius, std::vector<double> width,
+                      const std::vector<double>& values)
+        : fKStar(kStar), fRadius(radius), fWidth(width) {
+        const int nK = fKStar.size();
+        const int nR = fRadius.size();
+        if (nK == 0 || nR == 0 || (int)fWidth.size() != nR || (int)values.size() != nK * nR) {
+            throw std::invalid_argument("Inconsistent size of the wave function table");
+        }
+        if (!std::is_sorted(fKStar.begin(), fKStar.end())) {
+            throw std::invalid_argument("The momenta of the wave function table must be in increasing order");
+        }
+
+        fStride = (nR + 7) / 8 * 8;
+        fValues.assign(nK * fStride, 0);
+        for (int iK = 0; iK < nK; iK++) {
+            std::copy(values.begin() + iK * nR, values.begin() + (iK + 1) * nR, fValues.begin() + iK * fStride);
+        }
+    }
+
+    // Table from a histogram with the radius (fm) on the x axis and k* (MeV/c) on the y axis
+    static WaveFunctionTable FromHistogram(TH2* hWF) {
+        const int nR = hWF->GetNbinsX();
+        const int nK = hWF->GetNbinsY();
+        std::vector<double> kStar(nK), radius(nR), width(nR), values(nK * nR);
+        for (int iR = 0; iR < nR; iR++) {
+            radius[iR] = hWF->GetXaxis()->GetBinCenter(iR + 1);
+            width[iR] = hWF->GetXaxis()->GetBinWidth(iR + 1);
+        }
+        for (int iK = 0; iK < nK; iK++) {
+            kStar[iK] = hWF->GetYaxis()->GetBinCenter(iK + 1);
+            for (int iR = 0; iR < nR; iR++) {
+                values[iK * nR + iR] = hWF->GetBinContent(iR + 1, iK + 1);
+            }
+        }
+        return WaveFunctionTable(kStar, radius, width, values);
+    }
+
+    // Table from a text file with a header line '# radius k1 k2 ...' followed by the lines 'r |psi(k1, r)|^2 ...', as
+    // written by scripts/cats/ComputeWaveFunction.py
+    static WaveFunctionTable FromText(std::string fileName) {
+        std::ifstream file(fileName);
+        if (!file) throw std::runtime_error("Could not open the wave function file '" + fileName + "'");
+
+        std::vector<double> kStar, radius, columns;
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream stream(line);
+            if (line.rfind("# radius ", 0) == 0) {
+                std::string hash, label;
+                stream >> hash >> label;
+                for (double k; stream >> k;) kStar.push_back(k);
+            } else if (!line.empty() && line[0] != '#') {
+                double r;
+                if (!(stream >> r)) continue;
+                radius.push_back(r);
+                for (double value; stream >> value;) columns.push_back(value);
+            }
+        }
+
+        const int nK = kStar.size();
+        const int nR = radius.size();
+        if (nK == 0 || (int)columns.size() != nK * nR) {
+            throw std::runtime_error("Malformed wave function file '" + fileName + "'");
+        }
+
+        // The file has one line per radius, the table one row per momentum
+        std::vector<double> values(nK * nR);
+        for (int iR = 0; iR < nR; iR++) {
+            for (int iK = 0; iK < nK; iK++) values[iK * nR + iR] = columns[iR * nK + iK];
+        }
+
+        // The radii are the centres of the bins, whose edges are half way between them
+        std::vector<double> width(nR);
+        for (int iR = 0; iR < nR; iR++) {
+            double low = iR > 0 ? 0.5 * (radius[iR - 1] + radius[iR]) : std::max(0., 1.5 * radius[0] - 0.5 * radius[1]);
+            double high = iR < nR - 1 ? 0.5 * (radius[iR] + radius[iR + 1]) : 1.5 * radius[iR] - 0.5 * radius[iR - 1];
+            width[iR] = nR > 1 ? high - low : 1;
+        }
+        return WaveFunctionTable(kStar, radius, width, values);
+    }
+
+    // Table from a ROOT file, given as 'file.root' for the histogram 'hWF' or 'file.root:path', or from a text file.
+    // Each file is read once per process and shared by all the components that use it
+    static std::shared_ptr<const WaveFunctionTable> Load(std::string fileName) {
+        static std::mutex mutex;
+        static std::map<std::string, std::shared_ptr<const WaveFunctionTable>> tables;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto it = tables.find(fileName); it != tables.end()) return it->second;
+
+        std::shared_ptr<const WaveFunctionTable> table;
+        if (size_t pos = fileName.find(".root"); pos != std::string::npos) {
+            std::string path = pos + 5 < fileName.size() && fileName[pos + 5] == ':' ? fileName.substr(pos + 6) : "hWF";
+            TFile file(fileName.substr(0, pos + 5).data());
+            TH2* hWF = dynamic_cast<TH2*>(file.Get(path.data()));
+            if (!hWF) throw std::runtime_error("Could not load the wave function '" + fileName + "'");
+            table = std::make_shared<const WaveFunctionTable>(FromHistogram(hWF));
+            file.Close();
+        } else {
+            table = std::make_shared<const WaveFunctionTable>(FromText(fileName));
+        }
+
+        printf("Loaded wave function '%s' with %zu momenta and %zu radii\n", fileName.data(), table->fKStar.size(),
+               table->fRadius.size());
+        tables[fileName] = table;
+        return table;
+    }
+
+    int GetNKStar() const { return fKStar.size(); }
+    int GetNRadii() const { return fRadius.size(); }
+    const std::vector<double>& GetKStar() const { return fKStar; }
+    const std::vector<double>& GetRadii() const { return fRadius; }
+    const std::vector<double>& GetWidths() const { return fWidth; }
+
+    // Values at the radii for the iK-th momentum
+    const double* GetRow(int iK) const { return fValues.data() + iK * fStride; }
+
+    // Integral of weights[iR] |psi(k*, r_iR)|^2 over the radii, for the iK-th momentum
+    double Project(int iK, const double* weights) const {
+        const double* row = fValues.data() + iK * fStride;
+        const int nR = fRadius.size();
+        double sum = 0;
+#pragma omp simd reduction(+ : sum)
+        for (int iR = 0; iR < nR; iR++) {
+            sum += weights[iR] * row[iR];
+        }
+        return sum;
+    }
+};
+
+// Source evaluated at n radii, and if jac is not null its derivatives with respect to the parameters, stored as
+// jac[iPar * n + i]
+using source_func = std::function<void(const double* r, int n, const double* p, double* out, double* jac)>;
+
+// Gaussian source for 2B, with the radius r0 as only parameter. Radii that are not positive, including NaN, give NaN,
+// which the chi2 reports to the minimizer as an invalid point, since the source only depends on r0^2 and would
+// otherwise mirror the positive radii
+inline void GaussSource(const double* r, int n, const double* p, double* out, double* jac) {
+    const double r0 = p[0];
+    if (!(r0 > 0)) {
+        std::fill(out, out + n, std::numeric_limits<double>::quiet_NaN());
+        if (jac) std::fill(jac, jac + n, std::numeric_limits<double>::quiet_NaN());
+        return;
+    }
+    _SourceGaussBatch(r, n, r0, out);
+    if (!jac) return;
+
+    // dS/dr0 = S (r^2 / (2 r0^3) - 3 / r0)
+    for (int i = 0; i < n; i++) {
+        jac[i] = out[i] * (r[i] * r[i] / (2 * r0 * r0 * r0) - 3 / r0);
+    }
+}
+
+// Correlation function C(k*) = int S(r) |psi(k*, r)|^2 dr / int S(r) dr. The source is evaluated on the radial grid of
+// the table, where it is also normalized, and C(k*) is interpolated linearly between the momenta of the table. Only the
+// rows next to the requested momenta are projected. The momenta are in GeV/c, as for the other fit components, and
+// outside of the table they take the value at the closest edge
+class KooninPratt {
+   private:
+    std::shared_ptr<const WaveFunctionTable> fTable;
+    source_func fSource;
+    int fNPars;
+
+   public:
+    KooninPratt(std::shared_ptr<const WaveFunctionTable> table, source_func source, int nPars)
+        : fTable(table), fSource(source), fNPars(nPars) {}
+
+    int GetNPars() const { return fNPars; }
+
+    // Values at n momenta, and if jac is not null their derivatives stored as jac[iPar * n + i]
+    void Evaluate(const double* x, int n, const double* p, double* out, double* jac) const {
+        const auto& kStar = fTable->GetKStar();
+        const auto& radius = fTable->GetRadii();
+        const auto& width = fTable->GetWidths();
+        const int nK = kStar.size();
+        const int nR = radius.size();
+
+        // Integration weights S(r) dr, and their derivatives
+        std::vector<double> weights(nR * (1 + (jac ? fNPars : 0)));
+        fSource(radius.data(), nR, p, weights.data(), jac ? weights.data() + nR : nullptr);
+        for (int iW = 0; iW < (int)weights.size(); iW++) weights[iW] *= width[iW % nR];
+
+        std::vector<double> norm(1 + (jac ? fNPars : 0), 0);
+        for (size_t iW = 0; iW < norm.size(); iW++) {
+            for (int iR = 0; iR < nR; iR++) norm[iW] += weights[iW * nR + iR];
+        }
+
+        // Correlation of each row of the table, and its derivatives, computed when first needed
+        const int nRow = norm.size();
+        std::vector<double> rows(nK * nRow);
+        std::vector<char> done(nK, false);
+        auto row = [&](int iK) -> const double* {
+            double* cf = rows.data() + iK * nRow;
+            if (!done[iK]) {
+                cf[0] = fTable->Project(iK, weights.data()) / norm[0];
+                for (int iPar = 1; iPar < nRow; iPar++) {
+                    cf[iPar] = (fTable->Project(iK, weights.data() + iPar * nR) - cf[0] * norm[iPar]) / norm[0];
+                }
+                done[iK] = true;
+            }
+            return cf;
+        };
+
+        for (int i = 0; i < n; i++) {
+            int iK;
+            double t;
+            Locate(kStar, x[i] * 1000, iK, t);
+            const double* low = row(iK);
+            const double* high = nK > 1 ? row(iK + 1) : low;
+
+            out[i] = low[0] + t * (high[0] - low[0]);
+            for (int iPar = 1; iPar < nRow; iPar++) {
+                jac[(iPar - 1) * n + i] = low[iPar] + t * (high[iPar] - low[iPar]);
+            }
+        }
+    }
+};
+
+}  // namespace sf
+
+#endif
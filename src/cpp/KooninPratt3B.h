@@ -0,0 +1,350 @@
+/* Three-body correlation functions from the Koonin-Pratt equation in Jacobi coordinates */
+
+#ifndef KOONINPRATT3B_H
+#define KOONINPRATT3B_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "KooninPratt.h"
+#include "TFile.h"
+#include "TH3.h"
+#include "ThreadPool.h"
+
+namespace sf {
+
+// Nodes and weights of the Gauss-Legendre quadrature with n points over [-1, 1]
+inline void GaussLegendre(int n, std::vector<double>& nodes, std::vector<double>& weights) {
+    nodes.resize(n);
+    weights.resize(n);
+    for (int i = 0; i < n; i++) {
+        // Newton iterations for the i-th root of P_n, starting from its asymptotic estimate
+        double x = std::cos(M_PI * (i + 0.75) / (n + 0.5));
+        double derivative = 1;
+        for (int iter = 0; iter < 100; iter++) {
+            double current = 1, previous = 0;
+            for (int k = 0; k < n; k++) {
+                double next = ((2 * k + 1) * x * current - k * previous) / (k + 1);
+                previous = current;
+                current = next;
+            }
+            derivative = n * (x * current - previous) / (x * x - 1);
+            double step = current / derivative;
+            x -= step;
+            if (std::fabs(step) < 1e-15) break;
+        }
+        nodes[i] = x;
+        weights[i] = 2 / ((1 - x * x) * derivative * derivative);
+    }
+}
+
+// Squared three-body wave function |Psi(Q3; r12, r312)|^2, averaged over the angles, on a grid of Q3 in MeV/c and of
+// the Jacobi distances in fm: r12 between particles 1 and 2 and r312 between particle 3 and the centre of mass of the
+// pair. Each Q3 is stored as a r12 x r312 matrix whose rows are padded to whole cache lines
+class WaveFunction3BTable {
+   private:
+    std::vector<double> fQ3;      // Momenta of the matrices, in increasing order
+    std::vector<double> fR12;     // Distances of the rows
+    std::vector<double> fR312;    // Distances of the columns
+    std::vector<double> fW12;     // Width of the bins of r12, used as integration weights
+    std::vector<double> fW312;    // Width of the bins of r312, used as integration weights
+    int fStride;                  // Distance between the rows
+    std::vector<double, AlignedAllocator<double>> fValues;
+
+    // Table of zeros on the given grid, whose values are then written in place
+    WaveFunction3BTable(std::vector<double> q3, std::vector<double> r12, std::vector<double> w12,
+                        std::vector<double> r312, std::vector<double> w312)
+        : fQ3(q3), fR12(r12), fR312(r312), fW12(w12), fW312(w312) {
+        const int n12 = fR12.size();
+        const int n312 = fR312.size();
+        if (fQ3.empty() || n12 == 0 || n312 == 0 || (int)fW12.size() != n12 || (int)fW312.size() != n312) {
+            throw std::invalid_argument("Inconsistent size of the three-body wave function table");
+        }
+        if (!std::is_sorted(fQ3.begin(), fQ3.end())) {
+            throw std::invalid_argument("The momenta of the three-body wave function table must be increasing");
+        }
+
+        fStride = (n312 + 7) / 8 * 8;
+        fValues.assign(fQ3.size() * n12 * fStride, 0);
+    }
+
+    // Row of r312 values for the iQ-th momentum and the i12-th distance
+    double* Row(int iQ, int i12) { return fValues.data() + ((size_t)iQ * fR12.size() + i12) * fStride; }
+
+   public:
+    // The values are given as values[(iQ * nR12 + i12) * nR312 + i312]
+    WaveFunction3BTable(std::vector<double> q3, std::vector<double> r12, std::vector<double> w12,
+                        std::vector<double> r312, std::vector<double> w312, const std::vector<double>& values)
+        : WaveFunction3BTable(q3, r12, w12, r312, w312) {
+        const int n12 = fR12.size();
+        const int n312 = fR312.size();
+        if ((int)values.size() != (int)fQ3.size() * n12 * n312) {
+            throw std::invalid_argument("Inconsistent size of the three-body wave function table");
+        }
+
+        for (int iQ = 0; iQ < (int)fQ3.size(); iQ++) {
+            for (int i12 = 0; i12 < n12; i12++) {
+                auto row = values.begin() + (iQ * n12 + i12) * n312;
+                std::copy(row, row + n312, Row(iQ, i12));
+            }
+        }
+    }
+
+    // Table from a histogram with r12 (fm) on the x axis, r312 (fm) on the y axis and Q3 (MeV/c) on the z axis
+    static WaveFunction3BTable FromHistogram(TH3* hWF) {
+        const int n12 = hWF->GetNbinsX();
+        const int n312 = hWF->GetNbinsY();
+        const int nQ = hWF->GetNbinsZ();
+        std::vector<double> q3(nQ), r12(n12), w12(n12), r312(n312), w312(n312), values(nQ * n12 * n312);
+        for (int i12 = 0; i12 < n12; i12++) {
+            r12[i12] = hWF->GetXaxis()->GetBinCenter(i12 + 1);
+            w12[i12] = hWF->GetXaxis()->GetBinWidth(i12 + 1);
+        }
+        for (int i312 = 0; i312 < n312; i312++) {
+            r312[i312] = hWF->GetYaxis()->GetBinCenter(i312 + 1);
+            w312[i312] = hWF->GetYaxis()->GetBinWidth(i312 + 1);
+        }
+        for (int iQ = 0; iQ < nQ; iQ++) {
+            q3[iQ] = hWF->GetZaxis()->GetBinCenter(iQ + 1);
+            for (int i12 = 0; i12 < n12; i12++) {
+                for (int i312 = 0; i312 < n312; i312++) {
+                    values[(iQ * n12 + i12) * n312 + i312] = hWF->GetBinContent(i12 + 1, i312 + 1, iQ + 1);
+                }
+            }
+        }
+        return WaveFunction3BTable(q3, r12, w12, r312, w312, values);
+    }
+
+    // Pairwise-factorized table |Psi|^2 = |psi(k*, r12)|^2 |psi(k*, r13)|^2 |psi(k*, r23)|^2 of three identical
+    // particles, averaged over the angle between r12 and r312 with nAngles Gauss-Legendre points. The pairs are taken
+    // in the equilateral configuration, in which each of them has k* = Q3 / (2 sqrt(3)). The momenta are the ones of
+    // the pair table, and both distances have nR bins up to rMax. The table takes nQ x nR x nR doubles, written in
+    // place, i.e. 160 MB for 500 momenta with the default grid, and its construction scales with nQ x nR^2 x nAngles
+    static WaveFunction3BTable Factorized(const WaveFunctionTable& pair, double rMax = 20, int nR = 200,
+                                          int nAngles = 16) {
+        std::vector<double> q3, r(nR), w(nR, rMax / nR);
+        for (double kStar : pair.GetKStar()) q3.push_back(2 * std::sqrt(3) * kStar);
+        for (int iR = 0; iR < nR; iR++) r[iR] = (iR + 0.5) * rMax / nR;
+
+        std::vector<double> cosines, angleWeights;
+        GaussLegendre(nAngles, cosines, angleWeights);
+
+        // The distances do not depend on the momentum, so their positions in the radii of the pair table are found once
+        struct node {
+            int index;
+            double fraction;
+        };
+        auto locate = [&pair](double distance) {
+            node n;
+            Locate(pair.GetRadii(), distance, n.index, n.fraction);
+            return n;
+        };
+        std::vector<node> nodes12(nR), nodes13(nR * nR * nAngles), nodes23(nR * nR * nAngles);
+        for (int i12 = 0; i12 < nR; i12++) {
+            nodes12[i12] = locate(r[i12]);
+            for (int i312 = 0; i312 < nR; i312++) {
+                // Distances of particle 3 from particles 1 and 2: |r312 -+ r12 / 2|
+                const double base = r[i312] * r[i312] + 0.25 * r[i12] * r[i12];
+                for (int iAngle = 0; iAngle < nAngles; iAngle++) {
+                    const double cross = r[i312] * r[i12] * cosines[iAngle];
+                    const int iNode = (i12 * nR + i312) * nAngles + iAngle;
+                    nodes13[iNode] = locate(std::sqrt(base - cross));
+                    nodes23[iNode] = locate(std::sqrt(base + cross));
+                }
+            }
+        }
+
+        const int next = pair.GetNRadii() > 1 ? 1 : 0;
+        const int nQ = q3.size();
+        WaveFunction3BTable table(q3, r, w, r, w);
+        ThreadPool::Global().ParallelFor(nQ, [&](int iQ, int) {
+            const double* row = pair.GetRow(iQ);
+            auto psi2 = [row, next](const node& n) {
+                return row[n.index] + n.fraction * (row[n.index + next] - row[n.index]);
+            };
+            for (int i12 = 0; i12 < nR; i12++) {
+                const double psi12 = psi2(nodes12[i12]);
+                double* values = table.Row(iQ, i12);
+                for (int i312 = 0; i312 < nR; i312++) {
+                    const int iNode = (i12 * nR + i312) * nAngles;
+                    double average = 0;
+                    for (int iAngle = 0; iAngle < nAngles; iAngle++) {
+                        average += angleWeights[iAngle] * psi2(nodes13[iNode + iAngle]) * psi2(nodes23[iNode + iAngle]);
+                    }
+                    values[i312] = 0.5 * psi12 * average;
+                }
+            }
+        });
+        return table;
+    }
+
+    // Table from a ROOT file, given as 'file.root' for the histogram 'hWF3' or 'file.root:path'. With pairwise = true
+    // the file is instead a two-body table, see WaveFunctionTable::Load, from which the factorized table is built. Each
+    // table is built once per process and shared by all the components that use it
+    static std::shared_ptr<const WaveFunction3BTable> Load(std::string fileName, bool pairwise = false) {
+        static std::mutex mutex;
+        static std::map<std::pair<std::string, bool>, std::shared_ptr<const WaveFunction3BTable>> tables;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto it = tables.find({fileName, pairwise}); it != tables.end()) return it->second;
+
+        std::shared_ptr<const WaveFunction3BTable> table;
+        if (pairwise) {
+            table = std::make_shared<const WaveFunction3BTable>(Factorized(*WaveFunctionTable::Load(fileName)));
+        } else {
+            size_t pos = fileName.find(".root");
+            if (pos == std::string::npos) {
+                throw std::invalid_argument("Three-body wave functions are only read from ROOT files");
+            }
+            bool hasPath = pos + 5 < fileName.size() && fileName[pos + 5] == ':';
+            std::string path = hasPath ? fileName.substr(pos + 6) : "hWF3";
+            TFile file(fileName.substr(0, pos + 5).data());
+            TH3* hWF = dynamic_cast<TH3*>(file.Get(path.data()));
+            if (!hWF) throw std::runtime_error("Could not load the three-body wave function '" + fileName + "'");
+            table = std::make_shared<const WaveFunction3BTable>(FromHistogram(hWF));
+            file.Close();
+        }
+
+        printf("Loaded three-body wave function '%s' with %zu momenta and %zu x %zu distances\n", fileName.data(),
+               table->fQ3.size(), table->fR12.size(), table->fR312.size());
+        tables[{fileName, pairwise}] = table;
+        return table;
+    }
+
+    int GetNQ3() const { return fQ3.size(); }
+    const std::vector<double>& GetQ3() const { return fQ3; }
+    const std::vector<double>& GetR12() const { return fR12; }
+    const std::vector<double>& GetR312() const { return fR312; }
+    const std::vector<double>& GetWidths12() const { return fW12; }
+    const std::vector<double>& GetWidths312() const { return fW312; }
+
+    // Integrals sum_{i12, i312} a[i12] |Psi(Q3, r12, r312)|^2 b[i312] of the iQ-th momentum, for a source that
+    // factorizes as a(r12) b(r312). The bilinear forms of nA vectors a and nB vectors b are returned as
+    // out[iA * nB + iB]
+    void Project(int iQ, const double* a, int nA, const double* b, int nB, double* out) const {
+        const int n12 = fR12.size();
+        const int n312 = fR312.size();
+        std::fill(out, out + nA * nB, 0.);
+        for (int i12 = 0; i12 < n12; i12++) {
+            const double* row = fValues.data() + (iQ * n12 + i12) * fStride;
+            for (int iB = 0; iB < nB; iB++) {
+                const double* bB = b + iB * n312;
+                double sum = 0;
+#pragma omp simd reduction(+ : sum)
+                for (int i312 = 0; i312 < n312; i312++) {
+                    sum += row[i312] * bB[i312];
+                }
+                for (int iA = 0; iA < nA; iA++) out[iA * nB + iB] += a[iA * n12 + i12] * sum;
+            }
+        }
+    }
+};
+
+// Three-body correlation function C(Q3) = int S(r12, r312) |Psi|^2 dr12 dr312 / int S dr12 dr312 for the Gaussian
+// source of three identical particles in Jacobi coordinates (_SourceAAAJC), with the radius r0 as only parameter. The
+// source factorizes into exp(-r12^2 / (4 r0^2)) r12^2 times exp(-r312^2 / (3 r0^2)) r312^2, so the weight matrix is
+// the outer product of two vectors, and its normalization cancels in the ratio. The two vectors are rebuilt on every
+// call, which costs nR12 + nR312 exponentials against the nR12 x nR312 products of each projected row. The projections
+// onto the Q3 rows of the table are spread over the thread pool. The momenta are in GeV/c, as for the other fit
+// components, and C(Q3) is interpolated linearly between the momenta of the table. Radii that are not positive give
+// NaN, which the chi2 reports to the minimizer as an invalid point
+class KooninPratt3B {
+   private:
+    std::shared_ptr<const WaveFunction3BTable> fTable;
+
+   public:
+    KooninPratt3B(std::shared_ptr<const WaveFunction3BTable> table) : fTable(table) {}
+
+    int GetNPars() const { return 1; }
+
+    // Values at n momenta, and if jac is not null their derivatives with respect to r0
+    void Evaluate(const double* x, int n, const double* p, double* out, double* jac) const {
+        const double r0 = p[0];
+        if (!(r0 > 0)) {
+            std::fill(out, out + n, std::numeric_limits<double>::quiet_NaN());
+            if (jac) std::fill(jac, jac + n, std::numeric_limits<double>::quiet_NaN());
+            return;
+        }
+
+        const auto& q3 = fTable->GetQ3();
+        const auto& r12 = fTable->GetR12();
+        const auto& r312 = fTable->GetR312();
+        const int nQ = q3.size();
+        const int n12 = r12.size();
+        const int n312 = r312.size();
+
+        // Factors of the source with the integration weights. With derivatives, the second vector of each factor is
+        // weighted by the square of the distance, since dS/dr0 = S ((3 r12^2 + 4 r312^2) / (6 r0^3) - 6 / r0)
+        const int nVec = jac ? 2 : 1;
+        std::vector<double> a(nVec * n12), b(nVec * n312);
+        for (int i = 0; i < n12; i++) {
+            const double r2 = r12[i] * r12[i];
+            a[i] = r2 * std::exp(-r2 / (4 * r0 * r0)) * fTable->GetWidths12()[i];
+            if (jac) a[n12 + i] = a[i] * r2;
+        }
+        for (int i = 0; i < n312; i++) {
+            const double r2 = r312[i] * r312[i];
+            b[i] = r2 * std::exp(-r2 / (3 * r0 * r0)) * fTable->GetWidths312()[i];
+            if (jac) b[n312 + i] = b[i] * r2;
+        }
+
+        // Normalization, and the sum of its derivative without the -6 / r0 term, which cancels in the ratio
+        double norm[4] = {0, 0, 0, 0};
+        for (int iA = 0; iA < nVec; iA++) {
+            double sumA = 0, sumB = 0;
+            for (int i = 0; i < n12; i++) sumA += a[iA * n12 + i];
+            for (int i = 0; i < n312; i++) sumB += b[iA * n312 + i];
+            norm[iA * 2] = sumA;
+            norm[iA * 2 + 1] = sumB;
+        }
+        const double dNorm = (3 * norm[2] * norm[1] + 4 * norm[0] * norm[3]) / (6 * r0 * r0 * r0);
+        const double sourceNorm = norm[0] * norm[1];
+
+        // Rows of the table next to the requested momenta
+        std::vector<char> needed(nQ, false);
+        std::vector<int> lows(n);
+        std::vector<double> fractions(n);
+        for (int i = 0; i < n; i++) {
+            Locate(q3, x[i] * 1000, lows[i], fractions[i]);
+            needed[lows[i]] = true;
+            if (nQ > 1) needed[lows[i] + 1] = true;
+        }
+        std::vector<int> rows;
+        for (int iQ = 0; iQ < nQ; iQ++) {
+            if (needed[iQ]) rows.push_back(iQ);
+        }
+
+        // Correlation at each needed row and its derivative
+        std::vector<double> cf(nQ), dCf(nQ);
+        ThreadPool::Global().ParallelFor(rows.size(), [&](int iRow, int) {
+            const int iQ = rows[iRow];
+            double forms[4];
+            fTable->Project(iQ, a.data(), nVec, b.data(), nVec, forms);
+            cf[iQ] = forms[0] / sourceNorm;
+            if (jac) {
+                const double dForm = (3 * forms[2] + 4 * forms[1]) / (6 * r0 * r0 * r0);
+                dCf[iQ] = (dForm - cf[iQ] * dNorm) / sourceNorm;
+            }
+        });
+
+        for (int i = 0; i < n; i++) {
+            const int low = lows[i];
+            const int high = nQ > 1 ? low + 1 : low;
+            out[i] = cf[low] + fractions[i] * (cf[high] - cf[low]);
+            if (jac) jac[i] = dCf[low] + fractions[i] * (dCf[high] - dCf[low]);
+        }
+    }
+};
+
+}  // namespace sf
+
+#endif
@@ -0,0 +1,76 @@
+/* Counter-based random numbers, reproducible regardless of the order in which the streams are consumed */
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cmath>
+#include <cstdint>
+
+namespace sf {
+
+// Finalizer of the SplitMix64 generator (S. Vigna), a bijective mix of the 64 bits
+inline uint64_t SplitMix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Stream of random numbers identified by a key. The n-th number is a hash of (key, n), so each stream can be
+// generated independently, e.g. one per bin and replica, in any thread and order
+class CounterRNG {
+   private:
+    uint64_t fKey;
+    uint64_t fCounter = 0;
+
+   public:
+    // Key built from a seed and up to two indices of the stream
+    explicit CounterRNG(uint64_t seed, uint64_t i = 0, uint64_t j = 0)
+        : fKey(SplitMix64(SplitMix64(SplitMix64(seed) ^ i) ^ j)) {}
+
+    uint64_t Next() { return SplitMix64(fKey + 0x9E3779B97F4A7C15ULL * fCounter++); }
+
+    // Uniform in (0, 1), from the 53 most significant bits
+    double Uniform() { return ((Next() >> 11) + 0.5) * 0x1.0p-53; }
+
+    // Standard normal (Box-Muller)
+    double Gaus() {
+        double r = std::sqrt(-2 * std::log(Uniform()));
+        return r * std::cos(2 * M_PI * Uniform());
+    }
+
+    // Poisson with mean lambda: multiplication of uniforms for small means, transformed rejection (W. Hoermann, Insur.
+    // Math. Econ. 12 (1993) 39) otherwise
+    long Poisson(double lambda) {
+        if (lambda <= 0) return 0;
+        if (lambda < 10) {
+            double limit = std::exp(-lambda);
+            long k = 0;
+            for (double prod = Uniform(); prod > limit; prod *= Uniform()) k++;
+            return k;
+        }
+
+        double slam = std::sqrt(lambda);
+        double loglam = std::log(lambda);
+        double b = 0.931 + 2.53 * slam;
+        double a = -0.059 + 0.02483 * b;
+        double invAlpha = 1.1239 + 1.1328 / (b - 3.4);
+        double vr = 0.9277 - 3.6224 / (b - 2);
+        while (true) {
+            double u = Uniform() - 0.5;
+            double v = Uniform();
+            double us = 0.5 - std::fabs(u);
+            long k = std::floor((2 * a / us + b) * u + lambda + 0.43);
+            if (us >= 0.07 && v <= vr) return k;
+            if (k < 0 || (us < 0.013 && v > us)) continue;
+            if (std::log(v) + std::log(invAlpha) - std::log(a / (us * us) + b) <=
+                -lambda + k * loglam - std::lgamma(k + 1.)) {
+                return k;
+            }
+        }
+    }
+};
+
+}  // namespace sf
+
+#endif
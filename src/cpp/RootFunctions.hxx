@@ -76,4 +76,35 @@ double SourceCountsAAAJC(double* x, double* p) {
 
     return norm * _SourceAAAJC(r12, r312, r0);
 }
+
+// Batch versions of the wrappers above, with the same parameters, evaluated over arrays of n points
+
+// Source function for 3 identical particles
+void SourceAAABatch(const double* x, int n, const double* p, double* out) { _SourceAAABatch(x, n, p[0], out); }
+
+// Source function for 3 identical particles
+void SourceCountsAAABatch(const double* x, int n, const double* p, double* out) {
+    _SourceAAABatch(x, n, p[1], out);
+    for (int i = 0; i < n; i++) out[i] *= p[0];
+}
+
+// Source function for 2 particles
+void SourceGaussBatch(const double* x, int n, const double* p, double* out) { _SourceGaussBatch(x, n, p[0], out); }
+
+// Source function for 2 particles
+void SourceCountsGaussBatch(const double* x, int n, const double* p, double* out) {
+    _SourceGaussBatch(x, n, p[1], out);
+    for (int i = 0; i < n; i++) out[i] *= p[0];
+}
+
+// Source function for 3 identical particles in Jacobi coordinates, at the points (x[i], y[i])
+void SourceAAAJCBatch(const double* x, const double* y, int n, const double* p, double* out) {
+    _SourceAAAJCBatch(x, y, n, p[0], out);
+}
+
+// Source function for 3 identical particles in Jacobi coordinates, at the points (x[i], y[i])
+void SourceCountsAAAJCBatch(const double* x, const double* y, int n, const double* p, double* out) {
+    _SourceAAAJCBatch(x, y, n, p[1], out);
+    for (int i = 0; i < n; i++) out[i] *= p[0];
+}
 #endif
@@ -0,0 +1,158 @@
+/* Single-pass statistics, used to summarize many fit results without storing them */
+
+#ifndef RUNNINGSTATS_H
+#define RUNNINGSTATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace sf {
+
+// Estimator of a quantile with the P-square algorithm (R. Jain and I. Chlamtac, Comm. ACM 28 (1985) 1076). It keeps
+// five markers whose heights approximate the minimum, the p/2, p, (1+p)/2 quantiles and the maximum. The markers are
+// only accurate after many observations, so the first kNExact observations are kept and give the exact quantile, and
+// then the markers start from the exact quantiles of these observations
+class P2Quantile {
+   public:
+    static constexpr int kNExact = 50;
+
+   private:
+    double fP;
+    long fCount = 0;
+    std::vector<double> fExact;  // Observations, as long as there are at most kNExact of them
+    double fFractions[5];  // Fractions of the observations below the desired markers
+    double fHeights[5];    // Heights of the markers
+    double fPositions[5];  // Actual positions of the markers, starting from 1
+    double fDesired[5];    // Desired positions of the markers
+
+    // Piecewise-parabolic prediction of the height of the i-th marker moved by d
+    double Parabolic(int i, double d) const {
+        const double* q = fHeights;
+        const double* n = fPositions;
+        return q[i] + d / (n[i + 1] - n[i - 1]) *
+                          ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                           (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+    }
+
+    double Linear(int i, int d) const {
+        return fHeights[i] + d * (fHeights[i + d] - fHeights[i]) / (fPositions[i + d] - fPositions[i]);
+    }
+
+    // Markers at the sorted observations closest to their desired positions, which are kept distinct. The observations
+    // are then released
+    void StartMarkers() {
+        std::sort(fExact.begin(), fExact.end());
+        for (int i = 0; i < 5; i++) {
+            fDesired[i] = 1 + (fCount - 1) * fFractions[i];
+            long position = std::lround(fDesired[i]);
+            position = std::clamp<long>(position, i > 0 ? fPositions[i - 1] + 1 : 1, fCount - 4 + i);
+            fPositions[i] = position;
+            fHeights[i] = fExact[position - 1];
+        }
+        fExact.clear();
+        fExact.shrink_to_fit();
+    }
+
+   public:
+    explicit P2Quantile(double p = 0.5) : fP(p) {
+        double fractions[5] = {0, p / 2, p, (1 + p) / 2, 1};
+        std::copy(fractions, fractions + 5, fFractions);
+    }
+
+    void Add(double x) {
+        if (fCount < kNExact) {
+            fExact.push_back(x);
+            fCount++;
+            return;
+        }
+        if (fCount == kNExact) StartMarkers();
+        fCount++;
+
+        // Cell of the observation, extending the extreme markers if needed
+        int k;
+        if (x < fHeights[0]) {
+            fHeights[0] = x;
+            k = 0;
+        } else if (x >= fHeights[4]) {
+            fHeights[4] = x;
+            k = 3;
+        } else {
+            k = 0;
+            while (x >= fHeights[k + 1]) k++;
+        }
+
+        for (int i = k + 1; i < 5; i++) fPositions[i]++;
+        for (int i = 0; i < 5; i++) fDesired[i] += fFractions[i];
+
+        // Move the middle markers towards their desired positions
+        for (int i = 1; i < 4; i++) {
+            double d = fDesired[i] - fPositions[i];
+            if ((d >= 1 && fPositions[i + 1] - fPositions[i] > 1) || (d <= -1 && fPositions[i - 1] - fPositions[i] < -1)) {
+                int sign = d > 0 ? 1 : -1;
+                double q = Parabolic(i, sign);
+                fHeights[i] = (fHeights[i - 1] < q && q < fHeights[i + 1]) ? q : Linear(i, sign);
+                fPositions[i] += sign;
+            }
+        }
+    }
+
+    double GetProbability() const { return fP; }
+
+    // Estimate of the quantile. Up to kNExact observations it is the exact quantile, interpolated linearly between the
+    // sorted observations at the position p (n - 1)
+    double GetValue() const {
+        if (fCount == 0) return std::numeric_limits<double>::quiet_NaN();
+        if (fCount > kNExact) return fHeights[2];
+
+        std::vector<double> values = fExact;
+        std::sort(values.begin(), values.end());
+        const double position = fP * (fCount - 1);
+        const int low = std::min<int>(position, fCount - 1);
+        const int high = std::min<int>(low + 1, fCount - 1);
+        return values[low] + (position - low) * (values[high] - values[low]);
+    }
+};
+
+// Count, mean, variance (Welford's algorithm), range and quantiles of a stream of values. Non-finite values are skipped
+class RunningStats {
+   private:
+    long fCount = 0;
+    double fMean = 0;
+    double fM2 = 0;  // Sum of the squared deviations from the mean
+    double fMin = std::numeric_limits<double>::infinity();
+    double fMax = -std::numeric_limits<double>::infinity();
+    std::vector<P2Quantile> fQuantiles;
+
+   public:
+    explicit RunningStats(const std::vector<double>& probabilities = {0.16, 0.5, 0.84}) {
+        for (double p : probabilities) fQuantiles.emplace_back(p);
+    }
+
+    void Add(double x) {
+        if (!std::isfinite(x)) return;
+
+        fCount++;
+        double delta = x - fMean;
+        fMean += delta / fCount;
+        fM2 += delta * (x - fMean);
+        fMin = std::min(fMin, x);
+        fMax = std::max(fMax, x);
+        for (auto& quantile : fQuantiles) quantile.Add(x);
+    }
+
+    long GetCount() const { return fCount; }
+    double GetMean() const { return fCount > 0 ? fMean : std::numeric_limits<double>::quiet_NaN(); }
+    double GetVariance() const { return fCount > 1 ? fM2 / (fCount - 1) : 0; }
+    double GetStdDev() const { return std::sqrt(GetVariance()); }
+    double GetMin() const { return fMin; }
+    double GetMax() const { return fMax; }
+    int GetNQuantiles() const { return fQuantiles.size(); }
+    double GetQuantile(int iQuantile) const { return fQuantiles[iQuantile].GetValue(); }
+    double GetProbability(int iQuantile) const { return fQuantiles[iQuantile].GetProbability(); }
+};
+
+}  // namespace sf
+
+#endif
@@ -4,19 +4,35 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <filesystem>
+#include <limits>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "Dawson.h"
+#include "Dual.h"
+#include "Hash.h"
+#include "KooninPratt.h"
+#include "KooninPratt3B.h"
 #include "Observable.h"
+#include "Random.h"
+#include "RunningStats.h"
+#include "ThreadPool.h"
 #include "Riostream.h"
 #include "TF1.h"
+#include "TGraph.h"
 #include "TGraphErrors.h"
 #include "TFormula.h"
 #include "TH1.h"
+#include "TH2D.h"
+#include "TMatrixDSym.h"
 #include "TObject.h"
-#include "gsl/gsl_sf_dawson.h"
+#include "TROOT.h"
 
 #define DEBUG(level, indent, msg, ...)                       \
     do {                                                     \
@@ -32,6 +48,7 @@
 #define TINY std::numeric_limits<double>::min()
 const double FmToNu(5.067731237e-3);
 const double Pi(3.141592653589793);
+const double InvalidChi2(1e30);  // Chi2 of the parameters for which a model is not defined, e.g. negative radii
 const std::complex<double> i(0, 1);
 int colors[12] = {kBlue + 2,   kRed + 1,   kGreen + 3, kMagenta + 2, kCyan + 3, kOrange + 7,
                   kViolet + 3, kAzure + 4, kPink + 4,  kSpring - 7,  kTeal + 2, kGray + 2};
@@ -39,13 +56,83 @@ int colors[12] = {kBlue + 2,   kRed + 1,   kGreen + 3, kMagenta + 2, kCyan + 3,
 namespace sf {
 using parameter = std::tuple<std::string, double, double, double>;
 using func = std::function<double(double*, double*)>;
-}
+using batch_func = std::function<void(const double*, int, const double*, double*)>;  // (x, n, p, out)
+using grad_func = std::function<void(const double*, int, const double*, double*, double*)>;  // (x, n, p, out, jac)
+
+// Fit component: TF1-compatible function and its version evaluated over an array of points
+struct component {
+    std::string name;
+    func fn;
+    batch_func batch;
+    int nPars;
+    std::function<double(double)> shape;  // Unscaled template, empty for analytic functions
+    grad_func grad;  // Values and derivatives wrt the parameters (nPars rows of n values), empty if not available
+    std::vector<int> linear;  // Parameters in which the function is affine, jointly
+    std::string id;  // Identity of the function and its settings, or hash of the template, for the cache of the results
+};
+
+// Operations that can appear in a compiled model
+enum class opcode { kConst, kFunc, kAdd, kSub, kMul, kDiv };
+
+// Single instruction of a compiled model. Everything that depends on the names of the tokens is resolved at compile
+// time, so that the evaluation does not touch any string
+struct instruction {
+    opcode op;
+    double value;  // Literal constant, used by kConst
+    func fn;       // Fit function, used by kFunc
+    batch_func batch;  // Fit function evaluated over an array of points, used by kFunc
+    int offset;    // Index of the first parameter of the fit function, used by kFunc
+    int nPars;     // Number of parameters of the fit function, used by kFunc
+    int component;  // Position of the fit function in the list of components, used by kFunc
+    grad_func grad;  // Fit function and its derivatives, used by kFunc
+};
+
+// Model compiled from its RPN representation: flat list of instructions and depth of the value stack it needs
+struct tape {
+    std::vector<instruction> code;
+    int depth;
+    int nComponents;  // Number of components the model was compiled against
+    int nPars;        // Number of parameters of the model
+};
+
+// Output of each component of a model at the last batch evaluation, together with the parameters used to compute it.
+// Components whose parameters did not change since the last call are not evaluated again
+struct cache {
+    std::vector<std::vector<double>> pars;
+    std::vector<std::vector<double>> values;
+    std::vector<bool> valid;
+
+    void Reset(int nComponents) {
+        pars.assign(nComponents, {});
+        values.assign(nComponents, {});
+        valid.assign(nComponents, false);
+    }
+};
+
+// Points of a dataset that enter the fit, stored as contiguous arrays for the batch evaluation of the model
+struct dataset {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> invErr;  // Inverse of the uncertainties, so that the chi2 needs no division
+    tape model;                  // Compiled model with the templates sampled at the data points
+};
 
-// Definition of variables ---------------------------------------------------------------------------------------------
+// Recipe sampled for drawing, with the parameters and the points used, so that it is sampled again only if they change
+struct drawn_term {
+    std::vector<double> pars;
+    std::vector<double> x;
+    TGraph* graph = nullptr;
+};
+}
 
-// List of TF1-compatible functions that can be used in the fit
-std::vector<std::vector<std::tuple<std::string, sf::func, int>>> functions = {};
+// Maximum depth of the value stack used to evaluate a compiled model
+const int kMaxStackDepth = 64;
 
+// Maximum number of chains in which the points of a scan are split, and minimum number of points in each chain. They
+// do not depend on the number of threads, so that the starting point of each fit, and thus the scan, is the same on
+// any machine
+const int kMaxScanChains = 64;
+const int kMinScanChainLength = 8;
 
 // Utils ---------------------------------------------------------------------------------------------------------------
 
@@ -131,23 +218,24 @@ int GetPrecedence(const std::string& op) {
 // Check if token is an operator
 bool IsOperator(const std::string& token) { return token == "+" || token == "-" || token == "*" || token == "/"; }
 
-// Check if token is a function. "raw" is a special token used for the total fit function
-bool IsFunction(const std::string& token) {
+// Check if token is a function of the given registry. "raw" is a special token used for the total fit function
+bool IsFunction(const std::string& token, const std::vector<std::vector<sf::component>>& functions) {
     for (const auto& functionList : functions) {
-        for (const auto& [name, _, __] : functionList) {
-            if (token == name || token == "raw") return true;
+        for (const auto& component : functionList) {
+            if (token == component.name || token == "raw") return true;
         }
     }
     return false;
 }
 
-// Convert a vector of tokens into Reverse Polish Notation (RPN)
-std::vector<std::string> toRPN(const std::vector<std::string>& tokens) {
+// Convert a vector of tokens into Reverse Polish Notation (RPN), recognizing the functions of the given registry
+std::vector<std::string> toRPN(const std::vector<std::string>& tokens,
+                               const std::vector<std::vector<sf::component>>& functions) {
     std::vector<std::string> output;
     std::stack<std::string> operators;
 
     for (const std::string& token : tokens) {
-        if (isdigit(token[0]) || token[0] == '.' || IsFunction(token)) {
+        if (isdigit(token[0]) || token[0] == '.' || IsFunction(token, functions)) {
             // Numbers go directly to output
             output.push_back(token);
         } else if (token == "(") {
@@ -159,7 +247,7 @@ std::vector<std::string> toRPN(const std::vector<std::string>& tokens) {
                 operators.pop();
             }
             if (!operators.empty()) operators.pop();  // Pop "("
-            if (!operators.empty() && IsFunction(operators.top())) {
+            if (!operators.empty() && IsFunction(operators.top(), functions)) {
                 output.push_back(operators.top());
                 operators.pop();
             }
@@ -185,122 +273,371 @@ std::vector<std::string> toRPN(const std::vector<std::string>& tokens) {
 
 // Fit functions -------------------------------------------------------------------------------------------------------
 
+// The kernels of the fit functions are templated on the type of the parameters, so that they can be evaluated with
+// dual numbers to obtain the exact derivatives with respect to the parameters
+
+// Dawson function
+double Dawson(double x) { return sf::Dawson(x); }
+
+// Dawson function of a dual number, using D'(x) = 1 - 2 x D(x)
+template <int N>
+sf::Dual<N> Dawson(const sf::Dual<N>& x) {
+    double d = sf::Dawson(x.v);
+    return sf::Chain(x, d, 1. - 2. * x.v * d);
+}
+
+// Normalized Gaussian
+template <typename T>
+T GausKernel(double x, const T* p) {
+    const T& norm = p[0];
+    const T& mean = p[1];
+    const T& sigma = p[2];
+
+    T normFactor = norm / (std::sqrt(2 * M_PI) * sigma);
+    T t = (x - mean) / sigma;
+    return normFactor * exp(-0.5 * t * t);
+}
+
 // Normalized Gaussian
-double Gaus(double* x, double* p) {
-    double xx = x[0];
-    double norm = p[0];
-    double mean = p[1];
-    double sigma = p[2];
+double Gaus(double* x, double* p) { return GausKernel(x[0], p); }
+
+// Normalized Gaussian evaluated over an array of points
+void GausBatch(const double* x, int n, const double* p, double* out) {
+    const double normFactor = p[0] / (std::sqrt(2 * M_PI) * p[2]);
+    const double invSigma = 1. / p[2];
+    const double mean = p[1];
+
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+        double t = (x[i] - mean) * invSigma;
+        out[i] = normFactor * std::exp(-0.5 * t * t);
+    }
+}
+
+// Evaluate a TF1-compatible function over an array of points. Used for the components without a native batch version
+sf::batch_func Vectorize(sf::func fn) {
+    return [fn](const double* x, int n, const double* p, double* out) {
+        double* pars = const_cast<double*>(p);
+        for (int i = 0; i < n; i++) {
+            out[i] = fn(const_cast<double*>(x + i), pars);
+        }
+    };
+}
+
+// Evaluate a kernel with N parameters and its derivatives over an array of points, using forward-mode automatic
+// differentiation. The kernel must be callable as kernel(double x, const T* p) both with T = double and T = Dual<N>
+template <int N, typename F>
+sf::grad_func Differentiate(F kernel) {
+    return [kernel](const double* x, int n, const double* p, double* out, double* jac) {
+        sf::Dual<N> pars[N];
+        for (int k = 0; k < N; k++) {
+            pars[k] = sf::Dual<N>::Variable(p[k], k);
+        }
+
+        for (int i = 0; i < n; i++) {
+            sf::Dual<N> value = kernel(x[i], pars);
+            out[i] = value.v;
+            for (int k = 0; k < N; k++) {
+                jac[k * n + i] = value.d[k];
+            }
+        }
+    };
+}
+
+// Polynomial of the given degree and its derivatives, which are the powers of x
+sf::grad_func PolGradient(int degree) {
+    return [degree](const double* x, int n, const double* p, double* out, double* jac) {
+        for (int i = 0; i < n; i++) {
+            double power = 1;
+            double value = 0;
+            for (int k = 0; k <= degree; k++) {
+                value += p[k] * power;
+                jac[k * n + i] = power;
+                power *= x[i];
+            }
+            out[i] = value;
+        }
+    };
+}
+
+// Indeces of the coefficients of a polynomial of the given degree, all of which enter linearly
+std::vector<int> PolCoefficients(int degree) {
+    std::vector<int> coefficients(degree + 1);
+    for (int k = 0; k <= degree; k++) coefficients[k] = k;
+    return coefficients;
+}
+
+// Template scaled by its only parameter, and its derivative which is the unscaled template
+sf::grad_func ScaledGradient(std::function<double(double)> shape) {
+    return [shape](const double* x, int n, const double* p, double* out, double* jac) {
+        for (int i = 0; i < n; i++) {
+            jac[i] = shape(x[i]);
+            out[i] = p[0] * jac[i];
+        }
+    };
+}
+
+// Polynomial of the given degree at x, with the Horner scheme
+inline double Horner(double x, const double* p, int degree) {
+    double value = p[degree];
+    for (int k = degree - 1; k >= 0; k--) value = value * x + p[k];
+    return value;
+}
 
-    double normFactor = norm / (std::sqrt(2 * M_PI) * sigma);
-    double exponent = -0.5 * std::pow((xx - mean) / sigma, 2);
-    return normFactor * std::exp(exponent);
+// Polynomial of the given degree evaluated over an array of points
+sf::batch_func PolBatch(int degree) {
+    return [degree](const double* x, int n, const double* p, double* out) {
+#pragma omp simd
+        for (int i = 0; i < n; i++) {
+            out[i] = Horner(x[i], p, degree);
+        }
+    };
 }
 
 // Polynomial of degree 0
-double Pol0(double* x, double* p) { return p[0]; }
+double Pol0(double* x, double* p) { return Horner(x[0], p, 0); }
 
 // Polynomial of degree 1
-double Pol1(double* x, double* p) { return Pol0(x, p) + p[1] * pow(x[0], 1); }
+double Pol1(double* x, double* p) { return Horner(x[0], p, 1); }
 
 // Polynomial of degree 2
-double Pol2(double* x, double* p) { return Pol1(x, p) + p[2] * pow(x[0], 2); }
+double Pol2(double* x, double* p) { return Horner(x[0], p, 2); }
 
 // Polynomial of degree 3
-double Pol3(double* x, double* p) { return Pol2(x, p) + p[3] * pow(x[0], 3); }
+double Pol3(double* x, double* p) { return Horner(x[0], p, 3); }
 
 // Polynomial of degree 4
-double Pol4(double* x, double* p) { return Pol3(x, p) + p[4] * pow(x[0], 4); }
+double Pol4(double* x, double* p) { return Horner(x[0], p, 4); }
 
 // Polynomial of degree 5
-double Pol5(double* x, double* p) { return Pol4(x, p) + p[5] * pow(x[0], 5); }
+double Pol5(double* x, double* p) { return Horner(x[0], p, 5); }
 
 // Polynomial of degree 6
-double Pol6(double* x, double* p) { return Pol5(x, p) + p[6] * pow(x[0], 6); }
+double Pol6(double* x, double* p) { return Horner(x[0], p, 6); }
 
 // Polynomial of degree 7
-double Pol7(double* x, double* p) { return Pol6(x, p) + p[7] * pow(x[0], 7); }
+double Pol7(double* x, double* p) { return Horner(x[0], p, 7); }
 
 // Polynomial of degree 8
-double Pol8(double* x, double* p) { return Pol7(x, p) + p[8] * pow(x[0], 8); }
+double Pol8(double* x, double* p) { return Horner(x[0], p, 8); }
 
 // Polynomial of degree 9
-double Pol9(double* x, double* p) { return Pol8(x, p) + p[9] * pow(x[0], 9); }
+double Pol9(double* x, double* p) { return Horner(x[0], p, 9); }
+
+// Series sum_k p[k] B_k(t) of Chebyshev (T) or Legendre (P) polynomials, with x in [xMin, xMax] mapped onto t in
+// [-1, 1]. The basis is orthogonal over the fit range, so that its coefficients are much less correlated than the ones
+// of a polynomial in x. The polynomials follow T_{k+1} = 2 t T_k - T_{k-1} and (k+1) P_{k+1} = (2k+1) t P_k - k P_{k-1}
+sf::grad_func OrthogonalGradient(bool legendre, int degree, double xMin, double xMax) {
+    return [=](const double* x, int n, const double* p, double* out, double* jac) {
+        const double scale = 2 / (xMax - xMin);
+        for (int i = 0; i < n; i++) {
+            const double t = (x[i] - xMin) * scale - 1;
+            double previous = 0;
+            double current = 1;
+            double value = 0;
+            for (int k = 0; k <= degree; k++) {
+                value += p[k] * current;
+                if (jac) jac[k * n + i] = current;
+
+                double next = legendre ? ((2 * k + 1) * t * current - k * previous) / (k + 1)
+                                       : (k == 0 ? t : 2 * t * current - previous);
+                previous = current;
+                current = next;
+            }
+            out[i] = value;
+        }
+    };
+}
 
-// Breit Wigner
-double BreitWigner(double* x, double* par) {
-    double kstar = x[0];
+// Series of orthogonal polynomials evaluated over an array of points
+sf::batch_func OrthogonalBatch(bool legendre, int degree, double xMin, double xMax) {
+    auto grad = OrthogonalGradient(legendre, degree, xMin, xMax);
+    return [grad](const double* x, int n, const double* p, double* out) { grad(x, n, p, out, nullptr); };
+}
+
+// Degree of a polynomial component called prefix + degree, e.g. "cheb3", or -1 if the name does not match
+int ParseDegree(const std::string& func, const std::string& prefix) {
+    if (func.size() <= prefix.size() || func.compare(0, prefix.size(), prefix) != 0) return -1;
+    if (!std::all_of(func.begin() + prefix.size(), func.end(), ::isdigit)) return -1;
+    return std::stoi(func.substr(prefix.size()));
+}
 
-    double yield = par[0];
-    double mean = par[1];
-    double gamma = par[2];
+// Breit Wigner, normalized as TMath::BreitWigner
+template <typename T>
+T BreitWignerKernel(double kstar, const T* par) {
+    const T& yield = par[0];
+    const T& mean = par[1];
+    const T& gamma = par[2];
 
-    return yield * TMath::BreitWigner(kstar, mean, gamma);
+    return yield * gamma / ((kstar - mean) * (kstar - mean) + 0.25 * gamma * gamma) / (2 * Pi);
 }
 
-// General Lednicky
-double GeneralLednicky(double kstar, const double& GaussR, const complex<double>& a0, const double& effRange) {
-    // printf("led\n");
-    // Taken from
-    // https://github.com/dimihayl/DLM/blob/c40f03eac38006f89eac8e5fa1533c9e48f2b455/CATS_Extentions/DLM_CkModels.cpp#L215
-    if (GaussR != GaussR) {
-        printf(
-            "\033[1;33mWARNING:\033[0m GeneralLednicky got a bad value for the Radius (nan). Returning default value "
-            "of 1.\n");
-        exit(1);
-        return 1;
-    }
+// Breit Wigner
+double BreitWigner(double* x, double* par) { return BreitWignerKernel(x[0], par); }
 
-    kstar *= 1000;                   // change units to GeV/c
-    kstar = std::max(kstar, 1.e-6);  // avoid problems with k* = 0
+// Relative momentum of the Lednicky model in MeV/c, away from k* = 0 where the source terms are singular
+inline double LednickyMomentum(double kstar) { return std::max(kstar * 1000, 1.e-6); }
 
-    const double Radius = GaussR * FmToNu;
-    const complex<double> IsLen1 = 1. / (a0 * FmToNu + 1e-64);
-    const double eRan1 = effRange * FmToNu;
+// Scattering amplitude of the Lednicky model, f(k*) = 1 / (1/a0 + d0 k*^2 / 2 - i k*) in natural units. It does not
+// depend on the source, so it is computed once per k* and shared by all the radii
+template <typename T>
+struct LednickyAmplitude {
+    T re;
+    T im;
+    T norm2;     // |f(k*)|^2
+    T effRange;  // Effective range in natural units
+};
+
+// The complex arithmetic is written in terms of real and imaginary parts, so that the parameters can carry derivatives
+template <typename T>
+LednickyAmplitude<T> ComputeLednickyAmplitude(double kstar, const T& a0Re, const T& a0Im, const T& effRange) {
+    const T eRan1 = effRange * FmToNu;
+
+    // Inverse of the scattering length
+    const T a0ReNu = a0Re * FmToNu + 1e-64;
+    const T a0ImNu = a0Im * FmToNu;
+    const T a0Norm2 = a0ReNu * a0ReNu + a0ImNu * a0ImNu;
+    const T IsLen1Re = a0ReNu / a0Norm2;
+    const T IsLen1Im = -a0ImNu / a0Norm2;
+
+    const T denRe = IsLen1Re + 0.5 * eRan1 * kstar * kstar;
+    const T denIm = IsLen1Im - kstar;
+    const T denNorm2 = denRe * denRe + denIm * denIm;
+    return {denRe / denNorm2, -denIm / denNorm2, 1. / denNorm2, eRan1};
+}
+
+// Correlation of a Gaussian source with radius GaussR in fm, minus 1. The momentum is in MeV/c
+template <typename T>
+T LednickyGaussTerm(double kstar, const LednickyAmplitude<T>& f, const T& GaussR) {
+    const T Radius = GaussR * FmToNu;
+    const T arg = 2. * kstar * Radius;
+    T F1 = Dawson(arg) / arg;
+    T F2 = (1. - exp(-arg * arg)) / arg;
+
+    return 0.5 * f.norm2 / (Radius * Radius) * (1. - f.effRange / (2 * sqrt(Pi) * Radius)) +
+           2 * f.re * F1 / (sqrt(Pi) * Radius) - f.im * F2 / Radius;
+}
 
-    double F1 = gsl_sf_dawson(2. * kstar * Radius) / (2. * kstar * Radius);
-    double F2 = (1. - exp(-4. * kstar * kstar * Radius * Radius)) / (2. * kstar * Radius);
-    complex<double> ScattAmplSin = pow(IsLen1 + 0.5 * eRan1 * kstar * kstar - i * kstar, -1.);
+// General Lednicky. Radii that are not positive, including NaN, give NaN, which the chi2 reports to the minimizer as an
+// invalid point
+template <typename T>
+T GeneralLednickyKernel(double kstar, const T& GaussR, const T& a0Re, const T& a0Im, const T& effRange) {
+    // Taken from
+    // https://github.com/dimihayl/DLM/blob/c40f03eac38006f89eac8e5fa1533c9e48f2b455/CATS_Extentions/DLM_CkModels.cpp#L215
+    if (!(sf::Value(GaussR) > 0)) return std::numeric_limits<double>::quiet_NaN();
 
-    double CkValue = 0.;
-    CkValue += 0.5 * pow(abs(ScattAmplSin) / Radius, 2) * (1. - (eRan1) / (2 * sqrt(Pi) * Radius)) +
-               2 * real(ScattAmplSin) * F1 / (sqrt(Pi) * Radius) - imag(ScattAmplSin) * F2 / Radius;
-    CkValue += 1;
+    kstar = LednickyMomentum(kstar);
+    auto f = ComputeLednickyAmplitude(kstar, a0Re, a0Im, effRange);
+    return LednickyGaussTerm(kstar, f, GaussR) + 1.;
+}
 
-    return CkValue;
+// General Lednicky
+double GeneralLednicky(double kstar, const double& GaussR, const complex<double>& a0, const double& effRange) {
+    return GeneralLednickyKernel(kstar, GaussR, a0.real(), a0.imag(), effRange);
 }
 
 // Lednicky
-double Lednicky(double* x, double* par) {
+template <typename T>
+T LednickyKernel(double kStar, const T* par) {
     // Taken from
     // https://github.com/dimihayl/DLM/blob/c40f03eac38006f89eac8e5fa1533c9e48f2b455/CATS_Extentions/DLM_CkModels.cpp#L504C8-L504C53
-    double kStar = x[0];
-    double potPar0 = par[0];     // real part of the scattering length
-    double potPar1 = par[1];     // imaginary part of the scattering length
-    double potPar2 = par[2];     // effective range
-    double sourcePar0 = par[3];  // radius of the first gaussian
-    double sourcePar1 = par[4];  // radius of the second gaussian
-    double sourcePar2 = par[5];  // relative weight of the two gaussians
-    double sourcePar3 = par[6];  // normalization of the gaussians
-    complex<double> ScatLen(potPar0, potPar1);
+    const T& potPar0 = par[0];     // real part of the scattering length
+    const T& potPar1 = par[1];     // imaginary part of the scattering length
+    const T& potPar2 = par[2];     // effective range
+    const T& sourcePar0 = par[3];  // radius of the first gaussian
+    const T& sourcePar1 = par[4];  // radius of the second gaussian
+    const T& sourcePar2 = par[5];  // relative weight of the two gaussians
+    const T& sourcePar3 = par[6];  // normalization of the gaussians
+
+    if (!(sf::Value(sourcePar0) > 0) || !(sf::Value(sourcePar1) > 0)) return std::numeric_limits<double>::quiet_NaN();
+
+    const double kstar = LednickyMomentum(kStar);
+    auto f = ComputeLednickyAmplitude(kstar, potPar0, potPar1, potPar2);
+    T ll1 = LednickyGaussTerm(kstar, f, sourcePar0) + 1.;
+    T ll2 = LednickyGaussTerm(kstar, f, sourcePar1) + 1.;
+    return sourcePar3 * (sourcePar2 * ll1 + (1. - sourcePar2) * ll2) + 1. - sourcePar3;
+}
 
-    double ll1 = GeneralLednicky(kStar, sourcePar0, ScatLen, potPar2);
-    double ll2 = GeneralLednicky(kStar, sourcePar1, ScatLen, potPar2);
-    return sourcePar3 * (sourcePar2 * ll1 + (1 - sourcePar2) * ll2) + 1. - sourcePar3;
+// Lednicky
+double Lednicky(double* x, double* par) { return LednickyKernel(x[0], par); }
+
+// Lednicky evaluated over an array of points. The amplitude is computed once per k* for both radii, and the factors of
+// each radius that do not depend on k* once per call
+void LednickyBatch(const double* x, int n, const double* par, double* out) {
+    if (!(par[3] > 0) || !(par[4] > 0)) {
+        std::fill(out, out + n, std::numeric_limits<double>::quiet_NaN());
+        return;
+    }
+
+    const double a0Re = par[0];
+    const double a0Im = par[1];
+    const double effRange = par[2];
+    const double radius[2] = {par[3] * FmToNu, par[4] * FmToNu};
+    const double weight[2] = {par[5] * par[6], (1. - par[5]) * par[6]};
+
+    // Terms of each radius that do not depend on k*
+    double coeff0[2], coeff1[2], coeff2[2];
+    for (int iR = 0; iR < 2; iR++) {
+        coeff0[iR] = 0.5 / (radius[iR] * radius[iR]) * (1. - effRange * FmToNu / (2 * std::sqrt(Pi) * radius[iR]));
+        coeff1[iR] = 2 / (std::sqrt(Pi) * radius[iR]);
+        coeff2[iR] = 1 / radius[iR];
+    }
+
+    for (int i = 0; i < n; i++) {
+        const double kstar = LednickyMomentum(x[i]);
+        const auto f = ComputeLednickyAmplitude(kstar, a0Re, a0Im, effRange);
+
+        double cf = 1;
+        for (int iR = 0; iR < 2; iR++) {
+            const double arg = 2. * kstar * radius[iR];
+            const double F1 = sf::Dawson(arg) / arg;
+            const double F2 = (1. - std::exp(-arg * arg)) / arg;
+            cf += weight[iR] * (coeff0[iR] * f.norm2 + coeff1[iR] * f.re * F1 - coeff2[iR] * f.im * F2);
+        }
+        out[i] = cf;
+    }
 }
 
 // Class for advanced fitting ------------------------------------------------------------------------------------------
+class ParallelChi2;
+
 class SuperFitter : public TObject {
    private:
     std::vector<Observable*> fObsOrig;                 // Original observable to be drawn
     std::vector<Observable*> fObs;                     // Observable to be fitted. Includes the uncertainties of the model
     std::vector<TF1*> fFit;                            // Total fit function
+    std::vector<std::vector<sf::component>> fFunctions;  //! Components that can be used in each fit model
+    std::vector<sf::tape> fModels;                     //! Compiled fit models
+    std::vector<std::string> fModelExpressions;        // Fit models as given by the user
     std::vector<std::vector<sf::parameter>> fPars;     // List of fit pars: (name, init, min, max)
-    std::vector<TF1*> fTerms;                          // Each function to be drawn
+    std::vector<TGraph*> fTerms;                       //! Terms drawn by the last call of Draw, owned by the cache
+    std::map<std::pair<int, std::string>, sf::drawn_term> fDrawCache;  //! Sampled recipes, by fit and recipe
+    int fDrawNpx = 1000;                               // Number of points at which the terms are drawn
+    std::string fCacheDirectory;                       // Directory of the cached fit results, empty to always fit
     std::vector<std::pair<double, double>> fFitRange;  // Fit range as the union of different intervals
-    std::map<std::string, int> fParIndeces;            // Indeces of parameters for combined fit
+    std::unordered_map<std::string, int> fParIndeces;  //! Global index of each independent parameter, by name
+    std::vector<std::vector<int>> fGlobalIndeces;      //! Global index of the parameters of each fit
+    std::vector<std::pair<int, int>> fFirstOccurrences;  //! Fit and position where each independent parameter appears first
+    bool fVariableProjection = false;                  // Eliminate the linear parameters before the full fit
+    std::unordered_map<std::string, std::pair<double, double>> fStartingPoint;  //! Initial value and step by name
+    int fMultiStart = 0;                               // Number of starting points of the multi-start search
+    int fMultiStartPolish = 3;                         // Number of candidates polished by the multi-start search
+    int fMultiStartCalls = 0;                          // Budget of the short fits, 0 for 50 calls per free parameter
+    unsigned long fMultiStartSeed = 0;                 // Seed of the starting points of the multi-start search
     double fDrawRangeMin;                              // Draw range minimum
     double fDrawRangeMax;                              // Draw range maximum
+    TMatrixDSym fCovariance;                           // Covariance matrix of the parameters of the last fit
+    std::vector<std::string> fParNames;                // Names of the independent parameters of the last fit
+    std::vector<double> fParameters;                   // Values of the independent parameters after the last fit
+    std::vector<double> fParErrors;                    // Uncertainties of the independent parameters after the last fit
+    double fChi2 = 0;                                  // Chi2 of the last fit
+    int fNdf = 0;                                      // Number of degrees of freedom of the last fit
+    int fStatus = -1;                                  // Status of the minimizer in the last fit
+    int fNCalls = 0;                                   // Number of evaluations of the chi2 in the last fit
+    std::vector<std::vector<double>> fBootstrapPars;   //! Independent parameters fitted to each bootstrap replica
+    std::vector<int> fBootstrapStatus;                 //! Status of the minimizer for each bootstrap replica
+    std::vector<std::vector<double>> fScanPars;        //! Independent parameters at each point of the last scan
+    std::vector<int> fScanStatus;                      //! Status of the minimizer at each point of the last scan
 
    public:
     // Empty Contructor
@@ -311,6 +648,9 @@ class SuperFitter : public TObject {
 
     bool IsInFitRange(double x);
 
+    // Mask of the bins whose centre is in one of the fit ranges, edges included
+    std::vector<bool> GetBinMask(TH1* hist);
+
     bool IsParameterPresent(std::string name);
 
     // SetModel
@@ -319,9 +659,102 @@ class SuperFitter : public TObject {
     // Fit
     void Fit(const char* opt = "");
 
+    // Keep the results of the fits in a directory, keyed by the hash of their inputs, so that fitting again the same
+    // inputs restores the result instead of running the minimizer
+    void SetCacheDirectory(std::string directory) { this->fCacheDirectory = directory; }
+
+    // Content hash of everything that determines the result of the fit: data, components, models, parameters, ranges
+    // and options
+    uint64_t HashInputs(const char* opt = "");
+
+    // Store and restore the result of the last fit
+    void SaveResult(std::string fileName);
+    bool LoadResult(std::string fileName);
+
+    // Data points of each fit, with the templates sampled at their positions
+    std::vector<sf::dataset> PrepareData();
+
+    // Settings of the independent parameters and of the minimizer
+    void ConfigureParameters(ROOT::Fit::FitConfig& config);
+
+    // Minimize the chi2 of the given data with the given settings, quietly and in the calling thread
+    ROOT::Fit::FitResult Minimize(const std::vector<sf::dataset>& data, const ROOT::Fit::FitConfig& config);
+
+    // Refit replicas of the observables resampled bin by bin with "gaus" or "poisson" fluctuations, starting from the
+    // result of the last fit. In "poisson" mode, the bins that are not positive get "gaus" fluctuations. The replicas
+    // are fitted in parallel and are reproducible for a given seed
+    void Bootstrap(int nReplicas, std::string mode = "gaus", unsigned long seed = 0);
+
+    // Results of the last bootstrap, for the independent parameters in the order of their first appearance
+    std::vector<std::vector<double>> GetBootstrapParameters() { return this->fBootstrapPars; }
+    std::vector<int> GetBootstrapStatus() { return this->fBootstrapStatus; }
+
+    // Band of the fit function over the bins of the observable: mean and standard deviation of the converged replicas
+    TH1D* GetBootstrapBand(int iFit);
+
+    // Chi2 profiled over a list of points in the space of some parameters: at each point they are fixed and the others
+    // are minimized. The points are split into contiguous chains fitted in parallel, whose number depends only on the
+    // number of points, and each point starts from the result of the previous one in its chain, so that neighbouring
+    // points should be listed next to each other
+    std::vector<double> Scan(std::vector<std::string> names, std::vector<std::vector<double>> points);
+
+    // Scan over the grid of the given values of each parameter. The chi2 is returned in row-major order, with the
+    // values of the last parameter changing fastest
+    std::vector<double> ScanGrid(std::vector<std::string> names, std::vector<std::vector<double>> axes);
+
+    // Map of the chi2 at the bin centres of a two-dimensional grid
+    TH2D* ScanMap(std::string xName, int nX, double xMin, double xMax, std::string yName, int nY, double yMin,
+                  double yMax);
+
+    // Results of the last scan, for the independent parameters in the order of their first appearance
+    std::vector<std::vector<double>> GetScanParameters() { return this->fScanPars; }
+    std::vector<int> GetScanStatus() { return this->fScanStatus; }
+
+    // Eliminate the linear parameters by least squares before the fit of all the parameters (variable projection)
+    void SetVariableProjection(bool enable = true) { this->fVariableProjection = enable; }
+
+    // Search the global minimum before the fit: short fits from nStarts points spread over the parameter limits with a
+    // Latin hypercube, of which the best nPolish distinct ones are fitted to convergence. The best of them is the
+    // starting point of the fit. maxCalls is the budget of each short fit, 0 for 50 calls per free parameter
+    void SetMultiStart(int nStarts, int nPolish = 3, int maxCalls = 0, unsigned long seed = 0) {
+        if (nPolish < 1) {
+            throw std::invalid_argument("The multi-start search needs at least one minimum to polish");
+        }
+        this->fMultiStart = nStarts;
+        this->fMultiStartPolish = nPolish;
+        this->fMultiStartCalls = maxCalls;
+        this->fMultiStartSeed = seed;
+    }
+
+    // Set the parameters of the configuration to the best minimum found by the multi-start search
+    void MultiStart(const std::vector<sf::dataset>& data, ROOT::Fit::FitConfig& config);
+
+    // Start the fit from the given values and steps instead of the initial values of the parameters, e.g. from the
+    // result of a similar fit. Parameters that are not listed, fixed, or whose value is outside the limits keep their
+    // initial settings
+    void SetStartingPoint(const std::vector<std::string>& names, const std::vector<double>& values,
+                          const std::vector<double>& steps) {
+        this->fStartingPoint.clear();
+        for (size_t iPar = 0; iPar < names.size(); iPar++) {
+            this->fStartingPoint[names[iPar]] = {values[iPar], steps[iPar]};
+        }
+    }
+
+    // Minimize the chi2 wrt the nonlinear parameters only
+    void ProjectLinearParameters(ROOT::Fit::FitConfig& config, const std::vector<sf::dataset>& data,
+                                 const std::vector<std::vector<int>>& iPars,
+                                 const ROOT::Math::IMultiGradFunction& chi2);
+
+    // Covariance matrix from the Hessian computed in parallel at the minimum
+    bool ComputeCovariance(const ParallelChi2& chi2, const ROOT::Fit::FitResult& result,
+                           const ROOT::Fit::FitConfig& config, bool useGradient);
+
     // Add fit component
     void Add(int idx, std::string name, std::string func, std::vector<sf::parameter> pars);
 
+    // Add Koonin-Pratt correlation function, e.g. kp_gauss or kp3_gauss, with |psi|^2 read from a file
+    void Add(int idx, std::string name, std::string func, std::string wfFile, std::vector<sf::parameter> pars);
+
     // Add template function
     void Add(int idx, std::string name, TH1* hTemplate, std::vector<sf::parameter> pars);
 
@@ -331,6 +764,12 @@ class SuperFitter : public TObject {
     // Add TF1 function
     void Add(int idx, std::string name, TF1* fTemplate, std::vector<sf::parameter> pars, double unitMult);
 
+    // Number of points of the grid over the draw range at which the terms are sampled
+    void SetDrawNpx(int npx) { this->fDrawNpx = npx; }
+
+    // Terms of a fit sampled over the draw range, named gTerm<fit>_<position of the recipe>
+    std::vector<TGraph*> SampleRecipes(int iFit, const std::vector<std::string>& recipes);
+
     // Draw
     void Draw(int iFit, std::vector<std::pair<std::string, std::string>> recipes, std::string dataLabel="Data", std::string legHeader="");
 
@@ -353,38 +792,59 @@ class SuperFitter : public TObject {
         this->fDrawRangeMax = xMax;
     }
 
+    // Build the tables of the independent parameters for the combined fit
+    void IndexParameters();
+
     int GetN();
     int GetNShared();
     int GetNIndependent();
     int GetNIndependent(int iFit);
     std::vector<double> GetInitialParameters();
 
+    // Covariance matrix of the independent parameters of the last fit, in the order of their first appearance
+    TMatrixDSym GetCovarianceMatrix() { return this->fCovariance; }
+
+    // Results of the last fit, for the independent parameters in the order of their first appearance
+    std::vector<std::string> GetParameterNames() { return this->fParNames; }
+    std::vector<double> GetParameters() { return this->fParameters; }
+    std::vector<double> GetParErrors() { return this->fParErrors; }
+    double GetChi2() { return this->fChi2; }
+    int GetNdf() { return this->fNdf; }
+    int GetStatus() { return this->fStatus; }
+    int GetNCalls() { return this->fNCalls; }
+
     TF1* GetFitFunction(int idx = 0) { return this->fFit[idx]; }
+    sf::tape CompileRecipe(int idx, std::string recipe);
     TH1D* GetGenuineCF(int idx, std::string recipe);
-    std::vector<TF1*> GetTerms() { return this->fTerms; }
+    std::vector<double> GetGenuineCFValues(int idx, std::string recipe);
+    std::vector<TGraph*> GetTerms() { return this->fTerms; }
 
-    ClassDef(SuperFitter, 2)
+    ClassDef(SuperFitter, 3)
 };
 
-// Destructor
+// Destructor. The fit functions and the copies of the observables are owned by the fitter, while Draw draws copies of
+// them, so that the canvases remain valid after the fitter is deleted
 SuperFitter::~SuperFitter() {
+    for (auto fit : fFit) delete fit;
+    for (auto obs : fObsOrig) delete obs;
+    for (auto& [key, term] : fDrawCache) delete term.graph;
     fTerms.clear();
-    functions.clear();
 };
 
 // Check if value is in fit range
 bool SuperFitter::IsInFitRange(double x) {
-    return true;
     for (const auto& [xMin, xMax] : this->fFitRange) {
-        if (xMin < x && x < xMax) {
+        if (xMin <= x && x <= xMax) {
             return true;
         }
     }
     return false;
 }
 
-// Checks if a parameter is already known to the fitter (in case of combined fit)
+// Checks if a parameter is already known to the fitter (in case of combined fit). Shared parameters are listed in
+// each fit that uses them, and are merged when the table of the independent parameters is built
 bool SuperFitter::IsParameterPresent(std::string name) {
+    IndexParameters();
     auto it = this->fParIndeces.find(name);
 
     if (it != this->fParIndeces.end()) {
@@ -396,7 +856,7 @@ bool SuperFitter::IsParameterPresent(std::string name) {
 
 // Add fit component
 void SuperFitter::Add(int idx, std::string name, std::string func, std::vector<sf::parameter> pars) {
-    if (idx > functions.size()) {
+    if (idx > fFunctions.size()) {
         throw std::invalid_argument("Index is larger than current length of the function list.");
     }
 
@@ -404,8 +864,8 @@ void SuperFitter::Add(int idx, std::string name, std::string func, std::vector<s
         throw std::invalid_argument("Index is larger than current length of the parameter list.");
     }
 
-    if (idx == functions.size()) {
-        functions.push_back({});
+    if (idx == fFunctions.size()) {
+        fFunctions.push_back({});
     }
 
     if (idx == fPars.size()) {
@@ -413,43 +873,138 @@ void SuperFitter::Add(int idx, std::string name, std::string func, std::vector<s
     }
 
     if (func == "pol0") {
-        functions[idx].push_back({name, Pol0, 1});
+        fFunctions[idx].push_back({name, Pol0, PolBatch(0), 1, nullptr, PolGradient(0), PolCoefficients(0)});
     } else if (func == "pol1") {
-        functions[idx].push_back({name, Pol1, 2});
+        fFunctions[idx].push_back({name, Pol1, PolBatch(1), 2, nullptr, PolGradient(1), PolCoefficients(1)});
     } else if (func == "pol2") {
-        functions[idx].push_back({name, Pol2, 3});
+        fFunctions[idx].push_back({name, Pol2, PolBatch(2), 3, nullptr, PolGradient(2), PolCoefficients(2)});
     } else if (func == "pol3") {
-        functions[idx].push_back({name, Pol3, 4});
+        fFunctions[idx].push_back({name, Pol3, PolBatch(3), 4, nullptr, PolGradient(3), PolCoefficients(3)});
     } else if (func == "pol4") {
-        functions[idx].push_back({name, Pol4, 5});
+        fFunctions[idx].push_back({name, Pol4, PolBatch(4), 5, nullptr, PolGradient(4), PolCoefficients(4)});
     } else if (func == "pol5") {
-        functions[idx].push_back({name, Pol5, 6});
+        fFunctions[idx].push_back({name, Pol5, PolBatch(5), 6, nullptr, PolGradient(5), PolCoefficients(5)});
     } else if (func == "pol6") {
-        functions[idx].push_back({name, Pol6, 7});
+        fFunctions[idx].push_back({name, Pol6, PolBatch(6), 7, nullptr, PolGradient(6), PolCoefficients(6)});
     } else if (func == "pol7") {
-        functions[idx].push_back({name, Pol7, 8});
+        fFunctions[idx].push_back({name, Pol7, PolBatch(7), 8, nullptr, PolGradient(7), PolCoefficients(7)});
     } else if (func == "pol8") {
-        functions[idx].push_back({name, Pol8, 9});
+        fFunctions[idx].push_back({name, Pol8, PolBatch(8), 9, nullptr, PolGradient(8), PolCoefficients(8)});
     } else if (func == "pol9") {
-        functions[idx].push_back({name, Pol9, 10});
+        fFunctions[idx].push_back({name, Pol9, PolBatch(9), 10, nullptr, PolGradient(9), PolCoefficients(9)});
+    } else if (int degree = std::max(ParseDegree(func, "cheb"), ParseDegree(func, "legendre")); degree >= 0) {
+        if (fFitRange.empty()) {
+            throw std::invalid_argument("Function " + func + " with name " + name +
+                                        " needs the fit range to be set first");
+        }
+
+        // The polynomials are defined over the hull of the fit range set when they are added
+        double xMin = fFitRange[0].first;
+        double xMax = fFitRange[0].second;
+        for (const auto& [low, high] : fFitRange) {
+            xMin = std::min(xMin, low);
+            xMax = std::max(xMax, high);
+        }
+
+        auto batch = OrthogonalBatch(func[0] == 'l', degree, xMin, xMax);
+        auto fn = [batch](double* x, double* p) {
+            double value;
+            batch(x, 1, p, &value);
+            return value;
+        };
+        fFunctions[idx].push_back({name, fn, batch, degree + 1, nullptr,
+                                   OrthogonalGradient(func[0] == 'l', degree, xMin, xMax), PolCoefficients(degree),
+                                   Form("%s[%.17g, %.17g]", func.data(), xMin, xMax)});
     } else if (func == "gaus") {
-        functions[idx].push_back({name, Gaus, 3});
+        fFunctions[idx].push_back(
+            {name, Gaus, GausBatch, 3, nullptr, Differentiate<3>([](double x, const auto* p) { return GausKernel(x, p); }), {0}});
     } else if (func == "breit_wigner") {
-        functions[idx].push_back({name, BreitWigner, 3});
+        fFunctions[idx].push_back({name, BreitWigner, Vectorize(BreitWigner), 3, nullptr,
+                                  Differentiate<3>([](double x, const auto* p) { return BreitWignerKernel(x, p); }), {0}});
     } else if (func == "lednicky") {
-        functions[idx].push_back({name, Lednicky, 7});
+        fFunctions[idx].push_back({name, Lednicky, LednickyBatch, 7, nullptr,
+                                  Differentiate<7>([](double x, const auto* p) { return LednickyKernel(x, p); }), {6}});
     } else {
         throw std::runtime_error("Function " + func + " with name " + name + " is not implemented");
     }
 
+    if (int nPars = fFunctions[idx].back().nPars; pars.size() != nPars) {
+        fFunctions[idx].pop_back();
+        throw std::invalid_argument("Function " + func + " with name " + name + " needs " + std::to_string(nPars) +
+                                    " parameters");
+    }
+    if (fFunctions[idx].back().id.empty()) fFunctions[idx].back().id = func;
+
     // Save fit settings
     printf("Adding '%s' function with parameters:\n", name.data());
     for (const auto& par : pars) {
         auto [name, centr, min, max] = par;
         printf("    name: %s   init: %.3f   min: %.3f   max: %.3f\n", name.data(), centr, min, max);
-        if (!IsParameterPresent(name)) {
-            this->fPars[idx].push_back(par);
-        }
+        this->fPars[idx].push_back(par);
+    }
+};
+
+// Add Koonin-Pratt correlation function
+void SuperFitter::Add(int idx, std::string name, std::string func, std::string wfFile,
+                      std::vector<sf::parameter> pars) {
+    if (idx > fFunctions.size()) {
+        throw std::invalid_argument("Index is larger than current length of the function list.");
+    }
+
+    if (idx > fPars.size()) {
+        throw std::invalid_argument("Index is larger than current length of the parameter list.");
+    }
+
+    if (idx == fFunctions.size()) {
+        fFunctions.push_back({});
+    }
+
+    if (idx == fPars.size()) {
+        fPars.push_back({});
+    }
+
+    // Evaluation of the values and, if jac is not null, of the derivatives over an array of momenta
+    sf::grad_func evaluate;
+    int nPars;
+    if (func == "kp_gauss") {
+        auto kp = std::make_shared<sf::KooninPratt>(sf::WaveFunctionTable::Load(wfFile), sf::GaussSource, 1);
+        evaluate = [kp](const double* x, int n, const double* p, double* out, double* jac) {
+            kp->Evaluate(x, n, p, out, jac);
+        };
+        nPars = kp->GetNPars();
+    } else if (func == "kp3_gauss" || func == "kp3_gauss_pairwise") {
+        // The pairwise version builds the three-body |Psi|^2 from a two-body table
+        auto kp = std::make_shared<sf::KooninPratt3B>(
+            sf::WaveFunction3BTable::Load(wfFile, func == "kp3_gauss_pairwise"));
+        evaluate = [kp](const double* x, int n, const double* p, double* out, double* jac) {
+            kp->Evaluate(x, n, p, out, jac);
+        };
+        nPars = kp->GetNPars();
+    } else {
+        throw std::runtime_error("Function " + func + " with name " + name + " is not implemented");
+    }
+
+    if (pars.size() != nPars) {
+        throw std::invalid_argument("Function " + func + " with name " + name + " needs " + std::to_string(nPars) +
+                                    " parameters");
+    }
+
+    auto batch = [evaluate](const double* x, int n, const double* p, double* out) {
+        evaluate(x, n, p, out, nullptr);
+    };
+    auto fn = [evaluate](double* x, double* p) {
+        double value;
+        evaluate(x, 1, p, &value, nullptr);
+        return value;
+    };
+    fFunctions[idx].push_back({name, fn, batch, nPars, nullptr, evaluate, {}, func + ":" + wfFile});
+
+    // Save fit settings
+    printf("Adding '%s' function with parameters:\n", name.data());
+    for (const auto& par : pars) {
+        auto [name, centr, min, max] = par;
+        printf("    name: %s   init: %.3f   min: %.3f   max: %.3f\n", name.data(), centr, min, max);
+        this->fPars[idx].push_back(par);
     }
 };
 
@@ -476,203 +1031,1417 @@ void ProcessOperatorToken(std::stack<double> &stack, std::string token) {
 }
 
 // Get index of function with a given name
-int GetIndex(std::vector<std::tuple<std::string, sf::func, int>> funcs, std::string name) {
+int GetIndex(const std::vector<sf::component>& funcs, const std::string& name) {
     int counter = 0;
-    for (const auto& [fn, _, __] : funcs) {
-        if (fn == name) break;
+    for (const auto& component : funcs) {
+        if (component.name == name) break;
         counter++;
     }
     return counter;
 }
 
 // Compute how many parameters should be skipped
-int ComputeOffset(std::vector<std::tuple<std::string, sf::func, int>> funcs, int counter) {
+int ComputeOffset(const std::vector<sf::component>& funcs, int counter) {
     int offset = 0;
     for (int iFunc = 0; iFunc < counter; iFunc++) {
-        offset += std::get<2>(funcs[iFunc]);
+        offset += funcs[iFunc].nPars;
     }
     return offset;
 }
 
-// SetModel
-void SuperFitter::SetModel(int idx, std::string model) {
-    // Tokenization of the model
-    auto tokens = Tokenize(model);
-    DEBUG(50, 0, "Expression in infix: %s", join(" ", tokens).data());
-
-    // Convert to Reverse Polish Notation
-    auto rpn = toRPN(tokens);
-    DEBUG(50, 0, "Expression in RPN: %s", join(" ", rpn).data());
-
-    // The following lambda evaluates the fit function
-    auto lambda = [this, rpn, idx](double* x, double* p) -> double {
-        std::stack<double> stack;
-
-        DEBUG(51, 0, "Compute fit function from RPN: '%s'", join(" ", rpn).data());
-        for (const std::string& token : rpn) {
-            DEBUG(52, 1, "Start processing the token '%s'", token.data());
-            if (stack.size() == 0) {
-                DEBUG(53, 1, "Stack is empty");
-            } else {
-                DEBUG(53, 1, "Stack is: '%s'", join(" ", stack_to_vector(stack)).data());
-            }
-            if (isdigit(token[0]) || token[0] == '.') {
-                DEBUG(53, 2, "Token '%s' is a number", token.data());
-                // Push numbers
-                stack.push(std::stod(token));
-            } else if (IsFunction(token)) {
-                int counter = GetIndex(functions[idx], token);
-                int offset = ComputeOffset(functions[idx], counter);
-                auto func = std::get<1>(functions[idx][counter]);
-
-                DEBUG(53, 2, "Function '%s' at pos: %d ==> Skipping %d parameters", token.data(), counter, offset);
-                stack.push(func(x, p + offset));
-            } else if (IsOperator(token)) {
-                ProcessOperatorToken(stack, token);
-            } else {
-                DEBUG(53, 2, "Token '%s' is unknown", token.data());
-                throw std::runtime_error("Unknown token: " + token);
+// Compile an expression in RPN into a tape. Function lookups, parameter offsets and number parsing are done here once
+sf::tape Compile(const std::vector<std::string>& rpn, const std::vector<sf::component>& funcs) {
+    sf::tape tape = {{}, 0, (int)funcs.size(), ComputeOffset(funcs, funcs.size())};
+    int depth = 0;
+    for (const std::string& token : rpn) {
+        sf::instruction instr = {sf::opcode::kConst, 0, nullptr, nullptr, 0, 0, 0, nullptr};
+        if (isdigit(token[0]) || token[0] == '.') {
+            instr.value = std::stod(token);
+            depth++;
+        } else if (IsOperator(token)) {
+            if (depth < 2) throw std::runtime_error("Insufficient arguments for operator");
+            if (token == "+")
+                instr.op = sf::opcode::kAdd;
+            else if (token == "-")
+                instr.op = sf::opcode::kSub;
+            else if (token == "*")
+                instr.op = sf::opcode::kMul;
+            else
+                instr.op = sf::opcode::kDiv;
+            depth--;
+        } else {
+            int counter = GetIndex(funcs, token);
+            if (counter == funcs.size()) {
+                throw std::runtime_error("Function '" + token + "' is not defined for this fit");
             }
-            DEBUG(52, 1, "Stack after processing the token: '%s'", join(" ", stack_to_vector(stack)).data());
+            instr.op = sf::opcode::kFunc;
+            instr.fn = funcs[counter].fn;
+            instr.batch = funcs[counter].batch;
+            instr.grad = funcs[counter].grad;
+            instr.offset = ComputeOffset(funcs, counter);
+            instr.nPars = funcs[counter].nPars;
+            instr.component = counter;
+            DEBUG(53, 1, "Function '%s' at pos: %d ==> Skipping %d parameters", token.data(), counter, instr.offset);
+            depth++;
         }
 
-        DEBUG(51, 0, "End of evaluation, return value is: '%s'", join(" ", stack_to_vector(stack)).data());
+        tape.depth = std::max(tape.depth, depth);
+        if (tape.depth > kMaxStackDepth) throw std::runtime_error("Expression is too deep to be evaluated");
+        tape.code.push_back(instr);
+    }
 
-        if (stack.size() != 1) throw std::runtime_error("Invalid RPN expression");
+    if (depth != 1) throw std::runtime_error("Invalid RPN expression");
+    return tape;
+}
 
-        // Reject points outside of the fit range
-        if (!IsInFitRange(x[0])) {
-            TF1::RejectPoint();
+// Evaluate a compiled model
+double Evaluate(const sf::tape& tape, double* x, double* p) {
+    double stack[kMaxStackDepth];
+    int top = -1;
+    for (const auto& instr : tape.code) {
+        switch (instr.op) {
+            case sf::opcode::kConst:
+                stack[++top] = instr.value;
+                break;
+            case sf::opcode::kFunc:
+                stack[++top] = instr.fn(x, p + instr.offset);
+                break;
+            case sf::opcode::kAdd:
+                top--;
+                stack[top] += stack[top + 1];
+                break;
+            case sf::opcode::kSub:
+                top--;
+                stack[top] -= stack[top + 1];
+                break;
+            case sf::opcode::kMul:
+                top--;
+                stack[top] *= stack[top + 1];
+                break;
+            case sf::opcode::kDiv:
+                top--;
+                stack[top] /= stack[top + 1];
+                break;
         }
+    }
+    return stack[0];
+}
 
-        return stack.top();
-    };
+// Evaluate a compiled model over an array of n points. The slots of the value stack above the first one are stored in
+// `buffer`, which must hold at least (tape.depth - 1) * n values. If a cache is provided, only the components whose
+// parameters changed since the previous call are evaluated
+void Evaluate(const sf::tape& tape, const double* x, int n, const double* p, double* buffer, double* out,
+              sf::cache* cache = nullptr) {
+    auto slot = [&](int k) { return k == 0 ? out : buffer + (k - 1) * n; };
+
+    int top = -1;
+    for (const auto& instr : tape.code) {
+        if (instr.op == sf::opcode::kConst) {
+            double* a = slot(++top);
+            std::fill(a, a + n, instr.value);
+            continue;
+        }
+        if (instr.op == sf::opcode::kFunc) {
+            const double* pars = p + instr.offset;
+            if (!cache) {
+                instr.batch(x, n, pars, slot(++top));
+                continue;
+            }
 
-    // Count how many parameter the function has
-    int nPars = 0;
-    for (int iFunc = 0; iFunc < functions[idx].size(); iFunc++) {
-        nPars += std::get<2>(functions[idx][iFunc]);
-    }
+            auto& cachedPars = cache->pars[instr.component];
+            auto& cachedValues = cache->values[instr.component];
+            if (!cache->valid[instr.component] || !std::equal(pars, pars + instr.nPars, cachedPars.begin())) {
+                cachedPars.assign(pars, pars + instr.nPars);
+                cachedValues.resize(n);
+                instr.batch(x, n, pars, cachedValues.data());
+                cache->valid[instr.component] = true;
+            }
+            std::copy(cachedValues.begin(), cachedValues.end(), slot(++top));
+            continue;
+        }
 
-    this->fFit.push_back(new TF1(Form("fFit_%d", idx), lambda, this->fDrawRangeMin, this->fDrawRangeMax, nPars));
-    this->fFit[idx]->SetNpx(10000);
+        top--;
+        double* a = slot(top);
+        const double* b = slot(top + 1);
+        switch (instr.op) {
+            case sf::opcode::kAdd:
+#pragma omp simd
+                for (int i = 0; i < n; i++) a[i] += b[i];
+                break;
+            case sf::opcode::kSub:
+#pragma omp simd
+                for (int i = 0; i < n; i++) a[i] -= b[i];
+                break;
+            case sf::opcode::kMul:
+#pragma omp simd
+                for (int i = 0; i < n; i++) a[i] *= b[i];
+                break;
+            case sf::opcode::kDiv:
+#pragma omp simd
+                for (int i = 0; i < n; i++) a[i] /= b[i];
+                break;
+            default:
+                break;
+        }
+    }
+}
 
-    for (int iPar = 0; iPar < this->fPars[idx].size(); iPar++) {
-        auto [name, _, __, ___] = this->fPars[idx][iPar];
-        this->fFit[idx]->SetParName(iPar, name.data());
+// Derivatives of a component over an array of points, computed with central finite differences. Used for the
+// components that do not provide their derivatives
+void NumericalJacobian(const sf::batch_func& batch, const double* x, int n, const double* p, int nPars, double* out,
+                       double* jac) {
+    std::vector<double> pars(p, p + nPars);
+    std::vector<double> up(n), down(n);
+    batch(x, n, p, out);
+    for (int k = 0; k < nPars; k++) {
+        double step = 1.e-6 * std::max(1., std::abs(p[k]));
+        pars[k] = p[k] + step;
+        batch(x, n, pars.data(), up.data());
+        pars[k] = p[k] - step;
+        batch(x, n, pars.data(), down.data());
+        pars[k] = p[k];
+
+        for (int i = 0; i < n; i++) {
+            jac[k * n + i] = (up[i] - down[i]) / (2 * step);
+        }
     }
-};
+}
 
-// Global Chi2
-struct GlobalChi2 {
-    GlobalChi2(std::vector<ROOT::Fit::Chi2Function*> chi2, std::vector<std::vector<int>> parIndeces)
-        : fChi2(chi2), fParIndeces(parIndeces) {}
+// Evaluate a compiled model and its derivatives with respect to the tape.nPars parameters over an array of n points,
+// using forward-mode differentiation of the tape. The derivatives are stored in `dOut` as one row of n values per
+// parameter. `buffer` and `dBuffer` must hold tape.depth * n and tape.depth * tape.nPars * n values, `jac` the
+// derivatives of the component with most parameters. Each slot of the stack keeps track of the range of parameters
+// its derivatives can depend on, so that only those rows are propagated
+void EvaluateGradient(const sf::tape& tape, const double* x, int n, const double* p, double* buffer, double* dBuffer,
+                      double* jac, double* out, double* dOut) {
+    const int nPars = tape.nPars;
+    auto slot = [&](int k) { return buffer + k * n; };
+    auto dSlot = [&](int k, int iPar) { return dBuffer + (k * nPars + iPar) * n; };
+
+    int first[kMaxStackDepth];  // First parameter the slot depends on
+    int last[kMaxStackDepth];   // One past the last parameter the slot depends on
+
+    int top = -1;
+    for (const auto& instr : tape.code) {
+        if (instr.op == sf::opcode::kConst) {
+            top++;
+            std::fill(slot(top), slot(top) + n, instr.value);
+            first[top] = last[top] = 0;
+            continue;
+        }
+        if (instr.op == sf::opcode::kFunc) {
+            top++;
+            const double* pars = p + instr.offset;
+            if (instr.grad) {
+                instr.grad(x, n, pars, slot(top), jac);
+            } else {
+                NumericalJacobian(instr.batch, x, n, pars, instr.nPars, slot(top), jac);
+            }
+            std::copy(jac, jac + instr.nPars * n, dSlot(top, instr.offset));
+            first[top] = instr.offset;
+            last[top] = instr.offset + instr.nPars;
+            continue;
+        }
 
-    double operator()(const double* par) const {
-        double chi2 = 0;
-        for (size_t iChi2 = 0; iChi2 < fChi2.size(); iChi2++) {
-            double* pars = new double[fParIndeces[iChi2].size()];
+        top--;
+        double* a = slot(top);
+        const double* b = slot(top + 1);
+
+        // Extend the range of parameters of the result to the union of the two operands
+        if (first[top + 1] < last[top + 1]) {
+            int lo = first[top] < last[top] ? std::min(first[top], first[top + 1]) : first[top + 1];
+            int hi = first[top] < last[top] ? std::max(last[top], last[top + 1]) : last[top + 1];
+            for (int iPar = lo; iPar < hi; iPar++) {
+                if (first[top] <= iPar && iPar < last[top]) continue;
+                std::fill(dSlot(top, iPar), dSlot(top, iPar) + n, 0.);
+            }
+            first[top] = lo;
+            last[top] = hi;
+        }
 
-            for (int iPar = 0; iPar < fParIndeces[iChi2].size(); iPar++) {
-                pars[iPar] = par[fParIndeces[iChi2][iPar]];
+        for (int iPar = first[top]; iPar < last[top]; iPar++) {
+            double* da = dSlot(top, iPar);
+            bool inB = first[top + 1] <= iPar && iPar < last[top + 1];
+            const double* db = dSlot(top + 1, iPar);
+
+            switch (instr.op) {
+                case sf::opcode::kAdd:
+                    if (inB)
+                        for (int i = 0; i < n; i++) da[i] += db[i];
+                    break;
+                case sf::opcode::kSub:
+                    if (inB)
+                        for (int i = 0; i < n; i++) da[i] -= db[i];
+                    break;
+                case sf::opcode::kMul:
+                    if (inB)
+                        for (int i = 0; i < n; i++) da[i] = da[i] * b[i] + a[i] * db[i];
+                    else
+                        for (int i = 0; i < n; i++) da[i] *= b[i];
+                    break;
+                case sf::opcode::kDiv:
+                    if (inB)
+                        for (int i = 0; i < n; i++) da[i] = (da[i] - a[i] / b[i] * db[i]) / b[i];
+                    else
+                        for (int i = 0; i < n; i++) da[i] /= b[i];
+                    break;
+                default:
+                    break;
             }
-            chi2 += (*fChi2[iChi2])(pars);
         }
 
-        return chi2;
+        switch (instr.op) {
+            case sf::opcode::kAdd:
+                for (int i = 0; i < n; i++) a[i] += b[i];
+                break;
+            case sf::opcode::kSub:
+                for (int i = 0; i < n; i++) a[i] -= b[i];
+                break;
+            case sf::opcode::kMul:
+                for (int i = 0; i < n; i++) a[i] *= b[i];
+                break;
+            case sf::opcode::kDiv:
+                for (int i = 0; i < n; i++) a[i] /= b[i];
+                break;
+            default:
+                break;
+        }
     }
 
-    const std::vector<ROOT::Fit::Chi2Function*> fChi2;
-    std::vector<std::vector<int>> fParIndeces;
-};
+    std::copy(slot(0), slot(0) + n, out);
+    for (int iPar = 0; iPar < nPars; iPar++) {
+        if (first[0] <= iPar && iPar < last[0]) {
+            std::copy(dSlot(0, iPar), dSlot(0, iPar) + n, dOut + iPar * n);
+        } else {
+            std::fill(dOut + iPar * n, dOut + (iPar + 1) * n, 0.);
+        }
+    }
+}
 
-// return the indeces of the fit parameters, taking into account the shared ones
-std::vector<std::vector<int>> GetParameterIndeces(std::vector<std::vector<sf::parameter>> fPars) {
-    std::map<std::string, int> parIndeces = {};
-    std::vector<std::vector<int>> iPars = {};
-    int idx = 0;
-    for (size_t iFit = 0; iFit < fPars.size(); iFit++) {
-        std::vector<int> pars = {};
-        for (size_t iPar = 0; iPar < fPars[iFit].size(); iPar++) {
-            auto [name, _, __, ___] = fPars[iFit][iPar];
+// Sample the templates of a compiled model once at the given points. The returned tape can only be evaluated at those
+// points, but the evaluation of each template reduces to a scaling of the cached values
+sf::tape BindTemplates(const sf::tape& tape, const std::vector<sf::component>& funcs, const std::vector<double>& x) {
+    sf::tape bound = tape;
+    for (auto& instr : bound.code) {
+        if (instr.op != sf::opcode::kFunc || !funcs[instr.component].shape) continue;
+
+        auto shape = funcs[instr.component].shape;
+        std::vector<double> cached(x.size());
+        for (size_t i = 0; i < x.size(); i++) {
+            cached[i] = shape(x[i]);
+        }
 
-            // Find if the parameter was already inserted in the list of parameters
-            auto it = parIndeces.find(name);
-            if (it != parIndeces.end()) {
-                pars.push_back(it->second);
-            } else {
-                pars.push_back(idx);
-                parIndeces[name] = idx;
-                idx++;
+        instr.batch = [cached](const double* x, int n, const double* p, double* out) {
+            const double scale = p[0];
+#pragma omp simd
+            for (int i = 0; i < n; i++) out[i] = scale * cached[i];
+        };
+        instr.grad = [cached](const double* x, int n, const double* p, double* out, double* jac) {
+            const double scale = p[0];
+#pragma omp simd
+            for (int i = 0; i < n; i++) {
+                out[i] = scale * cached[i];
+                jac[i] = cached[i];
             }
-        }
-        iPars.push_back(pars);
+        };
     }
-
-    return iPars;
+    return bound;
 }
 
-// return the total number of fit parameters
-int SuperFitter::GetN() {
-    int nPars = 0;
-    for (size_t iParList = 0; iParList < fPars.size(); iParList++) {
-        nPars += fPars[iParList].size();
+// Check whether all the components of a compiled model provide their derivatives
+bool IsDifferentiable(const sf::tape& tape) {
+    for (const auto& instr : tape.code) {
+        if (instr.op == sf::opcode::kFunc && !instr.grad) return false;
     }
-    return nPars;
+    return true;
 }
 
-// Returns the number of shared fit parameters
-int SuperFitter::GetNShared() { return GetN() - GetNIndependent(); }
+// Parameters of a compiled model in which it is affine, jointly, so that they can be eliminated by linear least
+// squares. The analysis follows the stack of the tape and tracks, for each slot, the parameters it depends on and the
+// ones in which it is affine. A sum is affine in the parameters that enter all of its terms linearly, while a product
+// of two factors that both have linear parameters is not jointly affine in them, so only those of one factor are kept
+std::vector<bool> LinearParameters(const sf::tape& tape, const std::vector<sf::component>& funcs) {
+    struct slot {
+        std::vector<bool> deps;  // Parameters on which the slot depends
+        std::vector<bool> lin;   // Parameters in which the slot is affine
+    };
+    const std::vector<bool> none(tape.nPars, false);
+    std::vector<slot> stack = {};
 
-// Returns the number of independent fit parameters
-int SuperFitter::GetNIndependent() {
-    std::vector<std::string> seen = {};
-    int nIndependent = 0;
-    for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
-        for (size_t iPar = 0; iPar < fFit[iFit]->GetNpar(); iPar++) {
-            std::string name = fFit[iFit]->GetParName(iPar);
-            if (std::find(seen.begin(), seen.end(), name) == seen.end()) {
-                nIndependent++;
-                seen.push_back(name);
+    for (const auto& instr : tape.code) {
+        if (instr.op == sf::opcode::kConst) {
+            stack.push_back({none, none});
+            continue;
+        }
+        if (instr.op == sf::opcode::kFunc) {
+            slot s = {none, none};
+            std::fill(s.deps.begin() + instr.offset, s.deps.begin() + instr.offset + instr.nPars, true);
+            for (int iPar : funcs[instr.component].linear) {
+                s.lin[instr.offset + iPar] = true;
+            }
+            stack.push_back(s);
+            continue;
+        }
+
+        slot b = stack.back();
+        stack.pop_back();
+        slot& a = stack.back();
+        slot s = {none, none};
+        for (int iPar = 0; iPar < tape.nPars; iPar++) {
+            s.deps[iPar] = a.deps[iPar] || b.deps[iPar];
+        }
+
+        if (instr.op == sf::opcode::kAdd || instr.op == sf::opcode::kSub) {
+            for (int iPar = 0; iPar < tape.nPars; iPar++) {
+                s.lin[iPar] = s.deps[iPar] && (a.lin[iPar] || !a.deps[iPar]) && (b.lin[iPar] || !b.deps[iPar]);
+            }
+        } else {
+            // Linear parameters of each factor that do not appear in the other one
+            std::vector<bool> linA = none, linB = none;
+            int nA = 0, nB = 0;
+            for (int iPar = 0; iPar < tape.nPars; iPar++) {
+                linA[iPar] = a.lin[iPar] && !b.deps[iPar];
+                linB[iPar] = b.lin[iPar] && !a.deps[iPar];
+                nA += linA[iPar];
+                nB += linB[iPar];
             }
+            // Only the numerator of a ratio can be linear
+            s.lin = (instr.op == sf::opcode::kDiv || nA >= nB) ? linA : linB;
         }
+        a = s;
     }
-    return nIndependent;
+    return stack.empty() ? none : stack.back().lin;
 }
 
-// Returns the number of independent fit parameters for a specific fit
-int SuperFitter::GetNIndependent(int nFit) {
-    std::vector<std::string> seen = {};
-    int nIndependent = 0;
-    for (size_t iFit = 0; iFit < nFit; iFit++) {
-        for (size_t iPar = 0; iPar < fFit[iFit]->GetNpar(); iPar++) {
-            std::string name = fFit[iFit]->GetParName(iPar);
-            if (std::find(seen.begin(), seen.end(), name) == seen.end()) {
-                nIndependent++;
-                seen.push_back(name);
+// SetModel
+void SuperFitter::SetModel(int idx, std::string model) {
+    // Tokenization of the model
+    auto tokens = Tokenize(model);
+    DEBUG(50, 0, "Expression in infix: %s", join(" ", tokens).data());
+
+    // Convert to Reverse Polish Notation
+    auto rpn = toRPN(tokens, fFunctions);
+    DEBUG(50, 0, "Expression in RPN: %s", join(" ", rpn).data());
+
+    // Compile the model once, so that the evaluation does not need to parse the tokens
+    auto tape = Compile(rpn, fFunctions[idx]);
+    this->fModels.push_back(tape);
+    this->fModelExpressions.push_back(model);
+
+    // The following lambda evaluates the fit function. The points outside of the fit range are excluded when the data
+    // are prepared, so they need not be rejected here
+    auto lambda = [tape](double* x, double* p) -> double { return Evaluate(tape, x, p); };
+
+    // Count how many parameter the function has
+    int nPars = 0;
+    for (int iFunc = 0; iFunc < fFunctions[idx].size(); iFunc++) {
+        nPars += fFunctions[idx][iFunc].nPars;
+    }
+
+    // Not added to the global list of functions, which would be shared by all the fitters
+    this->fFit.push_back(new TF1(Form("fFit_%d", idx), lambda, this->fDrawRangeMin, this->fDrawRangeMax, nPars, 1,
+                                 TF1::EAddToList::kNo));
+    this->fFit[idx]->SetNpx(10000);
+
+    for (int iPar = 0; iPar < this->fPars[idx].size(); iPar++) {
+        auto [name, _, __, ___] = this->fPars[idx][iPar];
+        this->fFit[idx]->SetParName(iPar, name.data());
+    }
+};
+
+// Chi2 of a single dataset, computed with the batch evaluation of its compiled model
+struct DatasetChi2 {
+    DatasetChi2(const sf::dataset& data)
+        : fData(data),
+          fBuffer(std::max(data.model.depth - 1, 0) * data.x.size()),
+          fValues(data.x.size()) {
+        fCache.Reset(data.model.nComponents);
+    }
+
+    double operator()(const double* par) const {
+        const int n = fData.x.size();
+        Evaluate(fData.model, fData.x.data(), n, par, fBuffer.data(), fValues.data(), &fCache);
+
+        const double* y = fData.y.data();
+        const double* w = fData.invErr.data();
+        const double* f = fValues.data();
+        double chi2 = 0;
+#pragma omp simd reduction(+ : chi2)
+        for (int i = 0; i < n; i++) {
+            double r = (y[i] - f[i]) * w[i];
+            chi2 += r * r;
+        }
+        return std::isfinite(chi2) ? chi2 : InvalidChi2;
+    }
+
+    // Chi2 and its derivatives with respect to the parameters of the dataset
+    double operator()(const double* par, double* grad) const {
+        const int n = fData.x.size();
+        const int nPars = fData.model.nPars;
+
+        // The buffers for the derivatives are only allocated if the gradient is used
+        if (fDValues.empty()) {
+            int maxPars = 0;
+            for (const auto& instr : fData.model.code) {
+                maxPars = std::max(maxPars, instr.nPars);
+            }
+            fGradBuffer.resize(fData.model.depth * n);
+            fDBuffer.resize(fData.model.depth * nPars * n);
+            fJac.resize(maxPars * n);
+            fDValues.resize(nPars * n);
+        }
+
+        EvaluateGradient(fData.model, fData.x.data(), n, par, fGradBuffer.data(), fDBuffer.data(), fJac.data(),
+                         fValues.data(), fDValues.data());
+
+        const double* y = fData.y.data();
+        const double* w = fData.invErr.data();
+        const double* f = fValues.data();
+        double chi2 = 0;
+        for (int i = 0; i < n; i++) {
+            double r = (y[i] - f[i]) * w[i];
+            chi2 += r * r;
+            fValues[i] = -2 * r * w[i];  // Derivative of the chi2 wrt the model
+        }
+
+        for (int iPar = 0; iPar < nPars; iPar++) {
+            const double* df = fDValues.data() + iPar * n;
+            double derivative = 0;
+#pragma omp simd reduction(+ : derivative)
+            for (int i = 0; i < n; i++) {
+                derivative += fValues[i] * df[i];
+            }
+            grad[iPar] = derivative;
+        }
+
+        // The minimizer is pushed back by the value alone
+        if (!std::isfinite(chi2)) {
+            std::fill(grad, grad + nPars, 0.);
+            return InvalidChi2;
+        }
+        return chi2;
+    }
+
+    const sf::dataset& fData;
+    mutable std::vector<double> fBuffer;      // Value stack of the model evaluation
+    mutable std::vector<double> fValues;      // Model evaluated at the data points
+    mutable sf::cache fCache;                 // Output of the components at the previous call
+    mutable std::vector<double> fGradBuffer;  // Value stack of the evaluation with derivatives
+    mutable std::vector<double> fDBuffer;     // Derivative stack of the evaluation with derivatives
+    mutable std::vector<double> fJac;         // Derivatives of a single component
+    mutable std::vector<double> fDValues;     // Derivatives of the model at the data points
+};
+
+// Global Chi2
+struct GlobalChi2 {
+    GlobalChi2(std::vector<DatasetChi2*> chi2, std::vector<std::vector<int>> parIndeces)
+        : fChi2(chi2), fParIndeces(parIndeces), fPars(chi2.size()), fDatasetChi2(chi2.size()) {
+        for (size_t iChi2 = 0; iChi2 < fChi2.size(); iChi2++) {
+            fPars[iChi2].resize(fParIndeces[iChi2].size());
+        }
+    }
+
+    // The datasets are evaluated in parallel, but their chi2 are summed in a fixed order so that the result is
+    // identical to the one of a serial evaluation
+    double operator()(const double* par) const {
+        sf::ThreadPool::Global().ParallelFor(fChi2.size(), [&](int iChi2, int) {
+            double* pars = fPars[iChi2].data();
+            for (size_t iPar = 0; iPar < fParIndeces[iChi2].size(); iPar++) {
+                pars[iPar] = par[fParIndeces[iChi2][iPar]];
+            }
+            fDatasetChi2[iChi2] = (*fChi2[iChi2])(pars);
+        });
+
+        double chi2 = 0;
+        for (double datasetChi2 : fDatasetChi2) {
+            chi2 += datasetChi2;
+        }
+        return chi2;
+    }
+
+    const std::vector<DatasetChi2*> fChi2;
+    std::vector<std::vector<int>> fParIndeces;
+    mutable std::vector<std::vector<double>> fPars;  // Parameters of each dataset
+    mutable std::vector<double> fDatasetChi2;        // Chi2 of each dataset
+};
+
+// Global chi2 with its analytic gradient, obtained by differentiating the models of all the datasets
+class GlobalChi2Grad : public ROOT::Math::IMultiGradFunction {
+   public:
+    GlobalChi2Grad(const GlobalChi2& chi2, unsigned int nDim)
+        : fChi2(chi2), fNDim(nDim), fLocalGrad(chi2.fChi2.size()), fGrad(nDim) {
+        for (size_t iChi2 = 0; iChi2 < fLocalGrad.size(); iChi2++) {
+            fLocalGrad[iChi2].resize(chi2.fParIndeces[iChi2].size());
+        }
+    }
+
+    unsigned int NDim() const override { return fNDim; }
+
+    ROOT::Math::IMultiGenFunction* Clone() const override { return new GlobalChi2Grad(*this); }
+
+    void Gradient(const double* par, double* grad) const override {
+        double chi2;
+        FdF(par, chi2, grad);
+    }
+
+    // As for the chi2, the contributions of the datasets are computed in parallel and summed in a fixed order
+    void FdF(const double* par, double& chi2, double* grad) const override {
+        const auto& parIndeces = fChi2.fParIndeces;
+        sf::ThreadPool::Global().ParallelFor(fChi2.fChi2.size(), [&](int iChi2, int) {
+            double* pars = fChi2.fPars[iChi2].data();
+            for (size_t iPar = 0; iPar < parIndeces[iChi2].size(); iPar++) {
+                pars[iPar] = par[parIndeces[iChi2][iPar]];
+            }
+            fChi2.fDatasetChi2[iChi2] = (*fChi2.fChi2[iChi2])(pars, fLocalGrad[iChi2].data());
+        });
+
+        chi2 = 0;
+        std::fill(grad, grad + fNDim, 0.);
+        for (size_t iChi2 = 0; iChi2 < fChi2.fChi2.size(); iChi2++) {
+            chi2 += fChi2.fDatasetChi2[iChi2];
+            for (size_t iPar = 0; iPar < parIndeces[iChi2].size(); iPar++) {
+                grad[parIndeces[iChi2][iPar]] += fLocalGrad[iChi2][iPar];
+            }
+        }
+    }
+
+   private:
+    double DoEval(const double* par) const override { return fChi2(par); }
+
+    double DoDerivative(const double* par, unsigned int iPar) const override {
+        Gradient(par, fGrad.data());
+        return fGrad[iPar];
+    }
+
+    GlobalChi2 fChi2;
+    unsigned int fNDim;
+    mutable std::vector<std::vector<double>> fLocalGrad;  // Gradient of each dataset wrt its own parameters
+    mutable std::vector<double> fGrad;
+};
+
+// Copies of the global chi2 for the threads of the pool, so that it can be evaluated concurrently at different points.
+// The finite-difference derivatives spread their parameter shifts over the threads with it. The copy of a thread is
+// only created when the thread first uses it, so a fit that runs in a task of the pool, where the nested loops are
+// serial, only allocates the one of its own thread
+class ParallelChi2 {
+   public:
+    ParallelChi2(const std::vector<sf::dataset>& data, const std::vector<std::vector<int>>& parIndeces,
+                 std::vector<int> free, unsigned int nDim)
+        : fData(data), fParIndeces(parIndeces), fNDim(nDim), fFree(free),
+          fSlots(sf::ThreadPool::Global().GetNThreads()) {}
+
+    // Central finite-difference gradient. The two shifts of each free parameter are evaluated in parallel
+    void Gradient(const double* par, const std::vector<double>& steps, double* grad) const {
+        const int nFree = fFree.size();
+        fValues.resize(2 * nFree);
+        sf::ThreadPool::Global().ParallelFor(2 * nFree, [&](int iTask, int slot) {
+            int iPar = fFree[iTask / 2];
+            double* shifted = Shift(par, slot);
+            shifted[iPar] += iTask % 2 ? -steps[iPar] : steps[iPar];
+            fValues[iTask] = (*GetSlot(slot).chi2)(shifted);
+        });
+
+        std::fill(grad, grad + fNDim, 0.);
+        for (int iFree = 0; iFree < nFree; iFree++) {
+            int iPar = fFree[iFree];
+            grad[iPar] = (fValues[2 * iFree] - fValues[2 * iFree + 1]) / (2 * steps[iPar]);
+        }
+    }
+
+    // Hessian of the chi2 wrt the free parameters, stored row by row. It is computed with finite differences of the
+    // analytic gradient if available (2n gradients), otherwise of the chi2 (2n^2 chi2). The shifted points are
+    // evaluated in parallel
+    std::vector<double> Hessian(const double* par, const std::vector<double>& steps, bool useGradient) const {
+        const int nFree = fFree.size();
+        std::vector<double> hessian(nFree * nFree);
+
+        if (useGradient) {
+            std::vector<double> grads(2 * nFree * fNDim);
+            sf::ThreadPool::Global().ParallelFor(2 * nFree, [&](int iTask, int slot) {
+                int iPar = fFree[iTask / 2];
+                double* shifted = Shift(par, slot);
+                shifted[iPar] += iTask % 2 ? -steps[iPar] : steps[iPar];
+                GetSlot(slot).grad->Gradient(shifted, grads.data() + iTask * fNDim);
+            });
+
+            for (int i = 0; i < nFree; i++) {
+                const double* gUp = grads.data() + 2 * i * fNDim;
+                const double* gDown = gUp + fNDim;
+                for (int j = 0; j < nFree; j++) {
+                    hessian[i * nFree + j] = (gUp[fFree[j]] - gDown[fFree[j]]) / (2 * steps[fFree[i]]);
+                }
+            }
+
+            // Symmetrize, the two estimates of the mixed derivatives differ by the truncation error
+            for (int i = 0; i < nFree; i++) {
+                for (int j = 0; j < i; j++) {
+                    double mixed = (hessian[i * nFree + j] + hessian[j * nFree + i]) / 2;
+                    hessian[i * nFree + j] = mixed;
+                    hessian[j * nFree + i] = mixed;
+                }
+            }
+            return hessian;
+        }
+
+        // Shifted points: the minimum, x +- h_i, and x +- h_i +- h_j for i < j
+        struct point {
+            int i, si, j, sj;
+        };
+        std::vector<point> points = {{-1, 0, -1, 0}};
+        for (int i = 0; i < nFree; i++) {
+            points.push_back({i, 1, -1, 0});
+            points.push_back({i, -1, -1, 0});
+            for (int j = 0; j < i; j++) {
+                for (int si : {1, -1}) {
+                    for (int sj : {1, -1}) {
+                        points.push_back({i, si, j, sj});
+                    }
+                }
+            }
+        }
+
+        std::vector<double> values(points.size());
+        sf::ThreadPool::Global().ParallelFor(points.size(), [&](int iPoint, int slot) {
+            const auto& pt = points[iPoint];
+            double* shifted = Shift(par, slot);
+            if (pt.i >= 0) shifted[fFree[pt.i]] += pt.si * steps[fFree[pt.i]];
+            if (pt.j >= 0) shifted[fFree[pt.j]] += pt.sj * steps[fFree[pt.j]];
+            values[iPoint] = (*GetSlot(slot).chi2)(shifted);
+        });
+
+        // Combine the points in the order in which they were generated
+        const double f0 = values[0];
+        int iPoint = 1;
+        for (int i = 0; i < nFree; i++) {
+            double hi = steps[fFree[i]];
+            double fUp = values[iPoint++];
+            double fDown = values[iPoint++];
+            hessian[i * nFree + i] = (fUp - 2 * f0 + fDown) / (hi * hi);
+            for (int j = 0; j < i; j++) {
+                double hj = steps[fFree[j]];
+                double fUpUp = values[iPoint++];
+                double fUpDown = values[iPoint++];
+                double fDownUp = values[iPoint++];
+                double fDownDown = values[iPoint++];
+                double mixed = (fUpUp - fUpDown - fDownUp + fDownDown) / (4 * hi * hj);
+                hessian[i * nFree + j] = mixed;
+                hessian[j * nFree + i] = mixed;
+            }
+        }
+        return hessian;
+    }
+
+    const std::vector<int>& GetFree() const { return fFree; }
+
+   private:
+    // Chi2 of the datasets, global chi2 with its gradient and shifted parameters of a thread
+    struct slot {
+        std::vector<DatasetChi2> datasetChi2;
+        std::unique_ptr<GlobalChi2> chi2;
+        std::unique_ptr<GlobalChi2Grad> grad;
+        std::vector<double> pars;
+    };
+
+    // Buffers of a thread, created at their first use. Each thread only accesses its own slot
+    slot& GetSlot(int iSlot) const {
+        std::unique_ptr<slot>& buffers = fSlots[iSlot];
+        if (!buffers) {
+            buffers.reset(new slot);
+            buffers->datasetChi2.reserve(fData.size());
+            std::vector<DatasetChi2*> chi2 = {};
+            for (const auto& dataset : fData) {
+                buffers->datasetChi2.emplace_back(dataset);
+                chi2.push_back(&buffers->datasetChi2.back());
             }
+            buffers->chi2.reset(new GlobalChi2(chi2, fParIndeces));
+            buffers->grad.reset(new GlobalChi2Grad(*buffers->chi2, fNDim));
+            buffers->pars.resize(fNDim);
         }
+        return *buffers;
     }
-    return nIndependent;
+
+    // Copy the parameters in the buffer of a slot, to be shifted by the caller
+    double* Shift(const double* par, int iSlot) const {
+        std::vector<double>& pars = GetSlot(iSlot).pars;
+        std::copy(par, par + fNDim, pars.begin());
+        return pars.data();
+    }
+
+    const std::vector<sf::dataset>& fData;
+    std::vector<std::vector<int>> fParIndeces;
+    unsigned int fNDim;
+    std::vector<int> fFree;                              // Indeces of the free parameters
+    mutable std::vector<std::unique_ptr<slot>> fSlots;   // Buffers of each thread, empty until used
+    mutable std::vector<double> fValues;                 // Chi2 at the shifted points of the gradient
+};
+
+// Global chi2 with a finite-difference gradient, for models with components that do not provide their derivatives.
+// The parameter shifts are evaluated in parallel instead of in Minuit's serial loop
+class GlobalChi2NumGrad : public ROOT::Math::IMultiGradFunction {
+   public:
+    GlobalChi2NumGrad(const GlobalChi2& chi2, const ParallelChi2& parallelChi2, std::vector<double> steps)
+        : fChi2(chi2), fParallelChi2(&parallelChi2), fSteps(steps), fGrad(steps.size()) {}
+
+    unsigned int NDim() const override { return fSteps.size(); }
+
+    ROOT::Math::IMultiGenFunction* Clone() const override { return new GlobalChi2NumGrad(*this); }
+
+    void Gradient(const double* par, double* grad) const override { fParallelChi2->Gradient(par, fSteps, grad); }
+
+    void FdF(const double* par, double& chi2, double* grad) const override {
+        chi2 = fChi2(par);
+        Gradient(par, grad);
+    }
+
+   private:
+    double DoEval(const double* par) const override { return fChi2(par); }
+
+    double DoDerivative(const double* par, unsigned int iPar) const override {
+        Gradient(par, fGrad.data());
+        return fGrad[iPar];
+    }
+
+    GlobalChi2 fChi2;
+    const ParallelChi2* fParallelChi2;  // Not owned
+    std::vector<double> fSteps;         // Shifts of the parameters
+    mutable std::vector<double> fGrad;
+};
+
+// Solve the symmetric positive semi-definite system A x = b, with the matrices stored row by row, by Cholesky
+// decomposition. Directions with a vanishing pivot, i.e. linear parameters that do not affect the data, are set to 0
+std::vector<double> SolveNormalEquations(std::vector<double> A, std::vector<double> b, int n) {
+    const double tolerance = 1.e-12;
+    std::vector<bool> degenerate(n, false);
+
+    // Decomposition A = L L^T, with L stored in the lower triangle of A
+    for (int j = 0; j < n; j++) {
+        double diagonal = A[j * n + j];
+        double pivot = diagonal;
+        for (int k = 0; k < j; k++) pivot -= A[j * n + k] * A[j * n + k];
+        if (!(pivot > tolerance * diagonal)) {
+            degenerate[j] = true;
+            A[j * n + j] = 1;
+            for (int i = j + 1; i < n; i++) A[i * n + j] = 0;
+            continue;
+        }
+
+        A[j * n + j] = std::sqrt(pivot);
+        for (int i = j + 1; i < n; i++) {
+            double sum = A[i * n + j];
+            for (int k = 0; k < j; k++) sum -= A[i * n + k] * A[j * n + k];
+            A[i * n + j] = sum / A[j * n + j];
+        }
+    }
+
+    // Forward and backward substitutions
+    for (int i = 0; i < n; i++) {
+        double sum = b[i];
+        for (int k = 0; k < i; k++) sum -= A[i * n + k] * b[k];
+        b[i] = degenerate[i] ? 0 : sum / A[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        double sum = b[i];
+        for (int k = i + 1; k < n; k++) sum -= A[k * n + i] * b[k];
+        b[i] = degenerate[i] ? 0 : sum / A[i * n + i];
+    }
+    return b;
+}
+
+// Chi2 as a function of the nonlinear parameters only (variable projection). The linear parameters, in which all the
+// models are affine, are eliminated at each call by solving the weighted linear least squares problem of all the
+// datasets. Since the chi2 is stationary wrt the linear parameters at their solution, its gradient wrt the nonlinear
+// ones is the partial gradient of the full chi2
+class VarProChi2 : public ROOT::Math::IMultiGradFunction {
+   public:
+    VarProChi2(const std::vector<sf::dataset>& data, const std::vector<std::vector<int>>& parIndeces,
+               std::vector<int> linear, std::vector<int> nonlinear, const ROOT::Math::IMultiGradFunction& chi2)
+        : fData(&data),
+          fParIndeces(parIndeces),
+          fLinear(linear),
+          fNonlinear(nonlinear),
+          fFullChi2(&chi2),
+          fWork(data.size()),
+          fFull(chi2.NDim()),
+          fFullGrad(chi2.NDim()) {
+        std::vector<int> position(chi2.NDim(), -1);
+        for (size_t k = 0; k < linear.size(); k++) {
+            position[linear[k]] = k;
+        }
+
+        for (size_t iData = 0; iData < data.size(); iData++) {
+            auto& work = fWork[iData];
+            const int n = data[iData].x.size();
+            const auto& model = data[iData].model;
+
+            // Group the local occurrences of each linear parameter of the dataset
+            std::map<int, std::vector<int>> occurrences = {};
+            for (size_t iPar = 0; iPar < parIndeces[iData].size(); iPar++) {
+                int k = position[parIndeces[iData][iPar]];
+                if (k >= 0) occurrences[k].push_back(iPar);
+            }
+            for (const auto& [k, local] : occurrences) {
+                work.linear.push_back(k);
+                work.local.push_back(local);
+            }
+
+            const int nLinear = work.linear.size();
+            work.pars.resize(parIndeces[iData].size());
+            work.buffer.resize(std::max(model.depth - 1, 0) * n);
+            work.h.resize(n);
+            work.g.resize(nLinear * n);
+            work.A.resize(nLinear * nLinear);
+            work.b.resize(nLinear);
+            work.cache.Reset(model.nComponents);
+        }
+    }
+
+    unsigned int NDim() const override { return fNonlinear.size(); }
+
+    ROOT::Math::IMultiGenFunction* Clone() const override { return new VarProChi2(*this); }
+
+    // Parameters of the full model, with the linear ones at their least squares solution
+    const std::vector<double>& Solve(const double* par) const {
+        const int nLinear = fLinear.size();
+        for (size_t i = 0; i < fNonlinear.size(); i++) {
+            fFull[fNonlinear[i]] = par[i];
+        }
+        for (int iPar : fLinear) {
+            fFull[iPar] = 0;
+        }
+
+        // Model without the linear terms (h) and the contribution of each linear parameter (g)
+        sf::ThreadPool::Global().ParallelFor(fData->size(), [&](int iData, int) { Project(iData); });
+
+        std::vector<double> A(nLinear * nLinear, 0.), b(nLinear, 0.);
+        for (const auto& work : fWork) {
+            const int nLocal = work.linear.size();
+            for (int k = 0; k < nLocal; k++) {
+                b[work.linear[k]] += work.b[k];
+                for (int l = 0; l < nLocal; l++) {
+                    A[work.linear[k] * nLinear + work.linear[l]] += work.A[k * nLocal + l];
+                }
+            }
+        }
+
+        std::vector<double> solution = SolveNormalEquations(A, b, nLinear);
+        for (int k = 0; k < nLinear; k++) {
+            fFull[fLinear[k]] = solution[k];
+        }
+        return fFull;
+    }
+
+    void Gradient(const double* par, double* grad) const override {
+        double chi2;
+        FdF(par, chi2, grad);
+    }
+
+    void FdF(const double* par, double& chi2, double* grad) const override {
+        const auto& full = Solve(par);
+        fFullChi2->FdF(full.data(), chi2, fFullGrad.data());
+        for (size_t i = 0; i < fNonlinear.size(); i++) {
+            grad[i] = fFullGrad[fNonlinear[i]];
+        }
+    }
+
+   private:
+    // Workspace of a dataset
+    struct workspace {
+        std::vector<int> linear;              // Index in the list of linear parameters of those of the dataset
+        std::vector<std::vector<int>> local;  // Local indeces at which each of them appears
+        std::vector<double> pars;             // Local parameters
+        std::vector<double> buffer;           // Value stack of the model evaluation
+        std::vector<double> h;                // Residuals of the model with the linear parameters set to 0
+        std::vector<double> g;                // Contribution of each linear parameter for a unit value
+        std::vector<double> A;                // Normal matrix of the dataset
+        std::vector<double> b;                // Right-hand side of the normal equations of the dataset
+        sf::cache cache;                      // Only the components with the shifted parameter are recomputed
+        double chi2;                          // Chi2 of the dataset at the solution
+    };
+
+    void Project(int iData) const {
+        const auto& data = (*fData)[iData];
+        auto& work = fWork[iData];
+        const int n = data.x.size();
+        const int nLocal = work.linear.size();
+
+        for (size_t iPar = 0; iPar < work.pars.size(); iPar++) {
+            work.pars[iPar] = fFull[fParIndeces[iData][iPar]];
+        }
+        Evaluate(data.model, data.x.data(), n, work.pars.data(), work.buffer.data(), work.h.data(), &work.cache);
+
+        for (int k = 0; k < nLocal; k++) {
+            double* g = work.g.data() + k * n;
+            for (int iPar : work.local[k]) work.pars[iPar] = 1;
+            Evaluate(data.model, data.x.data(), n, work.pars.data(), work.buffer.data(), g, &work.cache);
+            for (int iPar : work.local[k]) work.pars[iPar] = 0;
+
+            for (int i = 0; i < n; i++) {
+                g[i] = (g[i] - work.h[i]) * data.invErr[i];
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            work.h[i] = (data.y[i] - work.h[i]) * data.invErr[i];
+        }
+
+        for (int k = 0; k < nLocal; k++) {
+            const double* gk = work.g.data() + k * n;
+            double bk = 0;
+#pragma omp simd reduction(+ : bk)
+            for (int i = 0; i < n; i++) {
+                bk += gk[i] * work.h[i];
+            }
+            work.b[k] = bk;
+
+            for (int l = 0; l <= k; l++) {
+                const double* gl = work.g.data() + l * n;
+                double akl = 0;
+#pragma omp simd reduction(+ : akl)
+                for (int i = 0; i < n; i++) {
+                    akl += gk[i] * gl[i];
+                }
+                work.A[k * nLocal + l] = akl;
+                work.A[l * nLocal + k] = akl;
+            }
+        }
+    }
+
+    // The chi2 at the solution is computed from the residuals and the contributions of the linear parameters, without
+    // evaluating the model again
+    double DoEval(const double* par) const override {
+        const auto& full = Solve(par);
+        sf::ThreadPool::Global().ParallelFor(fData->size(), [&](int iData, int) {
+            auto& work = fWork[iData];
+            const int n = work.h.size();
+            double chi2 = 0;
+            for (int i = 0; i < n; i++) {
+                double r = work.h[i];
+                for (size_t k = 0; k < work.linear.size(); k++) {
+                    r -= full[fLinear[work.linear[k]]] * work.g[k * n + i];
+                }
+                chi2 += r * r;
+            }
+            work.chi2 = chi2;
+        });
+
+        double chi2 = 0;
+        for (const auto& work : fWork) {
+            chi2 += work.chi2;
+        }
+        return std::isfinite(chi2) ? chi2 : InvalidChi2;
+    }
+
+    double DoDerivative(const double* par, unsigned int iPar) const override {
+        std::vector<double> grad(NDim());
+        Gradient(par, grad.data());
+        return grad[iPar];
+    }
+
+    const std::vector<sf::dataset>* fData;  // Not owned
+    std::vector<std::vector<int>> fParIndeces;
+    std::vector<int> fLinear;                      // Global indeces of the linear parameters
+    std::vector<int> fNonlinear;                   // Global indeces of the parameters seen by the minimizer
+    const ROOT::Math::IMultiGradFunction* fFullChi2;  // Chi2 of the full model, not owned
+    mutable std::vector<workspace> fWork;
+    mutable std::vector<double> fFull;      // Parameters of the full model
+    mutable std::vector<double> fFullGrad;  // Gradient of the full chi2
+};
+
+// Build the table of the independent parameters, hashed by name and numbered in order of first appearance, and the
+// maps from the parameters of each fit to the independent ones. The shared parameters are found in constant time, so
+// that combined fits of many datasets are set up in linear time
+void SuperFitter::IndexParameters() {
+    fParIndeces.clear();
+    fParIndeces.reserve(GetN());
+    fGlobalIndeces.assign(fPars.size(), {});
+    fFirstOccurrences.clear();
+    for (size_t iFit = 0; iFit < fPars.size(); iFit++) {
+        fGlobalIndeces[iFit].reserve(fPars[iFit].size());
+        for (size_t iPar = 0; iPar < fPars[iFit].size(); iPar++) {
+            const std::string& name = std::get<0>(fPars[iFit][iPar]);
+            auto [it, isNew] = fParIndeces.try_emplace(name, fFirstOccurrences.size());
+            if (isNew) {
+                fFirstOccurrences.push_back({iFit, iPar});
+            }
+            fGlobalIndeces[iFit].push_back(it->second);
+        }
+    }
+}
+
+// return the total number of fit parameters
+int SuperFitter::GetN() {
+    int nPars = 0;
+    for (size_t iParList = 0; iParList < fPars.size(); iParList++) {
+        nPars += fPars[iParList].size();
+    }
+    return nPars;
+}
+
+// Returns the number of shared fit parameters
+int SuperFitter::GetNShared() { return GetN() - GetNIndependent(); }
+
+// Returns the number of independent fit parameters
+int SuperFitter::GetNIndependent() {
+    IndexParameters();
+    return fFirstOccurrences.size();
+}
+
+// Returns the number of independent fit parameters of the first nFit fits
+int SuperFitter::GetNIndependent(int nFit) {
+    IndexParameters();
+    return std::count_if(fFirstOccurrences.begin(), fFirstOccurrences.end(),
+                         [nFit](const std::pair<int, int>& occurrence) { return occurrence.first < nFit; });
 }
 
 // Returns the values of the fit parameters at initialization
 std::vector<double> SuperFitter::GetInitialParameters() {
+    IndexParameters();
     std::vector<double> pars = {};
-    std::vector<std::string> seen = {};
-    for (int iFit = 0; iFit < fFit.size(); iFit++) {
-        for (int iPar = 0; iPar < this->fFit[iFit]->GetNpar(); iPar++) {
-            auto par = this->fPars[iFit][iPar];
-            std::string name = std::get<0>(par);
-            if (std::find(seen.begin(), seen.end(), name) == seen.end()) {
-                double centr = std::get<1>(par);
-                pars.push_back(centr);
-                seen.push_back(name);
+    pars.reserve(fFirstOccurrences.size());
+    for (const auto& [iFit, iPar] : fFirstOccurrences) {
+        pars.push_back(std::get<1>(this->fPars[iFit][iPar]));
+    }
+    return pars;
+}
+
+// Compute the covariance matrix of the fit parameters as twice the inverse of the Hessian of the chi2. The steps of
+// the finite differences are a fraction of the uncertainties estimated by the minimizer, reduced if needed so that
+// the shifted parameters stay within their limits. Returns false if the Hessian can't be inverted, in which case the
+// covariance estimated by the minimizer is kept
+bool SuperFitter::ComputeCovariance(const ParallelChi2& chi2, const ROOT::Fit::FitResult& result,
+                                    const ROOT::Fit::FitConfig& config, bool useGradient) {
+    const auto& free = chi2.GetFree();
+    const int nDim = result.NPar();
+    const int nFree = free.size();
+
+    fCovariance.ResizeTo(nDim, nDim);
+    for (int i = 0; i < nDim; i++) {
+        for (int j = 0; j < nDim; j++) {
+            fCovariance(i, j) = result.CovMatrix(i, j);
+        }
+    }
+    if (nFree == 0) return false;
+
+    std::vector<double> steps(nDim);
+    for (int iPar : free) {
+        const auto& settings = config.ParSettings(iPar);
+        double value = result.Parameter(iPar);
+        double step = result.ParError(iPar) > 0 ? 0.1 * result.ParError(iPar) : 1.e-3 * settings.StepSize();
+        if (settings.HasLimits()) {
+            step = std::min({step, (value - settings.LowerLimit()) / 2, (settings.UpperLimit() - value) / 2});
+        }
+        if (!(step > 0)) {
+            printf("\033[33mWARNING: parameter '%s' is at its limit, the covariance of the minimizer is used\033[0m\n",
+                   settings.Name().data());
+            return false;
+        }
+        steps[iPar] = step;
+    }
+
+    std::vector<double> hessian = chi2.Hessian(result.GetParams(), steps, useGradient);
+    TMatrixDSym mHessian(nFree);
+    for (int i = 0; i < nFree; i++) {
+        for (int j = 0; j < nFree; j++) {
+            mHessian(i, j) = hessian[i * nFree + j];
+        }
+    }
+
+    double det = 0;
+    mHessian.Invert(&det);
+    if (!mHessian.IsValid() || det == 0) {
+        printf("\033[33mWARNING: the Hessian is singular, the covariance of the minimizer is used\033[0m\n");
+        return false;
+    }
+
+    for (int i = 0; i < nFree; i++) {
+        for (int j = 0; j < nFree; j++) {
+            fCovariance(free[i], free[j]) = 2 * mHessian(i, j);
+        }
+    }
+    return true;
+}
+
+uint64_t SuperFitter::HashInputs(const char* opt) {
+    IndexParameters();
+    sf::Hash hash;
+    hash.Add(std::string(opt)).Add((long)fFit.size());
+    for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
+        // Data, including the uncertainties of the templates added to it
+        TH1* hObs = fObs[iFit]->GetHistogram();
+        std::vector<double> x = {};
+        for (int iBin = 1; iBin <= hObs->GetNbinsX(); iBin++) {
+            x.push_back(hObs->GetBinCenter(iBin));
+            hash.Add(hObs->GetBinLowEdge(iBin)).Add(hObs->GetBinContent(iBin)).Add(hObs->GetBinError(iBin));
+        }
+        hash.Add(hObs->GetXaxis()->GetXmax());
+
+        // Components, through their identity: the function with its settings or the content of the template, which
+        // do not depend on the parameters, and their values at the bin centres at the initial parameters
+        std::vector<double> pars = {};
+        for (const auto& [name, init, min, max] : fPars[iFit]) {
+            hash.Add(name).Add(init).Add(min).Add(max);
+            pars.push_back(init);
+        }
+        int offset = 0;
+        for (const auto& component : fFunctions[iFit]) {
+            hash.Add(component.name).Add(component.id).Add((long)component.nPars);
+            if (offset + component.nPars > (int)pars.size()) break;
+            std::vector<double> values(x.size());
+            component.batch(x.data(), x.size(), pars.data() + offset, values.data());
+            hash.Add(values);
+            offset += component.nPars;
+        }
+        hash.Add(fModelExpressions[iFit]);
+    }
+
+    for (const auto& [xMin, xMax] : fFitRange) hash.Add(xMin).Add(xMax);
+    hash.Add((long)fVariableProjection).Add((long)fMultiStart).Add((long)fMultiStartPolish);
+    hash.Add((long)fMultiStartCalls).Add((long)fMultiStartSeed);
+
+    std::map<std::string, std::pair<double, double>> start(fStartingPoint.begin(), fStartingPoint.end());
+    for (const auto& [name, point] : start) hash.Add(name).Add(point.first).Add(point.second);
+    return hash.Get();
+}
+
+// The result is written as text with full precision. The file is written under a temporary name and then renamed, so
+// that fitters running in parallel never read a partial file
+void SuperFitter::SaveResult(std::string fileName) {
+    std::filesystem::path path(fileName);
+    if (path.has_parent_path()) std::filesystem::create_directories(path.parent_path());
+
+    std::string tmpName = fileName + Form(".%p", (void*)this);
+    FILE* file = fopen(tmpName.data(), "w");
+    if (!file) {
+        printf("\033[33mWARNING: could not write the fit result to '%s'\033[0m\n", fileName.data());
+        return;
+    }
+
+    const int nDim = fParameters.size();
+    fprintf(file, "sf-fit-result 1\n%d\n", nDim);
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        fprintf(file, "%s %.17g %.17g\n", fParNames[iPar].data(), fParameters[iPar], fParErrors[iPar]);
+    }
+    fprintf(file, "%.17g %d %d %d\n", fChi2, fNdf, fStatus, fNCalls);
+    for (int i = 0; i < nDim; i++) {
+        for (int j = 0; j < nDim; j++) {
+            fprintf(file, "%.17g ", fCovariance.GetNrows() == nDim ? fCovariance(i, j) : 0.);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    std::filesystem::rename(tmpName, fileName);
+}
+
+bool SuperFitter::LoadResult(std::string fileName) {
+    FILE* file = fopen(fileName.data(), "r");
+    if (!file) return false;
+
+    // The header is checked before allocating anything, so that a corrupted dimension is never used
+    int version = 0, nDim = 0;
+    bool isValid = fscanf(file, "sf-fit-result %d %d", &version, &nDim) == 2 && version == 1 &&
+                   nDim == (int)fFirstOccurrences.size();
+    if (!isValid) {
+        fclose(file);
+        return false;
+    }
+
+    // The parameters must be the independent ones of this fitter, in the same order
+    std::vector<std::string> names(nDim);
+    std::vector<double> values(nDim), errors(nDim);
+    char name[1024];
+    for (int iPar = 0; isValid && iPar < nDim; iPar++) {
+        isValid = fscanf(file, "%1023s %lf %lf", name, &values[iPar], &errors[iPar]) == 3;
+        names[iPar] = name;
+        auto [iFit, iFitPar] = fFirstOccurrences[iPar];
+        isValid = isValid && names[iPar] == std::get<0>(fPars[iFit][iFitPar]);
+    }
+
+    double chi2 = 0;
+    int ndf = 0, status = 0, nCalls = 0;
+    isValid = isValid && fscanf(file, "%lf %d %d %d", &chi2, &ndf, &status, &nCalls) == 4;
+
+    TMatrixDSym covariance(nDim);
+    for (int i = 0; isValid && i < nDim; i++) {
+        for (int j = 0; isValid && j < nDim; j++) {
+            isValid = fscanf(file, "%lf", &covariance(i, j)) == 1;
+        }
+    }
+    fclose(file);
+    if (!isValid) return false;
+
+    fParNames = names;
+    fParameters = values;
+    fParErrors = errors;
+    fChi2 = chi2;
+    fNdf = ndf;
+    fStatus = status;
+    fNCalls = nCalls;
+    fCovariance.ResizeTo(nDim, nDim);
+    fCovariance = covariance;
+    return true;
+}
+
+// Data points of each fit: the bins in the fit range with positive uncertainty, as in ROOT::Fit::BinData, and the
+// model with the templates sampled at their centres
+std::vector<sf::dataset> SuperFitter::PrepareData() {
+    std::vector<sf::dataset> data(fFit.size());
+    for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
+        TH1* hObs = fObs[iFit]->GetHistogram();
+        std::vector<bool> mask = GetBinMask(hObs);
+        for (int iBin = 0; iBin < hObs->GetNbinsX(); iBin++) {
+            double unc = hObs->GetBinError(iBin + 1);
+            if (!mask[iBin] || unc <= 0) continue;
+
+            data[iFit].x.push_back(hObs->GetBinCenter(iBin + 1));
+            data[iFit].y.push_back(hObs->GetBinContent(iBin + 1));
+            data[iFit].invErr.push_back(1. / unc);
+        }
+        data[iFit].model = BindTemplates(fModels[iFit], fFunctions[iFit], data[iFit].x);
+    }
+    return data;
+}
+
+// Settings of the independent parameters, taken from their first occurrence, and of the minimizer
+void SuperFitter::ConfigureParameters(ROOT::Fit::FitConfig& config) {
+    std::vector<double> pars = {};
+    for (const auto& [iFit, iPar] : fFirstOccurrences) {
+        pars.push_back(std::get<1>(this->fPars[iFit][iPar]));
+    }
+    config.SetParamsSettings(pars.size(), pars.data());
+
+    for (size_t idx = 0; idx < fFirstOccurrences.size(); idx++) {
+        const auto& [iFit, iPar] = fFirstOccurrences[idx];
+        auto [name, centr, min, max] = this->fPars[iFit][iPar];
+
+        config.ParSettings(idx).SetName(name.data());
+
+        // Set Par Limits
+        if (min > max) {
+            config.ParSettings(idx).SetValue(centr);
+            config.ParSettings(idx).Fix();
+        } else {
+            if (!(min < centr && centr < max)) {
+                printf("\033[33mWARNING: parameter '%s' is outside the allowed range\033[0m\n", name.data());
+                centr = (min + max) / 2;
+            }
+
+            config.ParSettings(idx).SetValue(centr);
+            config.ParSettings(idx).SetLimits(min, max);
+
+            if (auto it = fStartingPoint.find(name); it != fStartingPoint.end()) {
+                auto [value, step] = it->second;
+                if (min < value && value < max) config.ParSettings(idx).SetValue(value);
+                if (step > 0) config.ParSettings(idx).SetStepSize(std::min(step, (max - min) / 2));
             }
         }
     }
-    return pars;
+
+    config.MinimizerOptions().SetPrintLevel(0);
+    config.SetMinimizer("Minuit2", "Migrad");
+}
+
+// Mask of the bins whose centre lies in the union of the fit ranges, with both edges of each range included. The
+// ranges can be given in any order and can overlap or touch: they are sorted and merged, so that the mask is filled
+// with a single sweep over the bins, whose centres are increasing
+std::vector<bool> SuperFitter::GetBinMask(TH1* hist) {
+    auto sorted = this->fFitRange;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::pair<double, double>> ranges = {};
+    for (const auto& range : sorted) {
+        if (!ranges.empty() && range.first <= ranges.back().second) {
+            ranges.back().second = std::max(ranges.back().second, range.second);
+        } else {
+            ranges.push_back(range);
+        }
+    }
+
+    std::vector<bool> mask(hist->GetNbinsX(), false);
+    size_t iRange = 0;
+    for (int iBin = 0; iBin < hist->GetNbinsX(); iBin++) {
+        double x = hist->GetBinCenter(iBin + 1);
+        while (iRange < ranges.size() && ranges[iRange].second < x) iRange++;
+        if (iRange == ranges.size()) break;
+
+        mask[iBin] = ranges[iRange].first <= x;
+    }
+    return mask;
+}
+
+// Minimize the chi2 wrt the nonlinear parameters only, with the linear ones solved by least squares at each step, and
+// set the minimum as the initial value of the parameters in the fit configuration. The least squares solution ignores
+// the limits of the linear parameters, which are enforced by the fit of all the parameters that follows
+void SuperFitter::ProjectLinearParameters(ROOT::Fit::FitConfig& config, const std::vector<sf::dataset>& data,
+                                          const std::vector<std::vector<int>>& iPars,
+                                          const ROOT::Math::IMultiGradFunction& chi2) {
+    const int nDim = chi2.NDim();
+
+    // The free parameters are linear if all the models in which they appear are affine in them
+    std::vector<bool> isLinear(nDim);
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        isLinear[iPar] = !config.ParSettings(iPar).IsFixed();
+    }
+    for (size_t iData = 0; iData < data.size(); iData++) {
+        std::vector<bool> local = LinearParameters(data[iData].model, fFunctions[iData]);
+        for (size_t iPar = 0; iPar < iPars[iData].size(); iPar++) {
+            if (!local[iPar]) isLinear[iPars[iData][iPar]] = false;
+        }
+    }
+
+    std::vector<int> linear = {}, nonlinear = {};
+    std::vector<double> init = {};
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        if (isLinear[iPar]) {
+            linear.push_back(iPar);
+        } else {
+            nonlinear.push_back(iPar);
+            init.push_back(config.ParSettings(iPar).Value());
+        }
+    }
+    if (linear.empty()) {
+        printf("\nVariable projection: no linear parameters to eliminate\n");
+        return;
+    }
+
+    printf("\nVariable projection: eliminating %zu linear parameters:", linear.size());
+    for (int iPar : linear) {
+        printf(" %s", config.ParSettings(iPar).Name().data());
+    }
+    printf("\n");
+
+    VarProChi2 varProChi2(data, iPars, linear, nonlinear, chi2);
+    bool hasFree = false;
+    for (int iPar : nonlinear) {
+        hasFree = hasFree || !config.ParSettings(iPar).IsFixed();
+    }
+
+    std::vector<double> full;
+    if (hasFree) {
+        ROOT::Fit::Fitter fitter;
+        fitter.Config().SetParamsSettings(nonlinear.size(), init.data());
+        for (size_t i = 0; i < nonlinear.size(); i++) {
+            fitter.Config().ParSettings(i) = config.ParSettings(nonlinear[i]);
+        }
+        fitter.Config().MinimizerOptions().SetPrintLevel(0);
+        fitter.Config().SetMinimizer("Minuit2", "Migrad");
+        fitter.FitFCN(varProChi2, nullptr, 0, true);
+        full = varProChi2.Solve(fitter.Result().GetParams());
+        printf("Variable projection: chi2 = %.3f after %u calls\n", fitter.Result().MinFcnValue(),
+               fitter.Result().NCalls());
+    } else {
+        full = varProChi2.Solve(init.data());
+    }
+
+    // The solution of the linear parameters is moved within their limits
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        auto& settings = config.ParSettings(iPar);
+        double value = full[iPar];
+        if (settings.HasLimits()) {
+            double margin = 1.e-6 * (settings.UpperLimit() - settings.LowerLimit());
+            value = std::clamp(value, settings.LowerLimit() + margin, settings.UpperLimit() - margin);
+        }
+        settings.SetValue(value);
+    }
 }
+
 // Fit
 void SuperFitter::Fit(const char* option) {
     if (fFitRange.size() == 0) {
@@ -690,77 +2459,124 @@ void SuperFitter::Fit(const char* option) {
     printf("\n");
 
     // Count the number of parameters:
+    IndexParameters();
     int nPars = GetN();
-    int nShared = GetNShared();
+    int nShared = nPars - fFirstOccurrences.size();
     printf("\nPerforming %zu fits simultaneously with %d parameters of which %d are shared\n", fFit.size(), nPars,
            nShared);
 
-    ROOT::Fit::DataOptions opt;
-    ROOT::Fit::DataRange range;
-    range.SetRange(fFitRange[0].first, fFitRange[fFitRange.size() - 1].second);
-
-    std::vector<ROOT::Fit::BinData> data = {};
-    std::vector<ROOT::Math::WrappedMultiTF1> wf = {};
-    std::vector<ROOT::Fit::Chi2Function*> chi2Func = {};
+    // Restore the result of a previous fit of the same inputs
+    std::string cacheFile = "";
+    if (!fCacheDirectory.empty()) {
+        cacheFile = fCacheDirectory + "/" + Form("%016llx", (unsigned long long)HashInputs(option)) + ".fit";
+        if (LoadResult(cacheFile)) {
+            printf("Fit result restored from '%s'\n", cacheFile.data());
+            for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
+                for (size_t iPar = 0; iPar < fGlobalIndeces[iFit].size(); iPar++) {
+                    this->fFit[iFit]->SetParameter(iPar, fParameters[fGlobalIndeces[iFit][iPar]]);
+                    this->fFit[iFit]->SetParError(iPar, fParErrors[fGlobalIndeces[iFit][iPar]]);
+                }
+            }
+            return;
+        }
+    }
 
     // Prepare machinery for custom global chi2
+    std::vector<sf::dataset> data = PrepareData();
+    std::vector<DatasetChi2*> chi2Func = {};
+    int nPoints = 0;
     for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
-        data.push_back(ROOT::Fit::BinData(opt, range));
-        wf.push_back(ROOT::Math::WrappedMultiTF1(*(fFit[iFit]), 1));
-        ROOT::Fit::FillData(data[iFit], fObs[iFit]->GetHistogram());
-        chi2Func.push_back(new ROOT::Fit::Chi2Function(data[iFit], wf[iFit]));
+        chi2Func.push_back(new DatasetChi2(data[iFit]));
+        nPoints += data[iFit].x.size();
     }
 
-    auto iPars = GetParameterIndeces(this->fPars);
+    const auto& iPars = fGlobalIndeces;
     GlobalChi2 globalChi2(chi2Func, iPars);
 
     ROOT::Fit::Fitter fitter;
+    ConfigureParameters(fitter.Config());
 
-    std::vector<double> pars = GetInitialParameters();
-    fitter.Config().SetParamsSettings(nPars - nShared, pars.data());
+    // Replace the starting point with the best minimum among several ones, to avoid local minima
+    if (fMultiStart > 0) {
+        MultiStart(data, fitter.Config());
+    }
+    // Use the analytic gradient when all the components provide their derivatives
+    bool isDifferentiable = true;
+    for (const auto& dataset : data) {
+        isDifferentiable = isDifferentiable && IsDifferentiable(dataset.model);
+    }
 
-    // Count the number of fit parameters
-    int idx = 0;
-    std::vector<std::string> seen = {};
-    for (int iFit = 0; iFit < fFit.size(); iFit++) {
-        for (int iPar = 0; iPar < this->fFit[iFit]->GetNpar(); iPar++) {
-            auto par = this->fPars[iFit][iPar];
-            std::string name = std::get<0>(par);
-            if (std::find(seen.begin(), seen.end(), name) != seen.end()) {
-                continue;
-            }
+    const int nDim = nPars - nShared;
+    std::vector<int> free = {};
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        if (!fitter.Config().ParSettings(iPar).IsFixed()) free.push_back(iPar);
+    }
+    ParallelChi2 parallelChi2(data, iPars, free, nDim);
 
-            double centr = std::get<1>(par);
-            double min = std::get<2>(par);
-            double max = std::get<3>(par);
-            seen.push_back(name);
+    std::unique_ptr<ROOT::Math::IMultiGradFunction> chi2Fcn;
+    if (isDifferentiable) {
+        chi2Fcn.reset(new GlobalChi2Grad(globalChi2, nDim));
+    } else {
+        // Finite-difference gradient with shifts much smaller than the initial steps of the minimizer
+        std::vector<double> steps(nDim);
+        for (int iPar = 0; iPar < nDim; iPar++) {
+            steps[iPar] = 1.e-4 * fitter.Config().ParSettings(iPar).StepSize();
+        }
+        chi2Fcn.reset(new GlobalChi2NumGrad(globalChi2, parallelChi2, steps));
+    }
 
-            fitter.Config().ParSettings(idx).SetName(name.data());
+    // The minimum found with the linear parameters eliminated is the starting point of the fit of all the parameters,
+    // which provides their uncertainties and enforces the limits of the linear ones
+    if (fVariableProjection) {
+        ProjectLinearParameters(fitter.Config(), data, iPars, *chi2Fcn);
+    }
 
-            // Set Par Limits
-            if (min > max) {
-                fitter.Config().ParSettings(idx).SetValue(centr);
-                fitter.Config().ParSettings(idx).Fix();
-            } else {
-                if (!(min < centr && centr < max)) {
-                    printf("\033[33mWARNING: parameter '%s' is outside the allowed range\033[0m\n", name.data());
-                    centr = (min + max) / 2;
-                }
+    fitter.FitFCN(*chi2Fcn, nullptr, nPoints, true);
+    ROOT::Fit::FitResult result = fitter.Result();
+    result.Print(std::cout);
 
-                fitter.Config().ParSettings(idx).SetValue(centr);
-                fitter.Config().ParSettings(idx).SetLimits(min, max);
-            }
-            idx++;
+    fChi2 = result.MinFcnValue();
+    fNdf = result.Ndf();
+    fStatus = result.Status();
+    fNCalls = result.NCalls();
+    fParNames.clear();
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        fParNames.push_back(fitter.Config().ParSettings(iPar).Name());
+    }
+    fParameters.assign(result.GetParams(), result.GetParams() + nDim);
+    fParErrors = result.Errors();
+
+    // Propagate the fit result to the fit functions
+    for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
+        for (size_t iPar = 0; iPar < iPars[iFit].size(); iPar++) {
+            this->fFit[iFit]->SetParameter(iPar, result.Parameter(iPars[iFit][iPar]));
+            this->fFit[iFit]->SetParError(iPar, result.ParError(iPars[iFit][iPar]));
         }
     }
 
+    // Covariance matrix from the Hessian at the minimum, evaluated in parallel
+    if (ComputeCovariance(parallelChi2, result, fitter.Config(), isDifferentiable)) {
+        printf("\nUncertainties from the Hessian at the minimum:\n");
+        for (int iPar : free) {
+            fParErrors[iPar] = std::sqrt(fCovariance(iPar, iPar));
+            printf("%-20s = %12.6g +/- %12.6g\n", fParNames[iPar].data(), result.Parameter(iPar), fParErrors[iPar]);
+        }
+
+        for (size_t iFit = 0; iFit < fFit.size(); iFit++) {
+            for (size_t iPar = 0; iPar < iPars[iFit].size(); iPar++) {
+                int idx = iPars[iFit][iPar];
+                this->fFit[iFit]->SetParError(iPar, std::sqrt(fCovariance(idx, idx)));
+            }
+        }
+    }
 
+    for (auto chi2 : chi2Func) {
+        delete chi2;
+    }
 
-    fitter.Config().MinimizerOptions().SetPrintLevel(0);
-    fitter.Config().SetMinimizer("Minuit2", "Migrad");
-    fitter.FitFCN(nPars - nShared, globalChi2, nullptr, data[0].Size() + data[1].Size(), true);
-    ROOT::Fit::FitResult result = fitter.Result();
-    result.Print(std::cout);
+    if (!cacheFile.empty()) {
+        SaveResult(cacheFile);
+    }
 
     // Check if fit parameters are AT LIMIT
     for (int iFit = 0; iFit < fFit.size(); iFit++) {
@@ -788,7 +2604,7 @@ void SuperFitter::Fit(const char* option) {
 
 // Add TF1 function // todo: remove units mult here and put in .py
 void SuperFitter::Add(int idx, std::string name, TF1* fTemplate, std::vector<sf::parameter> pars, double unitMult) {
-        if (idx > functions.size()) {
+        if (idx > fFunctions.size()) {
         throw std::invalid_argument("Index is larger than current length of the function list.");
     }
 
@@ -796,30 +2612,38 @@ void SuperFitter::Add(int idx, std::string name, TF1* fTemplate, std::vector<sf:
         throw std::invalid_argument("Index is larger than current length of the parameter list.");
     }
 
-    if (idx == functions.size()) {
-        functions.push_back({});
+    if (idx == fFunctions.size()) {
+        fFunctions.push_back({});
     }
 
     if (idx == fPars.size()) {
         fPars.push_back({});
     }
     
-    auto lambda = [fTemplate, unitMult](double* x, double* p) {
-        return p[0] * fTemplate->Eval(x[0] * unitMult);
-    };
-    functions[idx].push_back({name, lambda, 1});
+    auto shape = [fTemplate, unitMult](double x) { return fTemplate->Eval(x * unitMult); };
+    auto lambda = [shape](double* x, double* p) { return p[0] * shape(x[0]); };
+    sf::Hash hash;
+    hash.Add(std::string(fTemplate->GetName())).Add(std::string(fTemplate->GetExpFormula().Data())).Add(unitMult);
+    hash.Add(std::vector<double>(fTemplate->GetParameters(), fTemplate->GetParameters() + fTemplate->GetNpar()));
+    fFunctions[idx].push_back({name, lambda, Vectorize(lambda), 1, shape, ScaledGradient(shape), {0},
+                               Form("TF1:%016llx", (unsigned long long)hash.Get())});
 
     // Save fit settings
     printf("Adding '%s' function with parameters:\n", name.data());
     for (const auto& par : pars) {
         auto [name, centr, min, max] = par;
         printf("    name: %s   init: %.3f   min: %.3f   max: %.3f\n", name.data(), centr, min, max);
-        if (!IsParameterPresent(name)) {
-            this->fPars[idx].push_back(par);
-        }
+        this->fPars[idx].push_back(par);
     }
 }
 
+// Centres of the bins of a histogram
+std::vector<double> GetBinCenters(TH1* hist) {
+    std::vector<double> x(hist->GetNbinsX());
+    for (int iBin = 0; iBin < hist->GetNbinsX(); iBin++) x[iBin] = hist->GetBinCenter(iBin + 1);
+    return x;
+}
+
 bool HasConstantBinWidth(TH1* hist, double tol = 1e-9) {
     int nbins = hist->GetNbinsX();
     double ref_width = hist->GetBinWidth(1);
@@ -835,7 +2659,7 @@ bool HasConstantBinWidth(TH1* hist, double tol = 1e-9) {
 
 // Add template function
 void SuperFitter::Add(int idx, std::string name, TH1* hTemplate, std::vector<sf::parameter> pars) {
-    if (idx > functions.size()) {
+    if (idx > fFunctions.size()) {
         throw std::invalid_argument("Index is larger than current length of the function list.");
     }
 
@@ -843,8 +2667,8 @@ void SuperFitter::Add(int idx, std::string name, TH1* hTemplate, std::vector<sf:
         throw std::invalid_argument("Index is larger than current length of the parameter list.");
     }
 
-    if (idx == functions.size()) {
-        functions.push_back({});
+    if (idx == fFunctions.size()) {
+        fFunctions.push_back({});
     }
 
     if (idx == fPars.size()) {
@@ -875,17 +2699,21 @@ void SuperFitter::Add(int idx, std::string name, TH1* hTemplate, std::vector<sf:
         hObs->SetBinError(iBin + 1, std::sqrt(uncData * uncData + uncTempl * uncTempl));
     }
     
-    auto lambda = [hTemplate](double* x, double* p) { return p[0] * hTemplate->Interpolate(x[0]); };
-    functions[idx].push_back({name, lambda, 1});
+    auto shape = [hTemplate](double x) { return hTemplate->Interpolate(x); };
+    auto lambda = [shape](double* x, double* p) { return p[0] * shape(x[0]); };
+    sf::Hash hash;
+    for (int iBin = 1; iBin <= hTemplate->GetNbinsX() + 1; iBin++) {
+        hash.Add(hTemplate->GetBinLowEdge(iBin)).Add(hTemplate->GetBinContent(iBin));
+    }
+    fFunctions[idx].push_back({name, lambda, Vectorize(lambda), 1, shape, ScaledGradient(shape), {0},
+                               Form("TH1:%016llx", (unsigned long long)hash.Get())});
 
     // Save fit settings
     printf("Adding '%s' template with parameters:\n", name.data());
     for (const auto& par : pars) {
         auto [name, centr, min, max] = par;
         printf("    name: %s   init: %.3f   min: %.3f   max: %.3f\n", name.data(), centr, min, max);
-        if (!IsParameterPresent(name)) {
-            this->fPars[idx].push_back(par);
-        }
+        this->fPars[idx].push_back(par);
     }
 };
 
@@ -909,7 +2737,7 @@ int FindPoint(TGraph *g, double x) {
 }
 
 void SuperFitter::Add(int idx, std::string name, TGraphErrors* gTemplate, std::vector<sf::parameter> pars, double unitMult) {
-    if (idx > functions.size()) {
+    if (idx > fFunctions.size()) {
         throw std::invalid_argument("Index is larger than current length of the function list.");
     }
 
@@ -917,8 +2745,8 @@ void SuperFitter::Add(int idx, std::string name, TGraphErrors* gTemplate, std::v
         throw std::invalid_argument("Index is larger than current length of the parameter list.");
     }
 
-    if (idx == functions.size()) {
-        functions.push_back({});
+    if (idx == fFunctions.size()) {
+        fFunctions.push_back({});
     }
 
     if (idx == fPars.size()) {
@@ -936,298 +2764,585 @@ void SuperFitter::Add(int idx, std::string name, TGraphErrors* gTemplate, std::v
         hObs->SetBinError(iBin + 1, std::sqrt(uncData * uncData + uncTempl * uncTempl));
     }
 
-    auto lambda = [gTemplate, unitMult](double* x, double* p) { return p[0] * gTemplate->Eval(x[0] * unitMult); };
-    functions[idx].push_back({name, lambda, 1});
+    auto shape = [gTemplate, unitMult](double x) { return gTemplate->Eval(x * unitMult); };
+    auto lambda = [shape](double* x, double* p) { return p[0] * shape(x[0]); };
+    sf::Hash hash;
+    hash.Add(unitMult);
+    for (int iPoint = 0; iPoint < gTemplate->GetN(); iPoint++) {
+        hash.Add(gTemplate->GetPointX(iPoint)).Add(gTemplate->GetPointY(iPoint));
+    }
+    fFunctions[idx].push_back({name, lambda, Vectorize(lambda), 1, shape, ScaledGradient(shape), {0},
+                               Form("TGraph:%016llx", (unsigned long long)hash.Get())});
 
     // Save fit settings
     printf("Adding '%s' template with parameters:\n", name.data());
     for (const auto& par : pars) {
         auto [name, centr, min, max] = par;
         printf("    name: %s   init: %.3f   min: %.3f   max: %.3f\n", name.data(), centr, min, max);
-        if (!IsParameterPresent(name)) {
-            this->fPars[idx].push_back(par);
-        }
+        this->fPars[idx].push_back(par);
     }
 }
 
+// Minimize the chi2 of the given data without printing the result nor computing the Hessian. Can be called from
+// different threads, as the chi2 and the minimizer are local to the call
+ROOT::Fit::FitResult SuperFitter::Minimize(const std::vector<sf::dataset>& data, const ROOT::Fit::FitConfig& config) {
+    const auto& iPars = fGlobalIndeces;
+    const int nDim = config.ParamsSettings().size();
+
+    int nPoints = 0;
+    bool isDifferentiable = true;
+    std::vector<DatasetChi2> chi2Storage(data.begin(), data.end());
+    std::vector<DatasetChi2*> chi2Func = {};
+    for (size_t iFit = 0; iFit < data.size(); iFit++) {
+        nPoints += data[iFit].x.size();
+        isDifferentiable = isDifferentiable && IsDifferentiable(data[iFit].model);
+        chi2Func.push_back(&chi2Storage[iFit]);
+    }
+    GlobalChi2 globalChi2(chi2Func, iPars);
 
-// Draw
-void SuperFitter::Draw(int iFit, std::vector<std::pair<std::string, std::string>> recipes, std::string dataLabel, std::string legHeader) {
-    this->fTerms = {};
+    std::unique_ptr<ParallelChi2> parallelChi2;
+    std::unique_ptr<ROOT::Math::IMultiGradFunction> chi2Fcn;
+    if (isDifferentiable) {
+        chi2Fcn.reset(new GlobalChi2Grad(globalChi2, nDim));
+    } else {
+        std::vector<int> free = {};
+        std::vector<double> steps(nDim);
+        for (int iPar = 0; iPar < nDim; iPar++) {
+            if (!config.ParSettings(iPar).IsFixed()) free.push_back(iPar);
+            steps[iPar] = 1.e-4 * config.ParSettings(iPar).StepSize();
+        }
+        parallelChi2.reset(new ParallelChi2(data, iPars, free, nDim));
+        chi2Fcn.reset(new GlobalChi2NumGrad(globalChi2, *parallelChi2, steps));
+    }
 
-    printf("Start drawing\n");
+    ROOT::Fit::Fitter fitter;
+    fitter.Config() = config;
+    fitter.FitFCN(*chi2Fcn, nullptr, nPoints, true);
+    return fitter.Result();
+}
 
-    double legHeight = 0.06 * (1 + recipes.size());
-    if (!legHeader.empty()) {
-        legHeight += 0.06;
+void SuperFitter::MultiStart(const std::vector<sf::dataset>& data, ROOT::Fit::FitConfig& config) {
+    // The minimizers of the starting points create ROOT objects from different threads
+    ROOT::EnableThreadSafety();
+
+    const int nDim = config.ParamsSettings().size();
+    std::vector<int> free = {};
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        if (!config.ParSettings(iPar).IsFixed()) free.push_back(iPar);
     }
+    if (free.empty()) return;
+
+    // Latin hypercube: each parameter takes one value in each of nStarts equal strata of its range, in a random order.
+    // The user-given starting point is kept as the first one
+    const int nStarts = fMultiStart + 1;
+    std::vector<double> initial(nDim);
+    for (int iPar = 0; iPar < nDim; iPar++) initial[iPar] = config.ParSettings(iPar).Value();
+    std::vector<std::vector<double>> starts(nStarts, initial);
+    for (int iFree = 0; iFree < (int)free.size(); iFree++) {
+        const auto& settings = config.ParSettings(free[iFree]);
+        sf::CounterRNG rng(fMultiStartSeed, iFree);
+        std::vector<int> strata(fMultiStart);
+        for (int iStart = 0; iStart < fMultiStart; iStart++) strata[iStart] = iStart;
+        for (int iStart = fMultiStart - 1; iStart > 0; iStart--) {
+            std::swap(strata[iStart], strata[std::min<int>(rng.Uniform() * (iStart + 1), iStart)]);
+        }
 
-    TLegend* leg = new TLegend(0.55, 0.9 - legHeight, 0.9, 0.9);
-    if (!legHeader.empty()) {
-        leg->SetHeader(legHeader.data());
+        double min = settings.LowerLimit();
+        double width = (settings.UpperLimit() - min) / fMultiStart;
+        for (int iStart = 1; iStart < nStarts; iStart++) {
+            starts[iStart][free[iFree]] = min + width * (strata[iStart - 1] + rng.Uniform());
+        }
     }
-    
-    // Draw the fitted observable
-    this->fObsOrig[iFit]->Draw("hist same pe");
-    leg->AddEntry(this->fObsOrig[iFit], dataLabel.data(), "pe");
 
-    // Draw the final fit function
-    this->fFit[iFit]->Draw("same");
-
-    leg->AddEntry(this->fFit[iFit], "Total", "l");
-    // Draw components based on the draw recipes
-    for (int iRecipe = 0; iRecipe < recipes.size(); iRecipe++) {
-        std::string legend = recipes[iRecipe].first;
-        std::string recipe = recipes[iRecipe].second;
-        DEBUG(60, 0, "Drawing the recipe '%s'", recipe.data());
-
-        // Tokenization of the recipe
-        auto tokens = Tokenize(recipe);
-        DEBUG(60, 0, "[DRAW] recipe in infix: %s", join(" ", tokens).data());
-
-        // Count the number of parameters
-        std::set<int> paraList = {};
-        std::vector<int> nParsDraw = {};
-        std::set<std::string> used_tokens = {};
-        for (const auto& token : tokens) {
-            DEBUG(61, 1, "Processing token '%s'", token.data());
-
-            if (!IsFunction(token)) {
-                DEBUG(62, 2, "Token '%s' is not a function --> skip!", token.data());
-                continue;
+    // Short fits from all the starting points
+    ROOT::Fit::FitConfig shortConfig = config;
+    shortConfig.MinimizerOptions().SetMaxFunctionCalls(fMultiStartCalls > 0 ? fMultiStartCalls : 50 * free.size());
+    std::vector<double> chi2(nStarts);
+    std::vector<std::vector<double>> minima(nStarts), errors(nStarts);
+    sf::ThreadPool::Global().ParallelFor(nStarts, [&](int iStart, int) {
+        ROOT::Fit::FitConfig startConfig = shortConfig;
+        for (int iPar : free) startConfig.ParSettings(iPar).SetValue(starts[iStart][iPar]);
+        ROOT::Fit::FitResult result = Minimize(data, startConfig);
+        chi2[iStart] = std::isfinite(result.MinFcnValue()) ? result.MinFcnValue() : std::numeric_limits<double>::max();
+        minima[iStart].assign(result.GetParams(), result.GetParams() + nDim);
+        errors[iStart] = result.Errors();
+    });
+
+    // Start a fit from a minimum, with its uncertainties as initial steps so that Minuit starts with its estimate of
+    // the covariance. The steps are capped at half of the range of the parameters
+    auto startFrom = [&](ROOT::Fit::FitConfig& target, const std::vector<double>& values,
+                         const std::vector<double>& steps) {
+        for (int iPar : free) {
+            auto& settings = target.ParSettings(iPar);
+            settings.SetValue(values[iPar]);
+            if (iPar < (int)steps.size() && steps[iPar] > 0 && std::isfinite(steps[iPar])) {
+                settings.SetStepSize(std::min(steps[iPar], (settings.UpperLimit() - settings.LowerLimit()) / 2));
             }
+        }
+    };
 
-            int counter = GetIndex(functions[iFit], token);
-            int offset = ComputeOffset(functions[iFit], counter);
-
-            // Determine the number of parameters
-            for (int iFunc = 0; iFunc < functions[iFit].size(); iFunc++) {
-                auto name = std::get<0>(functions[iFit][iFunc]);
-                DEBUG(62, 2, "Comparing with function '%s'", name.data());
-                if (name == token && used_tokens.find(token) == used_tokens.end()) {
-                    int nPars = std::get<2>(functions[iFit][iFunc]);
-                    DEBUG(63, 3, "It's a match! Number of parameters: %d", nPars);
-                    nParsDraw.push_back(nPars);
-                    // Determine the position of the function in the list of functions
-                    for (int iPar = 0; iPar < nPars; iPar++) {
-                        paraList.insert(offset + iPar);
-                    }
-                    break;
-                }
+    // Prune: keep the best candidates that are not in the same basin as a better one, i.e. that differ from it by more
+    // than 1% of the range of some parameter
+    std::vector<int> order(nStarts);
+    for (int iStart = 0; iStart < nStarts; iStart++) order[iStart] = iStart;
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return chi2[a] < chi2[b]; });
+    std::vector<int> candidates = {};
+    for (int iStart : order) {
+        if ((int)candidates.size() >= fMultiStartPolish) break;
+
+        bool isDistinct = true;
+        for (int iCandidate : candidates) {
+            bool isClose = true;
+            for (int iPar : free) {
+                const auto& settings = config.ParSettings(iPar);
+                double range = settings.UpperLimit() - settings.LowerLimit();
+                isClose = isClose && std::fabs(minima[iStart][iPar] - minima[iCandidate][iPar]) < 0.01 * range;
             }
+            isDistinct = isDistinct && !isClose;
         }
+        if (isDistinct) candidates.push_back(iStart);
+    }
 
-        DEBUG(60, 0, "ParaList:");
-        for (const auto& e : paraList) {
-            DEBUG(61, 1, "%d value: %.3f", e, this->fFit[iFit]->GetParameter(e));
-        }
+    // Polish the candidates to convergence
+    std::vector<double> polishedChi2(candidates.size());
+    std::vector<std::vector<double>> polished(candidates.size()), polishedErrors(candidates.size());
+    sf::ThreadPool::Global().ParallelFor(candidates.size(), [&](int iCandidate, int) {
+        ROOT::Fit::FitConfig candidateConfig = config;
+        startFrom(candidateConfig, minima[candidates[iCandidate]], errors[candidates[iCandidate]]);
+        ROOT::Fit::FitResult result = Minimize(data, candidateConfig);
+        polishedChi2[iCandidate] = result.MinFcnValue();
+        polished[iCandidate].assign(result.GetParams(), result.GetParams() + nDim);
+        polishedErrors[iCandidate] = result.Errors();
+    });
+
+    int best = std::min_element(polishedChi2.begin(), polishedChi2.end()) - polishedChi2.begin();
+    printf("\nMulti-start search: %d starting points, %zu candidates polished\n", nStarts, candidates.size());
+    for (size_t iCandidate = 0; iCandidate < candidates.size(); iCandidate++) {
+        printf("    start %3d: chi2 = %12.6g after the short fit, %12.6g after polishing%s\n", candidates[iCandidate],
+               chi2[candidates[iCandidate]], polishedChi2[iCandidate], (int)iCandidate == best ? "  <-- best" : "");
+    }
 
-        // Convert to Reverse Polish Notation
-        auto rpn = toRPN(tokens);
-        DEBUG(60, 0, "[DRAW] Expression in RPN: %s", join(" ", rpn).data());
+    startFrom(config, polished[best], polishedErrors[best]);
+}
 
-        for (const int& d : nParsDraw) {
-            DEBUG(61, 1, "par draw: %d", d);
-        }
+void SuperFitter::Bootstrap(int nReplicas, std::string mode, unsigned long seed) {
+    if (fParameters.empty()) {
+        throw std::runtime_error("The bootstrap starts from the result of a fit, call Fit first");
+    }
+    if (mode != "gaus" && mode != "poisson") {
+        throw std::invalid_argument("Unknown bootstrap mode '" + mode + "'");
+    }
 
-        // The following lambda evaluates the fit function
-        auto lambda = [this, rpn, nParsDraw, iFit](double* x, double* p) -> double {
-            std::stack<double> stack;
+    // The fitters of the replicas create ROOT objects from different threads
+    ROOT::EnableThreadSafety();
+
+    IndexParameters();
+    const std::vector<sf::dataset> nominal = PrepareData();
+
+    // Start from the nominal result, with its uncertainties as initial steps
+    ROOT::Fit::FitConfig config;
+    ConfigureParameters(config);
+    const int nDim = fParameters.size();
+    std::vector<int> free = {};
+    for (int iPar = 0; iPar < nDim; iPar++) {
+        auto& settings = config.ParSettings(iPar);
+        if (settings.IsFixed()) continue;
+
+        free.push_back(iPar);
+        settings.SetValue(fParameters[iPar]);
+        if (fParErrors[iPar] > 0) {
+            double range = settings.UpperLimit() - settings.LowerLimit();
+            settings.SetStepSize(std::min(fParErrors[iPar], range / 2));
+        }
+    }
 
-            DEBUG(60, 0, "[DRAW] Compute fit function from RPN: '%s'", join(" ", rpn).data());
-            std::vector<std::pair<std::string, int>> nParameters = {};  // token, npars
-            int idx = 0;
-            for (const std::string& token : rpn) {
-                DEBUG(61, 1, "[DRAW] Start processing the token '%s'", token.data());
-                if (stack.size() == 0) {
-                    DEBUG(61, 1, "[DRAW] Stack is empty");
+    printf("Fitting %d bootstrap replicas on %d threads\n", nReplicas, sf::ThreadPool::Global().GetNThreads());
+    fBootstrapPars.assign(nReplicas, {});
+    fBootstrapStatus.assign(nReplicas, -1);
+    sf::ThreadPool::Global().ParallelFor(nReplicas, [&](int iReplica, int) {
+        // Each point has its own random stream, so the replicas do not depend on the number of threads
+        std::vector<sf::dataset> data = nominal;
+        for (size_t iFit = 0; iFit < data.size(); iFit++) {
+            for (size_t iPoint = 0; iPoint < data[iFit].x.size(); iPoint++) {
+                sf::CounterRNG rng(seed, iReplica, (uint64_t)iFit << 32 | iPoint);
+                double& y = data[iFit].y[iPoint];
+                double sigma = 1. / data[iFit].invErr[iPoint];
+                if (mode == "gaus" || y <= 0) {
+                    // Bins that are not positive have no counts to resample, so they fluctuate like Gaussians
+                    y += sigma * rng.Gaus();
                 } else {
-                    DEBUG(61, 1, "[DRAW] Stack is: '%s'", join(" ", stack_to_vector(stack)).data());
+                    // Counts with the same relative uncertainty as the bin
+                    double nEff = (y / sigma) * (y / sigma);
+                    y *= rng.Poisson(nEff) / nEff;
                 }
+            }
+        }
 
-                if (isdigit(token[0]) || token[0] == '.') {
-                    DEBUG(62, 2, "[DRAW] Token '%s' is a number", token.data());
-                    // Push numbers
-                    stack.push(std::stod(token));
-                } else if (IsFunction(token)) {
-                    DEBUG(62, 2, "[DRAW] Token '%s' is a function with %d parameters", token.data(), 1);
-
-                    // inly insert if not already present -> avoid duplicates
-                    if (std::find(nParameters.begin(), nParameters.end(), std::pair(token, 1)) == nParameters.end()) {
-                        for (const auto& [name, _, npar] : functions[iFit]) {
-                            if (name == token) {
-                                nParameters.push_back({token, npar});
-                            }
-                        }
-                    }
+        ROOT::Fit::FitResult result = Minimize(data, config);
+        fBootstrapPars[iReplica].assign(result.GetParams(), result.GetParams() + nDim);
+        fBootstrapStatus[iReplica] = result.Status();
+    });
 
-                    // Compute offset
-                    int shift = 0;
-                    for (const auto& [name, np] : nParameters) {
-                        if (name == token) break;
-                        shift += np;
-                    }
-                    
-                    int counter = GetIndex(functions[iFit], token);
+    // Summary of the distributions of the parameters
+    std::vector<sf::RunningStats> stats(nDim);
+    for (int iReplica = 0; iReplica < nReplicas; iReplica++) {
+        if (fBootstrapStatus[iReplica] != 0) continue;
+        for (int iPar = 0; iPar < nDim; iPar++) stats[iPar].Add(fBootstrapPars[iReplica][iPar]);
+    }
+
+    printf("\nBootstrap of %d replicas, %ld of which converged:\n", nReplicas, nDim ? stats[0].GetCount() : 0);
+    for (int iPar : free) {
+        printf("%-20s = %12.6g +/- %12.6g  (median %12.6g, 68%% interval [%.6g, %.6g])\n", fParNames[iPar].data(),
+               stats[iPar].GetMean(), stats[iPar].GetStdDev(), stats[iPar].GetQuantile(1), stats[iPar].GetQuantile(0),
+               stats[iPar].GetQuantile(2));
+    }
+}
 
-                    // Determine the position of the function in the list of functions
-                    auto func = std::get<1>(functions[iFit][counter]);
-                    double value = func(x, p + shift);
+std::vector<double> SuperFitter::Scan(std::vector<std::string> names, std::vector<std::vector<double>> points) {
+    // The minimizers of the chains create ROOT objects from different threads
+    ROOT::EnableThreadSafety();
 
-                    DEBUG(62, 2, "[DRAW] Counter: %d/%zu    Offset: %d", counter, functions[iFit].size(), shift);
-                    DEBUG(62, 2, "[DRAW] Pushing %s(x=%.3f, p) = %.3f", token.data(), x[0], value);
+    IndexParameters();
+    std::vector<int> scanned = {};
+    for (const auto& name : names) {
+        auto it = fParIndeces.find(name);
+        if (it == fParIndeces.end()) {
+            throw std::invalid_argument("Parameter '" + name + "' is not in the fit");
+        }
+        scanned.push_back(it->second);
+    }
+    for (const auto& point : points) {
+        if (point.size() != scanned.size()) {
+            throw std::invalid_argument("The points of the scan must have one value per scanned parameter");
+        }
+    }
 
-                    stack.push(value);
-                } else if (IsOperator(token)) {
-                    ProcessOperatorToken(stack, token);
-                } else {
-                    DEBUG(62, 2, "[DRAW] Token '%s' is unknown", token.data());
-                    throw std::runtime_error("Unknown token: " + token);
-                }
+    // The chains start from the result of the last fit, if any
+    const std::vector<sf::dataset> data = PrepareData();
+    ROOT::Fit::FitConfig config;
+    ConfigureParameters(config);
+    const int nDim = config.ParamsSettings().size();
+    if ((int)fParameters.size() == nDim) {
+        for (int iPar = 0; iPar < nDim; iPar++) {
+            auto& settings = config.ParSettings(iPar);
+            if (settings.IsFixed()) continue;
+
+            settings.SetValue(fParameters[iPar]);
+            if (fParErrors[iPar] > 0) {
+                double range = settings.UpperLimit() - settings.LowerLimit();
+                settings.SetStepSize(std::min(fParErrors[iPar], range / 2));
+            }
+        }
+    }
+    for (int iPar : scanned) config.ParSettings(iPar).Fix();
+
+    const int nPoints = points.size();
+    const int nChains = std::clamp(nPoints / kMinScanChainLength, 1, kMaxScanChains);
+    printf("Scanning %d points on %d threads\n", nPoints, sf::ThreadPool::Global().GetNThreads());
+
+    std::vector<double> chi2(nPoints, std::numeric_limits<double>::quiet_NaN());
+    fScanPars.assign(nPoints, {});
+    fScanStatus.assign(nPoints, -1);
+    sf::ThreadPool::Global().ParallelFor(nChains, [&](int iChain, int) {
+        ROOT::Fit::FitConfig chainConfig = config;
+        for (int iPoint = iChain * nPoints / nChains; iPoint < (iChain + 1) * nPoints / nChains; iPoint++) {
+            for (size_t iScanned = 0; iScanned < scanned.size(); iScanned++) {
+                chainConfig.ParSettings(scanned[iScanned]).SetValue(points[iPoint][iScanned]);
+            }
 
-                DEBUG(61, 1, "[DRAW] Stack after processing the token: '%s'", join(" ", stack_to_vector(stack)).data());
+            ROOT::Fit::FitResult result = Minimize(data, chainConfig);
+            chi2[iPoint] = result.MinFcnValue();
+            fScanPars[iPoint].assign(result.GetParams(), result.GetParams() + nDim);
+            fScanStatus[iPoint] = result.Status();
+
+            // Warm start of the next point
+            if (result.Status() != 0) continue;
+            for (int iPar = 0; iPar < nDim; iPar++) {
+                if (!chainConfig.ParSettings(iPar).IsFixed()) chainConfig.ParSettings(iPar).SetValue(result.Parameter(iPar));
             }
+        }
+    });
 
-            DEBUG(60, 0, "[DRAW] End of evaluation, return value is: '%s'", join(" ", stack_to_vector(stack)).data());
+    int nFailed = std::count_if(fScanStatus.begin(), fScanStatus.end(), [](int status) { return status != 0; });
+    printf("Scan done: %d points, %d of which did not converge\n", nPoints, nFailed);
+    return chi2;
+}
 
-            if (stack.size() != 1) throw std::runtime_error("Invalid RPN expression");
-            return stack.top();
-        };
+std::vector<double> SuperFitter::ScanGrid(std::vector<std::string> names, std::vector<std::vector<double>> axes) {
+    // Visit the grid as a reflected mixed-radix Gray code (a serpentine in two dimensions), so that consecutive points
+    // are neighbours
+    const int nAxes = axes.size();
+    int nPoints = 1;
+    for (const auto& axis : axes) nPoints *= axis.size();
+
+    std::vector<int> digits(nAxes, 0);
+    std::vector<int> directions(nAxes, 1);
+    std::vector<int> order = {};
+    std::vector<std::vector<double>> points = {};
+    for (int iPoint = 0; iPoint < nPoints; iPoint++) {
+        int index = 0;
+        std::vector<double> point = {};
+        for (int iAxis = 0; iAxis < nAxes; iAxis++) {
+            index = index * axes[iAxis].size() + digits[iAxis];
+            point.push_back(axes[iAxis][digits[iAxis]]);
+        }
+        order.push_back(index);
+        points.push_back(point);
+
+        for (int iAxis = nAxes - 1; iAxis >= 0; iAxis--) {
+            int next = digits[iAxis] + directions[iAxis];
+            if (0 <= next && next < (int)axes[iAxis].size()) {
+                digits[iAxis] = next;
+                break;
+            }
+            directions[iAxis] *= -1;
+        }
+    }
 
-        DEBUG(60, 0, "Term '%s' needs %lu parameters", recipe.data(), paraList.size());
+    std::vector<double> scanned = Scan(names, points);
 
-        TF1* fTerm =
-            new TF1(Form("fTerm%d", iRecipe), lambda, this->fDrawRangeMin, this->fDrawRangeMax, paraList.size());
+    // Back to row-major order
+    std::vector<double> chi2(nPoints);
+    std::vector<std::vector<double>> pars(nPoints);
+    std::vector<int> status(nPoints);
+    for (int iPoint = 0; iPoint < nPoints; iPoint++) {
+        chi2[order[iPoint]] = scanned[iPoint];
+        pars[order[iPoint]] = fScanPars[iPoint];
+        status[order[iPoint]] = fScanStatus[iPoint];
+    }
+    fScanPars = pars;
+    fScanStatus = status;
+    return chi2;
+}
 
-        fTerm->SetLineColor(colors[iRecipe]);
-        fTerm->SetLineWidth(2);
-        fTerm->SetNpx(10000);
+TH2D* SuperFitter::ScanMap(std::string xName, int nX, double xMin, double xMax, std::string yName, int nY,
+                           double yMin, double yMax) {
+    TH2D* hMap = new TH2D("hScanMap", Form(";%s;%s;#chi^{2}", xName.data(), yName.data()), nX, xMin, xMax, nY, yMin,
+                          yMax);
+    hMap->SetDirectory(nullptr);
 
-        int counter = 0;
-        for (const int& par : paraList) {
-            DEBUG(62, 2, "parameter val: %.3f", this->fFit[iFit]->GetParameter(par));
-            fTerm->FixParameter(counter++, this->fFit[iFit]->GetParameter(par));
+    std::vector<std::vector<double>> axes(2);
+    for (int iX = 0; iX < nX; iX++) axes[0].push_back(hMap->GetXaxis()->GetBinCenter(iX + 1));
+    for (int iY = 0; iY < nY; iY++) axes[1].push_back(hMap->GetYaxis()->GetBinCenter(iY + 1));
+
+    std::vector<double> chi2 = ScanGrid({xName, yName}, axes);
+    for (int iX = 0; iX < nX; iX++) {
+        for (int iY = 0; iY < nY; iY++) {
+            hMap->SetBinContent(iX + 1, iY + 1, chi2[iX * nY + iY]);
         }
-        fTerm->Draw("same");
-        fTerms.push_back(fTerm);
-        leg->AddEntry(fTerm, legend.data(), "l");
     }
-    leg->DrawClone("same");
-};
+    return hMap;
+}
 
-// Get genuine correlation function
-TH1D* SuperFitter::GetGenuineCF(int idx, std::string recipe) {
-    // todo: change
-    TH1D* hRawCF = (TH1D*)this->fObs[idx]->GetHistogram();
-    TH1D* hGenCF = (TH1D*)hRawCF->Clone("hGenCF");
-    hGenCF->Reset();
+TH1D* SuperFitter::GetBootstrapBand(int iFit) {
+    TH1* hObs = fObs[iFit]->GetHistogram();
+    std::vector<double> edges = {};
+    for (int iBin = 1; iBin <= hObs->GetNbinsX() + 1; iBin++) edges.push_back(hObs->GetBinLowEdge(iBin));
+    TH1D* hBand = new TH1D(Form("hBootstrapBand%d", iFit), ";#it{k}* (GeV/#it{c});#it{C}(#it{k}*)", hObs->GetNbinsX(),
+                           edges.data());
+    hBand->SetDirectory(nullptr);
+
+    std::vector<sf::RunningStats> stats(hObs->GetNbinsX());
+    std::vector<double> pars(fGlobalIndeces[iFit].size());
+    for (size_t iReplica = 0; iReplica < fBootstrapPars.size(); iReplica++) {
+        if (fBootstrapStatus[iReplica] != 0) continue;
+
+        for (size_t iPar = 0; iPar < pars.size(); iPar++) {
+            pars[iPar] = fBootstrapPars[iReplica][fGlobalIndeces[iFit][iPar]];
+        }
+        for (int iBin = 0; iBin < hObs->GetNbinsX(); iBin++) {
+            double x = hObs->GetBinCenter(iBin + 1);
+            stats[iBin].Add(Evaluate(fModels[iFit], &x, pars.data()));
+        }
+    }
+
+    for (int iBin = 0; iBin < hObs->GetNbinsX(); iBin++) {
+        if (stats[iBin].GetCount() == 0) continue;
+        hBand->SetBinContent(iBin + 1, stats[iBin].GetMean());
+        hBand->SetBinError(iBin + 1, stats[iBin].GetStdDev());
+    }
+    return hBand;
+}
+
+// Sample the recipes of a fit on a grid over the draw range, with the current parameters of the fit function. The
+// recipes share the cache of the components, so that each component is evaluated once for all of them, and the graphs
+// are kept until the parameters or the draw range change
+std::vector<TGraph*> SuperFitter::SampleRecipes(int iFit, const std::vector<std::string>& recipes) {
+    const int nPars = this->fFit[iFit]->GetNpar();
+    const std::vector<double> pars(this->fFit[iFit]->GetParameters(), this->fFit[iFit]->GetParameters() + nPars);
+
+    std::vector<double> x(fDrawNpx);
+    for (int iPoint = 0; iPoint < fDrawNpx; iPoint++) {
+        x[iPoint] = fDrawRangeMin + (fDrawRangeMax - fDrawRangeMin) * iPoint / std::max(fDrawNpx - 1, 1);
+    }
 
+    sf::cache cache;
+    cache.Reset(fFunctions[iFit].size());
+    std::vector<TGraph*> graphs = {};
+    for (const auto& recipe : recipes) {
+        auto& term = this->fDrawCache[{iFit, recipe}];
+        if (!term.graph || term.pars != pars || term.x != x) {
+            DEBUG(60, 0, "Sampling the recipe '%s'", recipe.data());
+            sf::tape tape = BindTemplates(Compile(toRPN(Tokenize(recipe), fFunctions), fFunctions[iFit]),
+                                          fFunctions[iFit], x);
+            std::vector<double> buffer(std::max(tape.depth - 1, 0) * fDrawNpx), y(fDrawNpx);
+            Evaluate(tape, x.data(), fDrawNpx, pars.data(), buffer.data(), y.data(), &cache);
+
+            delete term.graph;
+            term = {pars, x, new TGraph(fDrawNpx, x.data(), y.data())};
+        }
+
+        // Named after the position in this request also when it comes from the cache
+        term.graph->SetName(Form("gTerm%d_%zu", iFit, graphs.size()));
+        graphs.push_back(term.graph);
+    }
+    return graphs;
+}
+
+// Draw
+void SuperFitter::Draw(int iFit, std::vector<std::pair<std::string, std::string>> recipes, std::string dataLabel, std::string legHeader) {
+    printf("Start drawing\n");
+
+    double legHeight = 0.06 * (1 + recipes.size());
+    if (!legHeader.empty()) {
+        legHeight += 0.06;
+    }
+
+    TLegend* leg = new TLegend(0.55, 0.9 - legHeight, 0.9, 0.9);
+    if (!legHeader.empty()) {
+        leg->SetHeader(legHeader.data());
+    }
+    
     // Draw the fitted observable
-    // todo: change
-    this->fObs[0]->Draw("hist same pe");
+    TH1* hObsDrawn = this->fObsOrig[iFit]->GetHistogram()->DrawCopy("hist same pe");
+    leg->AddEntry(hObsDrawn, dataLabel.data(), "pe");
 
     // Draw the final fit function
-    this->fFit[0]->Draw("same");
+    TF1* fFitDrawn = this->fFit[iFit]->DrawCopy("same");
+
+    leg->AddEntry(fFitDrawn, "Total", "l");
 
-    // Tokenization of the recipe
-    auto tokens = Tokenize(recipe);
+    // Draw components based on the draw recipes, sampled all together
+    std::vector<std::string> expressions = {};
+    for (const auto& [legend, recipe] : recipes) expressions.push_back(recipe);
+    this->fTerms = SampleRecipes(iFit, expressions);
+
+    for (size_t iRecipe = 0; iRecipe < recipes.size(); iRecipe++) {
+        TGraph* gTerm = this->fTerms[iRecipe];
+        gTerm->SetLineColor(colors[iRecipe % 12]);
+        gTerm->SetLineWidth(2);
+        TObject* gTermDrawn = gTerm->DrawClone("l same");
+        leg->AddEntry(gTermDrawn, recipes[iRecipe].first.data(), "l");
+    }
+    leg->DrawClone("same");
+};
 
-    // Count the number of parameters
-    std::set<int> paraList = {};
-    std::vector<int> nParsDraw = {};
-    std::set<std::string> used_tokens = {};
-    for (const auto& token : tokens) {
-        int counter = 0;
-        for (const auto& [name, _, __] : functions[idx]) {
-            if (name == token) break;
-            counter++;
+// Genuine correlation function
+// Compile a recipe of the fit idx for its evaluation over the bins of the observable. The token "raw" stands for the
+// content of the bins plus an extra parameter after the ones of the fit, which is zero for the values of the recipe and
+// whose derivative is the sensitivity of each bin of the recipe to the data
+sf::tape SuperFitter::CompileRecipe(int idx, std::string recipe) {
+    TH1* hRawCF = this->fObs[idx]->GetHistogram();
+    std::vector<double> raw(hRawCF->GetNbinsX());
+    for (int iBin = 0; iBin < hRawCF->GetNbinsX(); iBin++) raw[iBin] = hRawCF->GetBinContent(iBin + 1);
+
+    // Only evaluated in batch over all the bins, so the points are not needed
+    sf::component data = {"raw", nullptr, nullptr, 1, nullptr, nullptr, {0}};
+    data.batch = [raw](const double* x, int n, const double* p, double* out) {
+        for (int i = 0; i < n; i++) out[i] = raw[i] + p[0];
+    };
+    data.grad = [raw](const double* x, int n, const double* p, double* out, double* jac) {
+        for (int i = 0; i < n; i++) {
+            out[i] = raw[i] + p[0];
+            jac[i] = 1;
         }
+    };
 
-        int offset = 0;
-        for (int iFunc = 0; iFunc < counter; iFunc++) {
-            offset += std::get<2>(functions[idx][iFunc]);
-        }
-
-        // Determine the number of parameters
-        for (int iFunc = 0; iFunc < functions[idx].size(); iFunc++) {
-            auto name = std::get<0>(functions[idx][iFunc]);
-            if (name == token && used_tokens.find(token) == used_tokens.end()) {
-                int nPars = std::get<2>(functions[idx][iFunc]);
-                nParsDraw.push_back(nPars);
-                // Determine the position of the function in the list of functions
-                for (int iPar = 0; iPar < nPars; iPar++) {
-                    paraList.insert(offset + iPar);
-                }
-                break;
-            }
+    std::vector<sf::component> funcs = fFunctions[idx];
+    funcs.push_back(data);
+    std::vector<std::vector<sf::component>> registry = {funcs};
+    return BindTemplates(Compile(toRPN(Tokenize(recipe), registry), funcs), funcs, GetBinCenters(hRawCF));
+}
+
+// Genuine correlation function given by a recipe, evaluated with the parameters of the fit function. The uncertainty
+// of each bin propagates the covariance of the fit parameters with the derivatives of the recipe, and adds the
+// statistical uncertainty of the data for recipes that contain "raw", neglecting the correlation between the two. The
+// latter is taken from the original observable, since the fitted one also includes the uncertainties of the templates,
+// which are already in the covariance of the fit parameters
+TH1D* SuperFitter::GetGenuineCF(int idx, std::string recipe) {
+    TH1* hRawCF = this->fObs[idx]->GetHistogram();
+    TH1* hDataCF = this->fObsOrig[idx]->GetHistogram();
+    TH1D* hGenCF = (TH1D*)hRawCF->Clone("hGenCF");
+    hGenCF->Reset();
+
+    const sf::tape tape = CompileRecipe(idx, recipe);
+    const int n = hRawCF->GetNbinsX();
+    const int nFitPars = fFit[idx]->GetNpar();
+    const int nPars = tape.nPars;  // Parameters of the fit and the one of the data
+
+    std::vector<double> pars(fFit[idx]->GetParameters(), fFit[idx]->GetParameters() + nFitPars);
+    pars.push_back(0);
+
+    int maxPars = 1;
+    for (const auto& instr : tape.code) maxPars = std::max(maxPars, instr.nPars);
+    std::vector<double> buffer(tape.depth * n), dBuffer(tape.depth * nPars * n), jac(maxPars * n);
+    std::vector<double> values(n), derivatives(nPars * n);
+    const std::vector<double> x = GetBinCenters(hRawCF);
+    EvaluateGradient(tape, x.data(), n, pars.data(), buffer.data(), dBuffer.data(), jac.data(), values.data(),
+                     derivatives.data());
+
+    // Covariance of the parameters of this fit, from the combined fit if available
+    IndexParameters();
+    TMatrixDSym covariance(nFitPars);
+    const bool hasCovariance = fCovariance.GetNrows() == (int)fParameters.size() && !fParameters.empty();
+    for (int a = 0; a < nFitPars; a++) {
+        if (!hasCovariance) {
+            covariance(a, a) = std::pow(fFit[idx]->GetParError(a), 2);
+            continue;
+        }
+        for (int b = 0; b < nFitPars; b++) {
+            covariance(a, b) = fCovariance(fGlobalIndeces[idx][a], fGlobalIndeces[idx][b]);
         }
     }
 
-    // Convert to Reverse Polish Notation
-    auto rpn = toRPN(tokens);
-
-    // The following lambda evaluates the fit function
-    for (int iBin = 0; iBin < hGenCF->GetNbinsX(); iBin++) {
-        double x = hGenCF->GetBinCenter(iBin + 1);
-
-        std::stack<double> stack;
-
-        std::vector<std::pair<std::string, int>> nParameters = {};  // token, npars
-        for (const std::string& token : rpn) {
-            if (isdigit(token[0]) || token[0] == '.') {
-                // Push numbers
-                stack.push(std::stod(token));
-            } else if (token == "raw") {
-                stack.push(hRawCF->GetBinContent(iBin + 1));
-            } else if (IsFunction(token)) {
-                int counter = GetIndex(functions[idx], token);
-                int offset = ComputeOffset(functions[idx], counter);
-                auto func = std::get<1>(functions[idx][counter]);
-                if (!func)  {
-                    throw std::runtime_error("function is null");
-                }
-
-                double* pars = fFit[idx]->GetParameters();
-                double value = func(&x, pars + offset);
-                stack.push(value);
-            } else if (IsOperator(token)) {
-                // Apply operator
-                if (stack.size() < 2) throw std::runtime_error("Insufficient arguments for operator");
-                double b = stack.top();
-                stack.pop();
-                double a = stack.top();
-                stack.pop();
-
-                if (token == "+")
-                    stack.push(a + b);
-                else if (token == "-")
-                    stack.push(a - b);
-                else if (token == "*")
-                    stack.push(a * b);
-                else if (token == "/")
-                    stack.push(a / b);
-                else
-                    throw std::runtime_error("Unknown operator");
-            } else {
-                throw std::runtime_error("Unknown token: " + token);
+    for (int iBin = 0; iBin < n; iBin++) {
+        double variance = 0;
+        for (int a = 0; a < nFitPars; a++) {
+            double da = derivatives[a * n + iBin];
+            if (da == 0) continue;
+            for (int b = 0; b < nFitPars; b++) {
+                variance += da * covariance(a, b) * derivatives[b * n + iBin];
             }
         }
+        variance += std::pow(derivatives[nFitPars * n + iBin] * hDataCF->GetBinError(iBin + 1), 2);
 
-        if (stack.size() != 1) throw std::runtime_error("Invalid RPN expression");
-
-        double cf = stack.top();
-        double cfUnc = hRawCF->GetBinError(iBin + 1) * 2;  //! Use proper uncertainty
-
+        double cf = values[iBin];
+        double cfUnc = std::sqrt(variance);
         if (std::isfinite(cf) && std::isfinite(cfUnc)) {
-            hGenCF->SetBinContent(iBin + 1, stack.top());
+            hGenCF->SetBinContent(iBin + 1, cf);
             hGenCF->SetBinError(iBin + 1, cfUnc);
         }
-        // return stack.top();
     }
 
     return hGenCF;
 }
 
+// Values of the recipe at the bin centres of the observable, with the current parameters of the fit function. Nothing
+// is drawn, so that it can be called from the threads of a multitrial fit
+std::vector<double> SuperFitter::GetGenuineCFValues(int idx, std::string recipe) {
+    const sf::tape tape = CompileRecipe(idx, recipe);
+    const int n = this->fObs[idx]->GetHistogram()->GetNbinsX();
+    const int nFitPars = fFit[idx]->GetNpar();
+
+    std::vector<double> pars(fFit[idx]->GetParameters(), fFit[idx]->GetParameters() + nFitPars);
+    pars.push_back(0);
+
+    std::vector<double> buffer(std::max(tape.depth - 1, 0) * n), values(n);
+    const std::vector<double> x = GetBinCenters(this->fObs[idx]->GetHistogram());
+    Evaluate(tape, x.data(), n, pars.data(), buffer.data(), values.data());
+    return values;
+}
+
 ClassImp(SuperFitter);
 
 #endif
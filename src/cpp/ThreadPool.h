@@ -0,0 +1,166 @@
+/* Persistent pool of worker threads used to parallelize the loops of the fitter */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace sf {
+
+class ThreadPool {
+   private:
+    // Non-owning reference to the callable of a job, so that submitting a job does not allocate
+    struct Task {
+        void* context;
+        void (*call)(void*, int, int);
+        void operator()(int i, int slot) const { call(context, i, slot); }
+    };
+
+    std::vector<std::thread> fWorkers;
+    std::mutex fJobMutex;  // Held by the thread that owns the current job
+    std::mutex fMutex;     // Protects the state below
+    std::condition_variable fWakeUp;
+    std::condition_variable fDone;
+    const Task* fJob = nullptr;
+    int fJobSize = 0;
+    std::atomic<int> fNext{0};
+    int fBusy = 0;
+    long fGeneration = 0;
+    bool fStop = false;
+    std::exception_ptr fError;  // First exception thrown by a task of the current job
+
+    // Index of the slot of the current thread: 0 for external threads, i + 1 for the i-th worker
+    static int& CurrentSlot() {
+        static thread_local int slot = 0;
+        return slot;
+    }
+
+    // Whether the current thread is executing a task of a pool
+    static bool& InsideTask() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    // Execute tasks of the current job until there are none left
+    void Drain(const Task& job, int n) {
+        bool wasInside = InsideTask();
+        InsideTask() = true;
+        for (int i = fNext++; i < n; i = fNext++) {
+            try {
+                job(i, CurrentSlot());
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(fMutex);
+                if (!fError) fError = std::current_exception();
+                fNext = n;
+            }
+        }
+        InsideTask() = wasInside;
+    }
+
+    void Work(int slot) {
+        CurrentSlot() = slot;
+        long seen = 0;
+        while (true) {
+            const Task* job;
+            int n;
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                fWakeUp.wait(lock, [&] { return fStop || fGeneration != seen; });
+                if (fStop) return;
+                seen = fGeneration;
+                if (!fJob) continue;  // The job was completed before this worker woke up
+                job = fJob;
+                n = fJobSize;
+                fBusy++;
+            }
+
+            Drain(*job, n);
+
+            std::lock_guard<std::mutex> lock(fMutex);
+            if (--fBusy == 0) fDone.notify_all();
+        }
+    }
+
+   public:
+    explicit ThreadPool(int nThreads) {
+        for (int iWorker = 1; iWorker < nThreads; iWorker++) {
+            fWorkers.emplace_back(&ThreadPool::Work, this, iWorker);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fWakeUp.notify_all();
+        for (auto& worker : fWorkers) worker.join();
+    }
+
+    // Number of threads that can execute tasks concurrently, including the caller
+    int GetNThreads() const { return fWorkers.size() + 1; }
+
+    // Call fn(i, slot) for each i in [0, n). The slot is in [0, GetNThreads()) and identifies the thread executing the
+    // task, so that per-thread buffers can be indexed with it. Nested calls and calls made while the pool is serving
+    // another thread run serially in the calling thread, keeping its slot
+    template <typename F>
+    void ParallelFor(int n, F&& fn) {
+        if (n <= 0) return;
+
+        std::unique_lock<std::mutex> jobLock(fJobMutex, std::defer_lock);
+        if (n == 1 || fWorkers.empty() || InsideTask() || !jobLock.try_lock()) {
+            for (int i = 0; i < n; i++) fn(i, CurrentSlot());
+            return;
+        }
+
+        using callable = typename std::remove_reference<F>::type;
+        Task task = {(void*)&fn, [](void* context, int i, int slot) { (*static_cast<callable*>(context))(i, slot); }};
+        Run(task, n);
+    }
+
+   private:
+    void Run(const Task& fn, int n) {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fJob = &fn;
+            fJobSize = n;
+            fNext = 0;
+            fError = nullptr;
+            fGeneration++;
+        }
+        fWakeUp.notify_all();
+
+        Drain(fn, n);
+
+        std::unique_lock<std::mutex> lock(fMutex);
+        fDone.wait(lock, [&] { return fBusy == 0 && fNext >= n; });
+        fJob = nullptr;
+        if (fError) std::rethrow_exception(fError);
+    }
+
+   public:
+    // Pool shared by all the fitters
+    static ThreadPool& Global() { return *GlobalPointer(); }
+
+    // Change the number of threads of the shared pool. Must not be called while the pool is in use
+    static void SetNThreads(int nThreads) { GlobalPointer().reset(new ThreadPool(std::max(nThreads, 1))); }
+
+   private:
+    static std::unique_ptr<ThreadPool>& GlobalPointer() {
+        static std::unique_ptr<ThreadPool> pool(new ThreadPool(std::max<int>(std::thread::hardware_concurrency(), 1)));
+        return pool;
+    }
+};
+
+}  // namespace sf
+
+#endif
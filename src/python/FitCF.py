@@ -8,8 +8,9 @@ import os
 import argparse
 import yaml
 import tabulate
+from array import array
 
-from ROOT import TF1, TFile, TCanvas, gInterpreter, gROOT, TH1, TGraphErrors
+from ROOT import TF1, TFile, TCanvas, gInterpreter, gROOT, TH1, TGraphErrors, TNtuple
 gInterpreter.ProcessLine(f'#define DEBUG_LEVEL 0')
 gInterpreter.ProcessLine(f'#include "{os.environ.get("YAFFA")}/yaffa/utils/Observable.h"')
 gInterpreter.ProcessLine(f'#include "{os.environ.get("YAFFA")}/yaffa/utils/SuperFitter.h"')
@@ -82,12 +83,24 @@ def FitCF(cfg): # pylint disable:missing-function-docstring
                     print('Type not implemented. Exit!')
                     sys.exit()
                 templFile.Close()
+            elif wfFileName := term.get('wf'):
+                fitter.Add(iFit, term['name'], term['func'], wfFileName, term['params'])
             else:
                 fitter.Add(iFit, term['name'], term['func'], term['params'])
 
         fitter.SetModel(iFit, fitCfg['model'])
+
+    # Look for the global minimum from several starting points within the parameter limits
+    if msCfg := cfg.get('multistart'):
+        fitter.SetMultiStart(msCfg.get('n', 50), msCfg.get('polish', 3), msCfg.get('calls', 0), msCfg.get('seed', 0))
+    if cacheDir := cfg.get('cache'):
+        fitter.SetCacheDirectory(cacheDir)
     fitter.Fit('MR+')
 
+    # Statistical uncertainties from refits of resampled replicas of the data
+    if bsCfg := cfg.get('bootstrap'):
+        fitter.Bootstrap(bsCfg.get('n', 1000), bsCfg.get('mode', 'gaus'), bsCfg.get('seed', 0))
+
     oFileName = cfg["ofile"]
     if suffix := cfg['suffix']:
         oFileName = f'{oFileName}_{suffix}'
@@ -137,6 +150,19 @@ def FitCF(cfg): # pylint disable:missing-function-docstring
         file.write(table)
 
     hObs.Write()
+    if cfg.get('bootstrap'):
+        names = list(fitter.GetParameterNames())
+        tBootstrap = TNtuple('tBootstrap', 'Bootstrap replicas', ':'.join(['status'] + names))
+        for status, pars in zip(fitter.GetBootstrapStatus(), fitter.GetBootstrapParameters()):
+            tBootstrap.Fill(array('f', [status] + list(pars)))
+        tBootstrap.Write()
+        for idx, _ in enumerate(cfg['fits']):
+            fitter.GetBootstrapBand(idx).Write()
+
+    # Chi2 map over two parameters, profiled over the other ones
+    if scanCfg := cfg.get('scan'):
+        fitter.ScanMap(*scanCfg['x'], *scanCfg['y']).Write()
+
     for idx, _ in enumerate(cfg['fits']):
         hGenCF = fitter.GetGenuineCF(idx, cfg['fits'][idx]['gencf']) # explicit cast to int for some reason
         hGenCF.SetName(f'hGenCF{idx}')
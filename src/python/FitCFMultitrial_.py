@@ -8,6 +8,7 @@ import os
 import argparse
 import yaml
 import tabulate
+from array import array
 
 
 from yaffa import utils
@@ -19,11 +20,10 @@ def FitCF(cfg): # pylint disable:missing-function-docstring
         cfg (dict): configuration of the fit
     '''
 
-    oFile = TFile(f"{cfg['ofile']}.root", 'recreate')
-
     sfmt = SuperFitterMultitrial()
     for fitCfg in cfg['fits']:
         sfmt.SetDrawRange(*fitCfg['drawrange'])
+        sfmt.SetDrawRecipes(fitCfg.get('draw_recipes', []))
 
         for inFileName in fitCfg['infiles']:
             inFile = TFile(inFileName)
@@ -33,10 +33,12 @@ def FitCF(cfg): # pylint disable:missing-function-docstring
             inFile.Close()
 
             sfmt.AddCF(oObs)
-        
-        # = SuperFitter(oObs, fitCfg['fitrange'][0][0], fitCfg['fitrange'][0][1])
 
-    #     # Add template to the sfmt
+        # Each variation of the fit range is given as a union of intervals
+        for fitRange in fitCfg.get('fitranges', [fitCfg['fitrange']]):
+            sfmt.AddFitRange(fitRange)
+
+        # Add template to the sfmt
         for iTerm, term in enumerate(fitCfg['terms']):
             if templFileName := term.get('file'):
                 templFile = TFile(templFileName)
@@ -52,33 +54,32 @@ def FitCF(cfg): # pylint disable:missing-function-docstring
             else:
                 sfmt.Add(term['name'], term['func'], term['params'])
 
-        # sfmt.AddSourceParameters([[1, 2], [3, 4]])
-        # sfmt.AddSourceParameters([[1, 2], [3, 4]])
-        # sfmt.AddFitRange([[1, 2], [3, 4]])
+        # Summarize the trials with running statistics instead of saving each of them
+        if cfg.get('aggregate'):
+            sfmt.SetAggregation(fitCfg.get('gencf', ''))
+
         sfmt.FitMultitrials(fitCfg['model'], 'MR+')
 
-    #     cFit = TCanvas('cFit', '', 600, 600)
-    #     cFit.DrawFrame(*fitCfg['frame'], ';#it{k}* (GeV/c);#it{C}(#it{k}*)')
-    #     sfmt.Draw(fitCfg['draw_recipes'])
-    #     cFit.SaveAs(f'{cfg["ofile"]}.pdf')
-    #     cFit.SaveAs(f'{cfg["ofile"]}.root')
-
-    #     # Save fit parameters to file
-    #     fFit = sfmt.GetFitFunction()
-    #     colNames = ['Parameter', 'Name', 'Value', 'Error', 'Step size', 'Derivative']
-    #     pars = []
-    #     for iPar in range(fFit.GetNpar()):
-    #         pars.append([
-    #             iPar,
-    #             fFit.GetParName(iPar),
-    #             f'{fFit.GetParameter(iPar):+10.5e}',
-    #             f'{fFit.GetParError(iPar):+10.5e}',
-    #             '-',  # Placeholder for "Step size"
-    #             '-'   # Placeholder for "Derivative"
-    #         ])        
-    #     table = tabulate.tabulate(pars, headers=colNames, tablefmt='pipe', floatfmt=".5e")  # "grid" is one of many styles
-    #     with open(f'{cfg["ofile"]}_parameters.txt', "w") as file:
-    #         file.write(table)
+        # Plotting is deferred to after all the trials are fitted, and only done on request
+        if cfg.get('plot_trials'):
+            sfmt.DrawTrials(f'{cfg["ofile"]}_trials.pdf', cfg.get('plot_step', 1))
+
+    # Save the results of the trials to file
+    oFile = TFile(f"{cfg['ofile']}.root", 'recreate')
+    if cfg.get('aggregate'):
+        sfmt.GetAggregator().Write()
+        oFile.Close()
+        return
+
+    names = list(sfmt.GetParameterNames())
+    branches = ['cf', 'range', 'chi2', 'ndf', 'status'] + names + [f'{name}_err' for name in names]
+    ntuple = TNtuple('tResults', 'Multitrial results', ':'.join(branches))
+    for trial in sfmt.GetTrials():
+        if trial.status < 0:
+            continue
+        values = [trial.cf, trial.range, trial.chi2, trial.ndf, trial.status] + list(trial.pars) + list(trial.errors)
+        ntuple.Fill(array('f', values))
+    ntuple.Write()
     oFile.Close()
 
 if __name__ == '__main__':
@@ -90,7 +91,7 @@ if __name__ == '__main__':
 
     # utils.style.SetStyle()
 
-    from ROOT import TFile, TCanvas, gInterpreter, gROOT, TH1
+    from ROOT import TFile, TCanvas, TNtuple, gInterpreter, gROOT, TH1
     gInterpreter.ProcessLine(f'#define DO_DEBUG {1 if args.debug else 0}')
     gInterpreter.ProcessLine(f'#include "{os.environ.get("YAFFA")}/yaffa/utils/Observable.h"')
     gInterpreter.ProcessLine(f'#include "{os.environ.get("YAFFA")}/yaffa/utils/SuperFitterMultitrial.h"')
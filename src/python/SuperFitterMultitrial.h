@@ -1,429 +1,492 @@
 #ifndef SUPERFITTERMULTITRIAL_H
 #define SUPERFITTERMULTITRIAL_H
 
+#include <stdio.h>
+
+#include <algorithm>
 #include <cmath>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
-#include <stdio.h>
-#include <algorithm>
-
-#include "gsl/gsl_sf_dawson.h"
 
 #include "Observable.h"
-#include "Riostream.h"
-#include "TF1.h"
-#include "TFormula.h"
+#include "RunningStats.h"
+#include "SuperFitter.h"
+#include "TCanvas.h"
+#include "TDirectory.h"
 #include "TH1.h"
+#include "TH1D.h"
 #include "TObject.h"
-#include "TCanvas.h"
+#include "TROOT.h"
+
+namespace sf {
+// Result of a single trial of a multitrial fit. Only the numbers are kept, so that the memory does not grow with the
+// size of the histograms and functions of the fit
+struct trial {
+    int cf;                      // Index of the correlation function
+    int range;                   // Index of the fit range
+    std::vector<int> terms;      // Index of the variation of each term, in order of insertion of the terms
+    std::vector<double> pars;    // Values of the independent parameters
+    std::vector<double> errors;  // Uncertainties of the independent parameters
+    double chi2;
+    int ndf;
+    int status;  // Status of the minimizer, -1 if the fit could not be performed
+    int nCalls;  // Number of evaluations of the chi2
+    int start;   // Trial whose result was the starting point of the fit, -1 for the initial values of the parameters
+};
 
-#include "Observable.h"
-#include "SuperFitter.h"
-#include "SuperFitterMultitrial.h"
+// Running statistics of the converged trials: parameters, chi2/ndf and genuine correlation function in each bin. The
+// memory does not depend on the number of trials. Trials can be folded in from different threads
+class SystematicAggregator {
+   private:
+    std::vector<double> fProbabilities;  // Probabilities of the estimated quantiles
+    std::vector<std::string> fNames;     // Names of the parameters, followed by chi2/ndf
+    std::vector<RunningStats> fPars;
+    std::vector<double> fEdges;          // Bin edges of the genuine correlation function
+    std::vector<RunningStats> fGenCF;
+    std::mutex fMutex;
 
-using par = std::tuple<std::string, double, double, double>;
+   public:
+    explicit SystematicAggregator(std::vector<double> probabilities) : fProbabilities(probabilities) {}
+
+    // Fold in a trial. The names and the binning are taken from the first trial and must be the same for all of them,
+    // otherwise an exception is thrown and the trial is not folded in
+    void Fill(const std::vector<std::string>& names, const std::vector<double>& pars, double chi2Ndf,
+              const std::vector<double>& edges, const std::vector<double>& genCF) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        if (fNames.empty()) {
+            fNames = names;
+            fNames.push_back("chi2/ndf");
+            fPars.assign(fNames.size(), RunningStats(fProbabilities));
+        }
+        if (fEdges.empty() && !genCF.empty()) {
+            fEdges = edges;
+            fGenCF.assign(genCF.size(), RunningStats(fProbabilities));
+        }
+        if (pars.size() + 1 != fPars.size() || genCF.size() != fGenCF.size() ||
+            !std::equal(names.begin(), names.end(), fNames.begin(), fNames.end() - 1) ||
+            (!genCF.empty() && edges != fEdges)) {
+            throw std::runtime_error("The trials have different parameters or binning");
+        }
 
-// Class for advanced multitrial fitting
-class SuperFitterMultitrial : public SuperFitter {
-   private:
-    std::vector<Observable*> fCFs;                                                    // Observable to be fitted
-    std::map<std::string, std::vector<TH1*>> fTemplates = {};
-    std::map<std::string, std::vector<std::string>> fFunctions = {};
-    std::map<std::string, std::vector<par>> fPars = {};
-    std::vector<std::pair<std::string, std::string>> fDrawRecipes;
+        for (size_t iPar = 0; iPar < pars.size(); iPar++) fPars[iPar].Add(pars[iPar]);
+        fPars.back().Add(chi2Ndf);
+        for (size_t iBin = 0; iBin < genCF.size(); iBin++) fGenCF[iBin].Add(genCF[iBin]);
+    }
 
-//     TF1* fFit;                                                           // Total fit function
-//     std::vector<par> fPars;  // List of fit pars: (name, init, min, max)
-//     double fFitRangeMin;                                                 // Fit range minimum
-//     double fFitRangeMax;                                                 // Fit range maximum
-//     double fDrawRangeMin;                                                // Draw range minimum
-//     double fDrawRangeMax;                                                // Draw range maximum
+    long GetNTrials() const { return fPars.empty() ? 0 : fPars.back().GetCount(); }
+    std::vector<std::string> GetNames() const { return fNames; }
+    const RunningStats& GetParameterStats(int iPar) const { return fPars[iPar]; }
+    const RunningStats& GetGenuineCFStats(int iBin) const { return fGenCF[iBin]; }
+
+    // Histogram of a statistic of the parameters (quantity "pars", one labelled bin per parameter) or of the genuine
+    // correlation function (quantity "gencf"). The statistic is "mean" (with the standard deviation as error),
+    // "stddev", "min", "max" or "q<percent>" for one of the estimated quantiles, e.g. "q50" for the median
+    TH1D* MakeHistogram(std::string quantity, std::string statistic) const {
+        std::string name = "h" + std::string(quantity == "pars" ? "Pars" : "GenCF") + "_" + statistic;
+        TH1D* hist = nullptr;
+        if (quantity == "pars") {
+            hist = new TH1D(name.data(), ";;", fPars.size(), 0, fPars.size());
+            for (size_t iPar = 0; iPar < fNames.size(); iPar++) {
+                hist->GetXaxis()->SetBinLabel(iPar + 1, fNames[iPar].data());
+            }
+        } else if (quantity == "gencf") {
+            if (fEdges.empty()) throw std::runtime_error("The genuine correlation function was not aggregated");
+            hist = new TH1D(name.data(), ";#it{k}* (GeV/#it{c});#it{C}(#it{k}*)", fEdges.size() - 1, fEdges.data());
+        } else {
+            throw std::runtime_error("Unknown quantity '" + quantity + "'");
+        }
+        hist->SetDirectory(nullptr);
+
+        const std::vector<RunningStats>& stats = quantity == "pars" ? fPars : fGenCF;
+        for (size_t iBin = 0; iBin < stats.size(); iBin++) {
+            const RunningStats& s = stats[iBin];
+            double value;
+            if (statistic == "mean") {
+                value = s.GetMean();
+                hist->SetBinError(iBin + 1, s.GetStdDev());
+            } else if (statistic == "stddev") {
+                value = s.GetStdDev();
+            } else if (statistic == "min") {
+                value = s.GetMin();
+            } else if (statistic == "max") {
+                value = s.GetMax();
+            } else {
+                int iQuantile = GetQuantileIndex(statistic);
+                if (iQuantile < 0) {
+                    delete hist;
+                    throw std::runtime_error("Unknown statistic '" + statistic + "'");
+                }
+                value = s.GetQuantile(iQuantile);
+            }
+            if (s.GetCount() > 0) hist->SetBinContent(iBin + 1, value);
+        }
+        return hist;
+    }
 
-   public:
-    // // Empty Contructor
-    SuperFitterMultitrial() : SuperFitter(), fCFs({}) {};
+    // Write the histograms of all the statistics to the current directory
+    void Write() const {
+        std::vector<std::string> statistics = {"mean", "stddev", "min", "max"};
+        for (double p : fProbabilities) statistics.push_back(Form("q%g", 100 * p));
+
+        std::vector<std::string> quantities = {"pars"};
+        if (!fEdges.empty()) quantities.push_back("gencf");
+        for (const auto& quantity : quantities) {
+            for (const auto& statistic : statistics) {
+                TH1D* hist = MakeHistogram(quantity, statistic);
+                gDirectory->WriteObject(hist, hist->GetName());
+                delete hist;
+            }
+        }
+    }
 
+   private:
+    int GetQuantileIndex(const std::string& statistic) const {
+        for (size_t iQuantile = 0; iQuantile < fProbabilities.size(); iQuantile++) {
+            if (statistic == Form("q%g", 100 * fProbabilities[iQuantile])) return iQuantile;
+        }
+        return -1;
+    }
+};
+}  // namespace sf
 
+// Class for multitrial fitting. Each combination of correlation function, fit range and variation of the terms is a
+// trial, fitted by its own SuperFitter. The trials run in parallel on the thread pool of the fitters, and the plots
+// are only produced on request once all the fits are done
+class SuperFitterMultitrial : public TObject {
+   private:
+    std::vector<Observable*> fCFs;                                   // Variations of the correlation function
+    std::vector<std::vector<std::pair<double, double>>> fFitRanges;  // Variations of the fit range
+    std::vector<std::string> fTermNames;                             // Names of the terms in order of insertion
+    std::map<std::string, std::vector<TH1*>> fTemplates = {};        // Variations of the template terms
+    std::map<std::string, std::vector<std::string>> fFunctions = {};  // Variations of the function terms
+    std::map<std::string, std::vector<sf::parameter>> fPars = {};    // Parameters of each term
+    std::vector<std::pair<std::string, std::string>> fDrawRecipes;
+    double fDrawRangeMin = 0;
+    double fDrawRangeMax = 1;
+    std::string fModel;                   // Model of the last multitrial fit
+    bool fWarmStart = true;               // Start each trial from the closest converged one
+    bool fAggregate = false;              // Fold the converged trials into running statistics
+    std::string fAggregatedRecipe;        // Recipe of the aggregated genuine correlation function
+    std::vector<double> fAggregatedProbabilities;
+    std::unique_ptr<sf::SystematicAggregator> fAggregator;  //! Running statistics of the last multitrial fit
+    std::vector<std::string> fParNames;   //! Names of the independent parameters of the trials
+    std::vector<sf::trial> fTrials;       //! Results of the last multitrial fit, not kept with the aggregation
+
+    // Maximum number of chains in which the trials are split, and minimum number of trials in each chain. They do not
+    // depend on the number of threads, so that the starting point of each trial, and thus its result, is the same on
+    // any machine
+    static constexpr int kMaxChains = 64;
+    static constexpr int kMinChainLength = 8;
+
+    // Fitter of a trial, with the copy of the correlation function that it modifies. The observable is declared first
+    // so that it is deleted after the fitter
+    struct trial_fitter {
+        std::unique_ptr<Observable> obs;
+        std::unique_ptr<SuperFitter> fitter;
+    };
 
-    // // Standard Contructor
-    // SuperFitterMultitrial(Observable* oObservable, double xMin, double xMax)
-    //     : TObject(), fCFs(oObservable) {};
+   public:
+    // Empty Contructor
+    SuperFitterMultitrial() : TObject(), fCFs({}) {};
 
-//     // Destructor
-//     ~SuperFitterMultitrial() { delete fCFs; };
+    void AddCF(Observable* obs) { fCFs.push_back(obs); }
 
-    void AddCF(Observable* obs) {
-        fCFs.push_back(obs);
-    }
+    // Add a variation of the fit range, given as the union of different intervals
+    void AddFitRange(std::vector<std::pair<double, double>> fitRange) { fFitRanges.push_back(fitRange); }
 
-    void SetPars(std::string name, std::vector<par> pars) {
-        if (fPars.contains(name))  {
+    void SetPars(std::string name, std::vector<sf::parameter> pars) {
+        if (fPars.contains(name)) {
             throw std::runtime_error("Parameters for '" + name + "' already defined");
-            exit(1);
         }
 
         fPars.insert({name, pars});
-
     }
-    void Add(std::string name, TH1 * hTemplate) {
-        if (!fTemplates.contains(name)) fTemplates[name] = {};
+
+    // Add a variation of a template term
+    void Add(std::string name, TH1* hTemplate) {
+        if (fFunctions.contains(name)) {
+            throw std::runtime_error("Term '" + name + "' is already defined as a function");
+        }
+        if (!fTemplates.contains(name)) {
+            fTemplates[name] = {};
+            fTermNames.push_back(name);
+        }
         fTemplates[name].push_back(hTemplate);
     }
 
+    // Add a variation of a function term
     void Add(std::string name, std::string func) {
-        if (!fFunctions.contains(name)) fFunctions[name] = {};
+        if (fTemplates.contains(name)) {
+            throw std::runtime_error("Term '" + name + "' is already defined as a template");
+        }
+        if (!fFunctions.contains(name)) {
+            fFunctions[name] = {};
+            fTermNames.push_back(name);
+        }
         fFunctions[name].push_back(func);
     }
 
-    void SetDrawRecipes(std::vector<std::pair<std::string, std::string>> recipes) {
-        this->fDrawRecipes = recipes;
+    // Add a variation of a term together with its parameters, which are the same for all the variations
+    void Add(std::string name, TH1* hTemplate, std::vector<sf::parameter> pars) {
+        Add(name, hTemplate);
+        if (!fPars.contains(name)) SetPars(name, pars);
+    }
+
+    void Add(std::string name, std::string func, std::vector<sf::parameter> pars) {
+        Add(name, func);
+        if (!fPars.contains(name)) SetPars(name, pars);
     }
 
-    // Fit
+    void SetDrawRecipes(std::vector<std::pair<std::string, std::string>> recipes) { this->fDrawRecipes = recipes; }
+
+    void SetDrawRange(double xMin, double xMax) {
+        this->fDrawRangeMin = xMin;
+        this->fDrawRangeMax = xMax;
+    }
+
+    // Start each trial from the result of the last converged trial of its chain, usually the previous one, which differs
+    // by a single variation, instead of the initial values of the parameters
+    void SetWarmStart(bool enable = true) { this->fWarmStart = enable; }
+
+    // Fold the results of the converged trials into running statistics as soon as they are fitted. If a recipe is
+    // given, the genuine correlation function of each trial is aggregated bin by bin too. The results of the single
+    // trials are then not kept, so that the memory does not depend on the number of trials. Trials without degrees of
+    // freedom are not aggregated
+    void SetAggregation(std::string genCFRecipe = "", std::vector<double> probabilities = {0.16, 0.5, 0.84}) {
+        this->fAggregate = true;
+        this->fAggregatedRecipe = genCFRecipe;
+        this->fAggregatedProbabilities = probabilities;
+    }
+
+    // Running statistics of the last multitrial fit, nullptr if the aggregation is not enabled
+    sf::SystematicAggregator* GetAggregator() { return this->fAggregator.get(); }
+
+    // Number of trials: all the combinations of the variations
+    int GetNTrials() const {
+        size_t nTrials = fCFs.size() * fFitRanges.size();
+        for (const auto& name : fTermNames) {
+            nTrials *= GetNVariations(name);
+        }
+        return nTrials;
+    }
+
+    // Fit all the trials in parallel. The trials are ordered so that consecutive ones differ by a single variation and
+    // split into contiguous chains, one chain at a time per thread. With the warm start, each trial starts
+    // from the last converged trial of its chain, so that the results do not depend on the number of threads
     void FitMultitrials(std::string model, const char* opt = "") {
-        int counter = 0;
-        TCanvas *cFit = new TCanvas("cFitMultitrials", "", 600, 600);
-        cFit->SaveAs("cFitMultitrials.pdf[");
-
-        for (int iCF = 0; iCF < fCFs.size(); iCF++) {
-
-            // Load templates
-            // for (auto &[name, hTemplates] : fTemplates) {
-            //     // find corresponding parameters
-            //     if (!fPars.contains(name)) {
-            //         throw std::runtime_error("Parameters for '" + name + "' not found");
-            //     }
-
-            //     std::vector<par> pars = fPars[name];
-            //     printf("name: %s\n", name.data());
-
-            //     // Template variations
-            //     for (auto &hTemplate : hTemplates) {
-
-            //     }
-            // }
-
-            SuperFitter* fitter = new SuperFitter(fCFs[iCF], 0, 0.5);
-            
-            // fitter->SetDrawRange(0, 0.5);
-            for (auto &[name, pars] : fPars) {
-                printf("name: %s\n", name.data()); 
-                if (fTemplates.contains(name)) {
-                    auto hTemplates = fTemplates[name];
-                    fitter->Add(name, hTemplates[0], pars);
-                } else if (fFunctions.contains(name)) {
-                    auto fFuncs = fFunctions[name];
-                    fitter->Add(name, fFuncs[0], pars);
-                } else {
-                    throw std::runtime_error("Term '" + name + "' is not implemented.");
+        if (fCFs.empty() || fFitRanges.empty()) {
+            throw std::runtime_error("At least one correlation function and one fit range are needed");
+        }
+
+        // The fitters of the trials create ROOT objects from different threads
+        ROOT::EnableThreadSafety();
+
+        fModel = model;
+        const int nTrials = GetNTrials();
+        printf("Fitting %d trials on %d threads\n", nTrials, sf::ThreadPool::Global().GetNThreads());
+
+        fTrials.assign(fAggregate ? 0 : nTrials, {});
+        fParNames = {};
+        fAggregator.reset(fAggregate ? new sf::SystematicAggregator(fAggregatedProbabilities) : nullptr);
+
+        // Several chains per thread balance the load, at the cost of a cold start for the first trial of each chain
+        const std::vector<int> order = GetTrialOrder();
+        const int nChains = std::clamp(nTrials / kMinChainLength, 1, kMaxChains);
+
+        int nFailed = 0;
+        long nCalls = 0;
+        sf::ThreadPool::Global().ParallelFor(nChains, [&](int iChain, int) {
+            int startIndex = -1;
+            sf::trial start = {};
+            for (int iPos = iChain * nTrials / nChains; iPos < (iChain + 1) * nTrials / nChains; iPos++) {
+                int iTrial = order[iPos];
+                sf::trial trial = FitTrial(iTrial, opt, fWarmStart && startIndex >= 0 ? &start : nullptr, startIndex);
+                if (trial.status == 0) {
+                    startIndex = iTrial;
+                    start = trial;
                 }
-            }
 
-            fitter->Fit(model, "MR+");
-            cFit->DrawFrame(0, 0.98, 0.5, 1.5);
-            fitter->Draw(fDrawRecipes);
+                std::lock_guard<std::mutex> lock(fNamesMutex);
+                nFailed += trial.status != 0;
+                nCalls += trial.nCalls;
+                if (!fAggregate) fTrials[iTrial] = trial;
+            }
+        });
 
-            cFit->SaveAs("cFitMultitrials.pdf");
+        printf("Multitrial fit done: %d trials, %d of which did not converge, %.1f chi2 evaluations per trial\n",
+               nTrials, nFailed, (double)nCalls / nTrials);
+    }
 
-            // delete fitter;
+    // Draw the trials in a multi-page pdf, one every `step` trials. The fitters of the trials are rebuilt with their
+    // fitted parameters, without fitting again. Not available with the aggregation, which does not keep the trials
+    void DrawTrials(std::string fileName, int step = 1, double yMin = 0.98, double yMax = 1.5) {
+        if (fAggregate) {
+            printf("\033[33mWARNING: the trials are not kept when they are aggregated, nothing to draw\033[0m\n");
+            return;
         }
-        cFit->SaveAs("cFitMultitrials.pdf]");
 
+        TCanvas* cFit = new TCanvas("cFitMultitrials", "", 600, 600);
+        cFit->SaveAs((fileName + "[").data());
+
+        for (size_t iTrial = 0; iTrial < fTrials.size(); iTrial += std::max(step, 1)) {
+            const auto& trial = fTrials[iTrial];
+            if (trial.status < 0) continue;
+
+            trial_fitter tf = BuildFitter(trial);
+            TF1* fFit = tf.fitter->GetFitFunction(0);
+            for (int iPar = 0; iPar < fFit->GetNpar(); iPar++) {
+                auto it = std::find(fParNames.begin(), fParNames.end(), fFit->GetParName(iPar));
+                fFit->SetParameter(iPar, trial.pars[it - fParNames.begin()]);
+            }
+
+            cFit->DrawFrame(fDrawRangeMin, yMin, fDrawRangeMax, yMax);
+            tf.fitter->Draw(0, fDrawRecipes, Form("Trial %zu", iTrial));
+            cFit->SaveAs(fileName.data());
+        }
 
-    //         Observable cf = fCFs[iCF];
-    //         SuperFitter fitter(cf, 0, 0.5);
+        cFit->SaveAs((fileName + "]").data());
+        delete cFit;
+    }
 
+    // Results of the trials of the last multitrial fit, empty if they were aggregated
+    const std::vector<sf::trial>& GetTrials() const { return fTrials; }
+    const sf::trial& GetTrial(int iTrial) const { return fTrials[iTrial]; }
+    std::vector<std::string> GetParameterNames() const { return fParNames; }
+    std::vector<std::string> GetTermNames() const { return fTermNames; }
+
+    // Order of the trials as a reflected mixed-radix Gray code over (cf, range, terms): consecutive trials differ by a
+    // single variation, with the terms changing most often
+    std::vector<int> GetTrialOrder() const {
+        std::vector<int> radices = {(int)fCFs.size(), (int)fFitRanges.size()};
+        for (const auto& name : fTermNames) radices.push_back(GetNVariations(name));
+
+        const int nDigits = radices.size();
+        std::vector<int> digits(nDigits, 0);
+        std::vector<int> directions(nDigits, 1);
+        std::vector<int> order = {};
+        for (int iTrial = 0; iTrial < GetNTrials(); iTrial++) {
+            int index = 0;
+            for (int iDigit = 0; iDigit < nDigits; iDigit++) index = index * radices[iDigit] + digits[iDigit];
+            order.push_back(index);
+
+            // Move the fastest digit that can move in its direction, and reverse the ones that could not
+            for (int iDigit = nDigits - 1; iDigit >= 0; iDigit--) {
+                int next = digits[iDigit] + directions[iDigit];
+                if (0 <= next && next < radices[iDigit]) {
+                    digits[iDigit] = next;
+                    break;
+                }
+                directions[iDigit] *= -1;
+            }
+        }
+        return order;
+    }
 
+   private:
+    int GetNVariations(const std::string& name) const {
+        if (auto it = fTemplates.find(name); it != fTemplates.end()) return it->second.size();
+        return fFunctions.at(name).size();
+    }
 
-    //          #         if templFileName := term.get('file'):
-    // #             templFile = TFile(templFileName)
-    // #             template = utils.io.Load(templFile, term['path'])
-    // #             if isinstance(template, TH1):
-    // #                 hTemplate = utils.analysis.ChangeUnits(template, term.get('unit_mult', 1))
-    // #                 hTemplate.SetDirectory(0)
-    // #                 fitter.Add(term['name'], hTemplate, term['params'])
+    // Indices of the variations of a trial, with the terms varying fastest
+    sf::trial Decode(int iTrial) const {
+        sf::trial trial = {};
+        trial.terms.resize(fTermNames.size());
+        for (int iTerm = fTermNames.size() - 1; iTerm >= 0; iTerm--) {
+            int nVariations = GetNVariations(fTermNames[iTerm]);
+            trial.terms[iTerm] = iTrial % nVariations;
+            iTrial /= nVariations;
+        }
+        trial.range = iTrial % fFitRanges.size();
+        trial.cf = iTrial / fFitRanges.size();
+        return trial;
+    }
 
-    // #             # elif isinstance(template, TF1):
-    // #                 # Ccnvert to hist
-    // #                 # hTemplate = TH1D(f"h{iTerm}", "", 500, 0, 2)
-    // #                 # for iBin in range(500):
-    // #                 #     bc = template.Eval(hTemplate.GetBinCenter(iBin + 1) * term.get('unit_mult', 1))
-    // #                 #     print("bc", bc)
-    // #                 #     hTemplate.SetBinContent(iBin + 1, bc)
-    // #                 # hTemplate.SetDirectory(0)
+    // Fitter of a trial with its own copy of the correlation function, since adding templates changes its uncertainties
+    trial_fitter BuildFitter(const sf::trial& trial) const {
+        trial_fitter tf;
+        TH1* hCF = (TH1*)fCFs[trial.cf]->GetHistogram()->Clone();
+        hCF->SetDirectory(nullptr);
+        tf.obs.reset(new Observable(hCF));
+        tf.fitter.reset(new SuperFitter());
+
+        SuperFitter* fitter = tf.fitter.get();
+        fitter->SetFitRange(fFitRanges[trial.range]);
+        fitter->SetDrawRange(fDrawRangeMin, fDrawRangeMax);
+        fitter->AddObservable(tf.obs.get());
+        for (size_t iTerm = 0; iTerm < fTermNames.size(); iTerm++) {
+            const std::string& name = fTermNames[iTerm];
+            if (!fPars.contains(name)) {
+                throw std::runtime_error("Parameters for '" + name + "' not found");
+            }
 
-    // #                 # c = TCanvas()
-    // #                 # hTemplate.Draw()
+            if (auto it = fTemplates.find(name); it != fTemplates.end()) {
+                fitter->Add(0, name, it->second[trial.terms[iTerm]], fPars.at(name));
+            } else {
+                fitter->Add(0, name, fFunctions.at(name)[trial.terms[iTerm]], fPars.at(name));
+            }
+        }
+        fitter->SetModel(0, fModel);
+        return tf;
+    }
 
-    // #                 # hTemplate.Write()
-    // #                 # # oFile.cd()
-    // #                 # hTemplate.Write(f'hCF_{iTerm}')
-    // #                 # c.SaveAs(f'test{iTerm}.png')
+    // Fit a single trial, from the result of the trial startIndex if start is not null. A failure is recorded in the
+    // status of the trial, so that it does not stop the other ones
+    sf::trial FitTrial(int iTrial, const char* opt, const sf::trial* start, int startIndex) {
+        sf::trial trial = Decode(iTrial);
+        trial.start = -1;
+        trial.nCalls = 0;
+        try {
+            trial_fitter tf = BuildFitter(trial);
+
+            // The steps of the minimizer are the uncertainties of the starting trial, i.e. the diagonal of its
+            // covariance, which Minuit uses to seed its estimate of the covariance
+            if (start) {
+                std::lock_guard<std::mutex> lock(fNamesMutex);
+                trial.start = startIndex;
+                tf.fitter->SetStartingPoint(fParNames, start->pars, start->errors);
+            }
 
+            tf.fitter->Fit(opt);
+
+            trial.pars = tf.fitter->GetParameters();
+            trial.errors = tf.fitter->GetParErrors();
+            trial.chi2 = tf.fitter->GetChi2();
+            trial.ndf = tf.fitter->GetNdf();
+            trial.status = tf.fitter->GetStatus();
+            trial.nCalls = tf.fitter->GetNCalls();
+
+            // The chi2/ndf of a trial without degrees of freedom, e.g. a narrow fit range, is not defined
+            const double chi2Ndf = trial.ndf > 0 ? trial.chi2 / trial.ndf : std::nan("");
+            if (fAggregator && trial.status == 0 && !std::isfinite(chi2Ndf)) {
+                printf("\033[33mWARNING: trial %d has chi2 = %g with ndf = %d and is not aggregated\033[0m\n", iTrial,
+                       trial.chi2, trial.ndf);
+            } else if (fAggregator && trial.status == 0) {
+                std::vector<double> edges = {};
+                std::vector<double> genCF = {};
+                if (!fAggregatedRecipe.empty()) {
+                    const TAxis* axis = tf.obs->GetHistogram()->GetXaxis();
+                    for (int iBin = 1; iBin <= axis->GetNbins() + 1; iBin++) edges.push_back(axis->GetBinLowEdge(iBin));
+                    genCF = tf.fitter->GetGenuineCFValues(0, fAggregatedRecipe);
+                }
+                fAggregator->Fill(tf.fitter->GetParameterNames(), trial.pars, chi2Ndf, edges, genCF);
+            }
 
-    // #                 # unitMult = term.get('unit_mult', 1)
-    // #                 # SetOwnership(template, False)
-    // #                 # template.SetName(f'f{iTerm}')
+            std::lock_guard<std::mutex> lock(fNamesMutex);
+            if (fParNames.empty()) fParNames = tf.fitter->GetParameterNames();
+        } catch (const std::exception& e) {
+            printf("\033[33mWARNING: trial %d failed: %s\033[0m\n", iTrial, e.what());
+            trial.status = -1;
+        }
+        return trial;
+    }
 
-    // #                 # print('zezez', template)
-    // #                 # fitter.Add(term['name'], template, term['params'], term.get('unit_mult', 1))
-    // #                 # fitter.Add(term['name'], hTemplate, term['params'])
-    // #             else:
-    // #                 print('Type not implemented. Exit!')
-    // #                 sys.exit()
-    // #             templFile.Close()
-    // #         else:
-    // #             fitter.Add(term['name'], term['func'], term['params'])
-    };
+    std::mutex fNamesMutex;  //! Protects the names of the parameters and the results while the trials are running
 
-//     // Add fit component
-//     void Add(std::string name, std::string func, std::vector<par> pars) {
-
-//         if (func == "pol0") {
-//             functions.push_back({name, Pol0, 1});
-//         } else if (func == "pol1") {
-//             functions.push_back({name, Pol1, 2});
-//         } else if (func == "pol2") {
-//             functions.push_back({name, Pol2, 3});
-//         } else if (func == "pol3") {
-//             functions.push_back({name, Pol3, 4});
-//         } else if (func == "pol4") {
-//             functions.push_back({name, Pol4, 5});
-//         } else if (func == "pol5") {
-//             functions.push_back({name, Pol5, 6});
-//         } else if (func == "pol6") {
-//             functions.push_back({name, Pol6, 7});
-//         } else if (func == "pol7") {
-//             functions.push_back({name, Pol7, 8});
-//         } else if (func == "pol8") {
-//             functions.push_back({name, Pol8, 9});
-//         } else if (func == "pol9") {
-//             functions.push_back({name, Pol9, 10});
-//         } else if (func == "gaus") {
-//             functions.push_back({name, Gaus, 3});
-//         } else if (func == "lednicky") {
-//             functions.push_back({name, Lednicky, 7});
-//         } else {
-//             throw std::runtime_error("Function " + func + " with name " + name + " is not implemented");
-//         }
-
-//         // Save fit settings
-//         for (const auto& par : pars) {
-//                   std::get<2>(par), std::get<3>(par));
-//             this->fPars.push_back(par);
-//         }
-//     };
-
-//     // Add template function
-//     void Add(std::string name, TH1* hTemplate, std::vector<par> pars) {
-
-//         functions.push_back(
-//             {name, [hTemplate](double* x, double* p) { return p[0] * hTemplate->Interpolate(x[0]); }, 1});
-
-//         // Save fit settings
-//         for (const auto& par : pars) {
-//                   std::get<2>(par), std::get<3>(par));
-//             this->fPars.push_back(par);
-//         }
-//     };
-
-//     // Add TF1 function
-//     void Add(std::string name, TF1* fTemplate, std::vector<par> pars,
-//              double unitMult) {  // todo: remove units mult here and put in .py
-//         std::cout << "kekek" << fTemplate << std::endl;
-
-//         functions.push_back(
-//             {name,
-//              [&, fTemplate, unitMult, this](double* x, double* p) { return p[0] * fTemplate->Eval(x[0] * unitMult); },
-//              1});
-
-//         // Save fit settings
-//         for (const auto& par : pars) {
-//                   std::get<2>(par), std::get<3>(par));
-//             this->fPars.push_back(par);
-//         }
-//     };
-
-//     // Draw
-//     void Draw(std::vector<std::pair<std::string, std::string>> recipes) const {
-//         std::cout << "Draw functions" << std::endl;
-//         for (const auto& [name, _, __] : functions) {
-//             std::cout << name << std::endl;
-//         }
-
-
-//         TLegend* leg = new TLegend(0.6, 0.6, 0.9, 0.9);
-
-//         // Draw the fitted observable
-//         this->fCFs->Draw("hist same pe");
-//         leg->AddEntry(this->fCFs, "data", "pe");
-
-//         // Draw the final fit function
-//         this->fFit->Draw("same");
-
-//         leg->AddEntry(this->fFit, "Total");
-//         // Draw components based on the draw recipes
-//         for (int iRecipe = 0; iRecipe < recipes.size(); iRecipe++) {
-//             std::string legend = recipes[iRecipe].first;
-//             std::string recipe = recipes[iRecipe].second;
-
-//             // Tokenization of the recipe
-//             auto tokens = Tokenize(recipe);
-
-//             // Count the number of parameters
-//             std::set<int> paraList = {};
-//             std::vector<int> nParsDraw = {};
-//             std::set<std::string> used_tokens = {};
-//             for (const auto& token : tokens) {
-
-//                 if (!IsFunction(token)) {
-//                     continue;
-//                 }
-
-//                 int counter = 0;
-//                 for (const auto& [name, _, __] : functions) {
-//                     if (name == token) break;
-//                     counter++;
-//                 }
-
-//                 int offset = 0;
-//                 for (int iFunc = 0; iFunc < counter; iFunc++) {
-//                     offset += std::get<2>(functions[iFunc]);
-//                 }
-
-//                 // Determine the number of parameters
-//                 for (int iFunc = 0; iFunc < functions.size(); iFunc++) {
-//                     auto name = std::get<0>(functions[iFunc]);
-//                     if (name == token && used_tokens.find(token) == used_tokens.end()) {
-//                         int nPars = std::get<2>(functions[iFunc]);
-//                         nParsDraw.push_back(nPars);
-//                         // Determine the position of the function in the list of functions
-//                         for (int iPar = 0; iPar < nPars; iPar++) {
-//                             paraList.insert(offset + iPar);
-//                         }
-//                         break;
-//                     }
-//                 }
-//             }
-
-//             for (const auto& e : paraList) {
-//             }
-
-//             // Convert to Reverse Polish Notation
-//             auto rpn = toRPN(tokens);
-
-//             for (const int& d : nParsDraw) {
-//             }
-
-//             // The following lambda evaluates the fit function
-//             auto lambda = [this, rpn, nParsDraw](double* x, double* p) -> double {
-//                 std::stack<double> stack;
-
-//                 if (0.12 < x[0] && x[0] < .16)
-//                 std::vector<std::pair<std::string, int>> nParameters = {};  // token, npars
-//                 int idx = 0;
-//                 for (const std::string& token : rpn) {
-//                     if (stack.size() == 0) {
-//                     } else {
-//                         if (0.12 < x[0] && x[0] < .16)
-//                     }
-
-//                     if (isdigit(token[0]) || token[0] == '.') {
-//                         // Push numbers
-//                         stack.push(std::stod(token));
-//                     } else if (IsFunction(token)) {
-
-//                         // inly insert if not already present -> avoid duplicates
-//                         if (std::find(nParameters.begin(), nParameters.end(), std::pair(token, 1)) ==
-//                             nParameters.end()) {
-//                             for (const auto& [name, _, npar] : functions) {
-//                                 if (name == token) {
-//                                     nParameters.push_back({token, npar});
-//                                 }
-//                             }
-//                         }
-
-//                         // Compute offset
-//                         int offset = 0;
-//                         for (const auto& [name, np] : nParameters) {
-//                             if (name == token) break;
-//                             offset += np;
-//                         }
-
-
-//                         // Determine the position of the function in the list of functions
-//                         int counter = 0;
-//                         for (const auto& [name, _, __] : functions) {
-//                             if (name == token) break;
-//                             counter++;
-//                         }
-//                         auto func = std::get<1>(functions[counter]);
-//                         double value = func(x, p + offset);
-
-//                         if (0.12 < x[0] && x[0] < .16)
-//                         if (0.12 < x[0] && x[0] < .16)
-
-//                         stack.push(value);
-//                     } else if (IsOperator(token)) {
-//                         // Apply operator
-//                         if (stack.size() < 2) throw std::runtime_error("Insufficient arguments for operator");
-//                         double b = stack.top();
-//                         stack.pop();
-//                         double a = stack.top();
-//                         stack.pop();
-
-//                         if (token == "+")
-//                             stack.push(a + b);
-//                         else if (token == "-")
-//                             stack.push(a - b);
-//                         else if (token == "*")
-//                             stack.push(a * b);
-//                         else if (token == "/")
-//                             stack.push(a / b);
-//                         else
-//                             throw std::runtime_error("Unknown operator");
-//                     } else {
-//                         throw std::runtime_error("Unknown token: " + token);
-//                     }
-//                     if (0.12 < x[0] && x[0] < .16)
-//                               join(" ", stack_to_vector(stack)).data());
-//                 }
-
-//                 if (0.12 < x[0] && x[0] < .16)
-//                           join(" ", stack_to_vector(stack)).data());
-
-//                 if (stack.size() != 1) throw std::runtime_error("Invalid RPN expression");
-//                 return stack.top();
-//             };
-
-
-//             TF1* fTerm =
-//                 new TF1(Form("fTerm%d", iRecipe), lambda, this->fDrawRangeMin, this->fDrawRangeMax, paraList.size());
-//             int color = iRecipe + 2;
-//             if (color >= 5) color++;
-//             fTerm->SetLineColor(color);
-//             fTerm->SetLineWidth(3);
-//             fTerm->SetNpx(1000);
-
-//             int counter = 0;
-//             for (const int& par : paraList) {
-//                 fTerm->FixParameter(counter++, this->fFit->GetParameter(par));
-//             }
-//             fTerm->Draw("same");
-//             leg->AddEntry(fTerm, legend.data());
-//         }
-//         leg->Draw("same");
-//     };
-
-//     void SetDrawRange(double xMin, double xMax) {
-//         this->fDrawRangeMin = xMin;
-//         this->fDrawRangeMax = xMax;
-//     }
-
-//     TF1* GetFitFunction() { return this->fFit; }
-
-    ClassDef(SuperFitterMultitrial, 1)
+    ClassDef(SuperFitterMultitrial, 4)
 };
 
 ClassImp(SuperFitterMultitrial);
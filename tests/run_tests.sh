@@ -12,6 +12,9 @@ popd
 # Load environment variables from .env
 source ../.env
 
+# Unit tests of the functions and of the fitter
+python3 -m pytest test_source_functions.py test_random.py test_running_stats.py test_superfitter.py test_multitrial.py || exit 1
+
 # Compule yaffa
 mkdir -p ../build || exit 1
 pushd ../build || exit 1
@@ -0,0 +1,139 @@
+# Test the multitrial fits
+# Usage:
+#   pytest
+
+import os
+import pytest
+from dotenv import load_dotenv
+from pathlib import Path
+
+env_path = Path(__file__).resolve().parent.parent / ".env"
+print(f'Loading env from {env_path}')
+if not load_dotenv(dotenv_path=env_path, verbose=True, override=True):
+    print("Environment variables in .env not loaded")
+YAFFA_PATH = os.getenv("YAFFA")
+if not YAFFA_PATH:
+    print("\033[33mWARNING: Path to yaffa is empty, something might break!\033[0m")
+
+from ROOT import gInterpreter
+gInterpreter.ProcessLine('#define DEBUG_LEVEL 0')
+gInterpreter.AddIncludePath(f'{YAFFA_PATH}/src/cpp')
+gInterpreter.Declare(f'#include "{YAFFA_PATH}/src/python/SuperFitterMultitrial.h"')
+gInterpreter.Declare(r'''
+namespace test {
+
+// Toy correlation function with a bump on a slope, with 50 bins between 0 and 0.5 GeV/c and noise from the given seed
+TH1D* ToyMultitrialCF(int seed) {
+    TH1D* hCF = new TH1D(Form("hMultitrialCF%d", seed), "", 50, 0, 0.5);
+    hCF->SetDirectory(nullptr);
+    for (int iBin = 1; iBin <= hCF->GetNbinsX(); iBin++) {
+        double x = hCF->GetBinCenter(iBin);
+        double value = 0.95 + 0.1 * x + 0.3 * std::exp(-0.5 * std::pow((x - 0.1) / 0.03, 2));
+        hCF->SetBinContent(iBin, value + 0.01 * sf::CounterRNG(seed, iBin).Gaus());
+        hCF->SetBinError(iBin, 0.01);
+    }
+    return hCF;
+}
+
+// Multitrial fit of 2 correlation functions x 3 fit ranges x 3 backgrounds x 2 signals = 36 trials. The functions of
+// the variations of the background are given, those that do not exist make their trials fail
+SuperFitterMultitrial* ToyMultitrial(bool warmStart, std::vector<std::string> backgrounds = {"pol1", "cheb1",
+                                                                                             "legendre1"}) {
+    SuperFitterMultitrial* multitrial = new SuperFitterMultitrial();
+    for (int seed : {1, 2}) multitrial->AddCF(new Observable(ToyMultitrialCF(seed)));
+    for (double xMax : {0.4, 0.45, 0.5}) multitrial->AddFitRange({{0, xMax}});
+    for (const auto& background : backgrounds) multitrial->Add("bkg", background, {{"p0", 1, -2, 2}, {"p1", 0, -1, 1}});
+    for (const auto& signal : {"gaus", "breit_wigner"}) {
+        multitrial->Add("sig", signal, {{"norm", 0.3, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.03, 0.01, 0.2}});
+    }
+    multitrial->SetWarmStart(warmStart);
+    multitrial->FitMultitrials("bkg + sig");
+    return multitrial;
+}
+
+// Flat list of the results of the trials of a toy multitrial fit on the given number of threads: for each trial its
+// status, number of calls, starting trial and parameters
+std::vector<double> ToyMultitrialResults(int nThreads) {
+    sf::ThreadPool::SetNThreads(nThreads);
+    std::unique_ptr<SuperFitterMultitrial> multitrial(ToyMultitrial(true));
+    sf::ThreadPool::SetNThreads(std::thread::hardware_concurrency());
+
+    std::vector<double> results = {};
+    for (const auto& trial : multitrial->GetTrials()) {
+        results.insert(results.end(), {(double)trial.status, (double)trial.nCalls, (double)trial.start});
+        results.insert(results.end(), trial.pars.begin(), trial.pars.end());
+    }
+    return results;
+}
+
+}  // namespace test
+''')
+from ROOT import test  # pylint: disable=ungrouped-imports
+
+N_TRIALS = 36
+
+
+def Variations(trial):
+    return [trial.cf, trial.range] + list(trial.terms)
+
+
+@pytest.fixture(scope='module')
+def warm():
+    return test.ToyMultitrial(True)
+
+
+@pytest.fixture(scope='module')
+def cold():
+    return test.ToyMultitrial(False)
+
+
+def test_decode(warm):
+    # The trials are numbered in mixed radix over (cf, range, terms), with the last term varying fastest
+    assert warm.GetNTrials() == N_TRIALS
+    assert list(warm.GetTermNames()) == ['bkg', 'sig']
+    for iTrial, trial in enumerate(warm.GetTrials()):
+        assert Variations(trial) == [iTrial // 18, iTrial // 6 % 3, iTrial // 2 % 3, iTrial % 2]
+
+
+def test_trial_order(warm):
+    # The order is a permutation of the trials in which consecutive ones differ by exactly one variation
+    order = list(warm.GetTrialOrder())
+    assert sorted(order) == list(range(N_TRIALS))
+    trials = warm.GetTrials()
+    for previous, current in zip(order, order[1:]):
+        differences = [a != b for a, b in zip(Variations(trials[previous]), Variations(trials[current]))]
+        assert sum(differences) == 1
+
+
+def test_bookkeeping(warm):
+    trials = warm.GetTrials()
+    assert all(trial.status == 0 and trial.nCalls > 0 for trial in trials)
+    assert all(len(trial.pars) == len(warm.GetParameterNames()) == 5 for trial in trials)
+
+    # The trials of a background that does not exist fail without stopping the other ones
+    failing = test.ToyMultitrial(True, ['pol1', 'unknown'])
+    for trial in failing.GetTrials():
+        if trial.terms[0] == 1:
+            assert (trial.status, trial.nCalls, len(trial.pars)) == (-1, 0, 0)
+        else:
+            assert trial.status == 0 and trial.nCalls > 0
+
+
+def test_warm_start(warm, cold):
+    # Each trial starts from the previous one of its chain, which differs by one variation, and converges to the same
+    # minimum as from the initial values of the parameters
+    order = list(warm.GetTrialOrder())
+    trials = warm.GetTrials()
+    assert trials[order[0]].start == -1
+    for trial in trials:
+        if trial.start >= 0:
+            assert order.index(trial.start) + 1 == order.index(trial.cf * 18 + trial.range * 6 + trial.terms[0] * 2 +
+                                                               trial.terms[1])
+    assert all(trial.start == -1 for trial in cold.GetTrials())
+    for warmTrial, coldTrial in zip(trials, cold.GetTrials()):
+        assert warmTrial.chi2 == pytest.approx(coldTrial.chi2, rel=1e-3, abs=1e-3)
+
+
+def test_thread_independence():
+    # The chains do not depend on the number of threads, so neither do the starting points and the results
+    assert list(test.ToyMultitrialResults(1)) == list(test.ToyMultitrialResults(4))
@@ -0,0 +1,64 @@
+# Test the counter-based random numbers
+# Usage:
+#   pytest
+
+import math
+import os
+import pytest
+from dotenv import load_dotenv
+from pathlib import Path
+
+env_path = Path(__file__).resolve().parent.parent / ".env"
+print(f'Loading env from {env_path}')
+if not load_dotenv(dotenv_path=env_path, verbose=True, override=True):
+    print("Environment variables in .env not loaded")
+YAFFA_PATH = os.getenv("YAFFA")
+if not YAFFA_PATH:
+    print("\033[33mWARNING: Path to yaffa is empty, something might break!\033[0m")
+
+from ROOT import gInterpreter
+gInterpreter.Declare(f'#include "{YAFFA_PATH}/src/cpp/Random.h"')
+gInterpreter.Declare(r'''
+namespace test {
+
+// Mean and variance of n Poisson numbers with mean lambda, each from its own stream
+std::vector<double> PoissonMoments(double lambda, int n) {
+    double sum = 0, sum2 = 0;
+    for (int i = 0; i < n; i++) {
+        double k = sf::CounterRNG(7, i).Poisson(lambda);
+        sum += k;
+        sum2 += k * k;
+    }
+    double mean = sum / n;
+    return {mean, (sum2 - n * mean * mean) / (n - 1)};
+}
+
+// First numbers of the streams (seed, i) consumed in the given order
+std::vector<double> Streams(std::vector<int> order) {
+    std::vector<double> values(order.size() * 3);
+    for (int i : order) {
+        sf::CounterRNG rng(7, i, 3);
+        for (int k = 0; k < 3; k++) values[i * 3 + k] = rng.Uniform();
+    }
+    return values;
+}
+
+}  // namespace test
+''')
+from ROOT import test  # pylint: disable=ungrouped-imports
+
+
+def test_streams():
+    # The numbers of a stream only depend on its key, not on the order in which the streams are used
+    assert list(test.Streams([0, 1, 2, 3])) == list(test.Streams([3, 1, 0, 2]))
+    assert len(set(test.Streams([0, 1, 2, 3]))) == 12
+
+
+@pytest.mark.parametrize('lam', [0.5, 3, 9.9, 10, 35, 1000])
+def test_poisson(lam):
+    # Both the multiplication of uniforms (lambda < 10) and the transformed rejection must give the Poisson moments,
+    # within 5 standard deviations of their estimates
+    n = 200000
+    mean, variance = test.PoissonMoments(lam, n)
+    assert abs(mean - lam) < 5 * math.sqrt(lam / n)
+    assert abs(variance - lam) < 5 * math.sqrt((lam + 2 * lam * lam) / n)
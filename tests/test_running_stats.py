@@ -0,0 +1,113 @@
+# Test the single-pass statistics of the multitrial fits
+# Usage:
+#   pytest
+
+import math
+import os
+import random
+import pytest
+from dotenv import load_dotenv
+from pathlib import Path
+
+env_path = Path(__file__).resolve().parent.parent / ".env"
+print(f'Loading env from {env_path}')
+if not load_dotenv(dotenv_path=env_path, verbose=True, override=True):
+    print("Environment variables in .env not loaded")
+YAFFA_PATH = os.getenv("YAFFA")
+if not YAFFA_PATH:
+    print("\033[33mWARNING: Path to yaffa is empty, something might break!\033[0m")
+
+from ROOT import gInterpreter
+gInterpreter.ProcessLine('#define DEBUG_LEVEL 0')
+gInterpreter.AddIncludePath(f'{YAFFA_PATH}/src/cpp')
+gInterpreter.Declare(f'#include "{YAFFA_PATH}/src/python/SuperFitterMultitrial.h"')
+gInterpreter.Declare(r'''
+namespace test {
+
+// Count, mean, variance, minimum, maximum and quantiles of the values, in this order, computed in a single pass
+std::vector<double> Summarize(std::vector<double> values, std::vector<double> probabilities) {
+    sf::RunningStats stats(probabilities);
+    for (double value : values) stats.Add(value);
+    std::vector<double> summary = {(double)stats.GetCount(), stats.GetMean(), stats.GetVariance(), stats.GetMin(),
+                                   stats.GetMax()};
+    for (int iQuantile = 0; iQuantile < stats.GetNQuantiles(); iQuantile++) {
+        summary.push_back(stats.GetQuantile(iQuantile));
+    }
+    return summary;
+}
+
+}  // namespace test
+''')
+from ROOT import sf, test  # pylint: disable=ungrouped-imports
+
+PROBABILITIES = [0.16, 0.5, 0.84]
+
+
+def Quantile(values, p):
+    '''Exact quantile, interpolated linearly between the sorted values at the position p (n - 1)'''
+    values = sorted(values)
+    position = p * (len(values) - 1)
+    low = min(int(position), len(values) - 1)
+    high = min(low + 1, len(values) - 1)
+    return values[low] + (position - low) * (values[high] - values[low])
+
+
+def Values(n, seed=1):
+    generator = random.Random(seed)
+    return [generator.gauss(1, 2) for _ in range(n)]
+
+
+@pytest.mark.parametrize('n', [1, 2, 4, 5, 6, 10, 50])
+def test_small_samples(n):
+    # The quantiles are exact as long as the observations are kept
+    values = Values(n)
+    summary = list(test.Summarize(values, PROBABILITIES))
+    mean = sum(values) / n
+    assert summary[0] == n
+    assert summary[1] == pytest.approx(mean, rel=1e-12, abs=1e-14)
+    assert summary[2] == pytest.approx(sum((v - mean)**2 for v in values) / (n - 1) if n > 1 else 0, rel=1e-12)
+    assert summary[3:5] == [min(values), max(values)]
+    assert summary[5:] == pytest.approx([Quantile(values, p) for p in PROBABILITIES], rel=1e-12)
+    if n > 1:
+        assert summary[5] < summary[6] < summary[7]
+
+
+@pytest.mark.parametrize('n', [51, 1000, 100000])
+def test_large_samples(n):
+    # The P-square estimates of the quantiles of a Gaussian with sigma = 2 differ from the exact ones by less than
+    # 2 sigma / sqrt(n), which is about the statistical uncertainty of the quantiles themselves
+    values = Values(n)
+    summary = list(test.Summarize(values, PROBABILITIES))
+    mean = sum(values) / n
+    assert summary[0] == n
+    assert summary[1] == pytest.approx(mean, rel=1e-10)
+    assert summary[2] == pytest.approx(sum((v - mean)**2 for v in values) / (n - 1), rel=1e-10)
+    assert summary[3:5] == [min(values), max(values)]
+    for p, estimate in zip(PROBABILITIES, summary[5:]):
+        assert abs(estimate - Quantile(values, p)) < 4 / math.sqrt(n)
+
+
+def test_non_finite():
+    summary = list(test.Summarize([1, math.nan, 3, math.inf], PROBABILITIES))
+    assert summary[:5] == [2, 2, 2, 1, 3]
+
+
+def test_aggregator():
+    aggregator = sf.SystematicAggregator(PROBABILITIES)
+    aggregator.Fill(['a', 'b'], [1, 2], 1.1, [0, 1, 2], [1.5, 1.2])
+    aggregator.Fill(['a', 'b'], [3, 4], 0.9, [0, 1, 2], [1.7, 1.0])
+    assert aggregator.GetNTrials() == 2
+    assert list(aggregator.GetNames()) == ['a', 'b', 'chi2/ndf']
+    assert aggregator.GetParameterStats(1).GetMean() == 3
+    assert aggregator.GetGenuineCFStats(0).GetMax() == 1.7
+
+    # Trials with other parameters or binning are rejected and not folded in
+    with pytest.raises(Exception):
+        aggregator.Fill(['a', 'b', 'c'], [1, 2, 3], 1, [0, 1, 2], [1.5, 1.2])
+    with pytest.raises(Exception):
+        aggregator.Fill(['a', 'c'], [1, 2], 1, [0, 1, 2], [1.5, 1.2])
+    with pytest.raises(Exception):
+        aggregator.Fill(['a', 'b'], [1, 2], 1, [0, 1, 2, 3], [1.5, 1.2, 1.1])
+    with pytest.raises(Exception):
+        aggregator.Fill(['a', 'b'], [1, 2], 1, [0, 1, 3], [1.5, 1.2])
+    assert aggregator.GetNTrials() == 2
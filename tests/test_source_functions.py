@@ -4,6 +4,7 @@
 
 import os
 import pytest
+from array import array
 from dotenv import load_dotenv
 from pathlib import Path
 
@@ -18,8 +19,11 @@ if not YAFFA_PATH:
 from ROOT import TF1, TF2, gInterpreter
 gInterpreter.Declare(f'#include "{YAFFA_PATH}/src/cpp/RootFunctions.hxx"')
 from ROOT import SourceGauss, SourceAAA, SourceAAAJC, SourceCountsGauss, SourceCountsAAA, SourceCountsAAAJC
+from ROOT import SourceGaussBatch, SourceAAABatch, SourceAAAJCBatch
+from ROOT import SourceCountsGaussBatch, SourceCountsAAABatch, SourceCountsAAAJCBatch
 
 EPSILON = 1.e-12
+REL_EPSILON = 1.e-13  # The sources span many orders of magnitude, so the batch versions are compared relatively
 
 def test_normalization_SourceAAA():
     fSourceAAA = TF1('fSourceAAA', SourceAAA, 0, 1000, 1)
@@ -27,9 +31,10 @@ def test_normalization_SourceAAA():
     fSourceAAA.SetNpx(100000)
     assert abs(fSourceAAA.Integral(0, 1000) - 1) < EPSILON
 
-def test_normalization_SourceGauss():
+@pytest.mark.parametrize('r0', [1, -1])
+def test_normalization_SourceGauss(r0):
     fSourceGauss = TF1('fSourceGauss', SourceGauss, 0, 1000, 1)
-    fSourceGauss.SetParameter(0, 1)
+    fSourceGauss.SetParameter(0, r0)
     fSourceGauss.SetNpx(100000)
     assert abs(fSourceGauss.Integral(0, 1000) - 1) < EPSILON
 
@@ -47,10 +52,11 @@ def test_normalization_SourceCountsAAA():
     fSourceCountsAAA.SetNpx(100000)
     assert abs(fSourceCountsAAA.Integral(0, 1000) - 1) < EPSILON
 
-def test_normalization_SourceCountsGauss():
+@pytest.mark.parametrize('r0', [1, -1])
+def test_normalization_SourceCountsGauss(r0):
     fSourceCountsGauss = TF1('fSourceCountsGauss', SourceCountsGauss, 0, 1000, 2)
     fSourceCountsGauss.SetParameter(0, 1)
-    fSourceCountsGauss.SetParameter(1, 1)
+    fSourceCountsGauss.SetParameter(1, r0)
     fSourceCountsGauss.SetNpx(100000)
     assert abs(fSourceCountsGauss.Integral(0, 1000) - 1) < EPSILON
 
@@ -61,3 +67,41 @@ def test_normalization_SourceCountsAAAJC():
     fSourceCountsAAAJC.SetNpx(10000)
     print("---> ", fSourceCountsAAAJC.Integral(0., 50, 0., 50))
     assert abs(fSourceCountsAAAJC.Integral(0., 50, 0., 50, EPSILON) - 1) < EPSILON
+
+def check_batch_1D(scalar, batch, pars):
+    x = array('d', [0.05 * i for i in range(400)])
+    p = array('d', pars)
+    out = array('d', [0.] * len(x))
+    batch(x, len(x), p, out)
+    for xi, value in zip(x, out):
+        assert value == pytest.approx(scalar(array('d', [xi]), p), rel=REL_EPSILON, abs=0)
+
+def check_batch_2D(scalar, batch, pars):
+    x = array('d', [0.1 * (i % 50) for i in range(1000)])
+    y = array('d', [0.1 * (i // 50) for i in range(1000)])
+    p = array('d', pars)
+    out = array('d', [0.] * len(x))
+    batch(x, y, len(x), p, out)
+    for xi, yi, value in zip(x, y, out):
+        assert value == pytest.approx(scalar(array('d', [xi, yi]), p), rel=REL_EPSILON, abs=0)
+
+def test_batch_SourceAAA():
+    check_batch_1D(SourceAAA, SourceAAABatch, [1.3])
+    check_batch_1D(SourceCountsAAA, SourceCountsAAABatch, [2.5, 1.3])
+
+def test_batch_SourceGauss():
+    check_batch_1D(SourceGauss, SourceGaussBatch, [1.3])
+    check_batch_1D(SourceCountsGauss, SourceCountsGaussBatch, [2.5, 1.3])
+
+    # The source only depends on r0^2
+    check_batch_1D(SourceGauss, SourceGaussBatch, [-1.3])
+    check_batch_1D(SourceCountsGauss, SourceCountsGaussBatch, [2.5, -1.3])
+    x = array('d', [0.05 * i for i in range(1, 400)])
+    positive, negative = array('d', [0.] * len(x)), array('d', [0.] * len(x))
+    SourceGaussBatch(x, len(x), array('d', [1.3]), positive)
+    SourceGaussBatch(x, len(x), array('d', [-1.3]), negative)
+    assert list(negative) == list(positive)
+
+def test_batch_SourceAAAJC():
+    check_batch_2D(SourceAAAJC, SourceAAAJCBatch, [1.3])
+    check_batch_2D(SourceCountsAAAJC, SourceCountsAAAJCBatch, [2.5, 1.3])
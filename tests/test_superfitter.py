@@ -0,0 +1,694 @@
+# Test the fitter
+# Usage:
+#   pytest
+
+import math
+import os
+import pytest
+from dotenv import load_dotenv
+from pathlib import Path
+
+env_path = Path(__file__).resolve().parent.parent / ".env"
+print(f'Loading env from {env_path}')
+if not load_dotenv(dotenv_path=env_path, verbose=True, override=True):
+    print("Environment variables in .env not loaded")
+YAFFA_PATH = os.getenv("YAFFA")
+if not YAFFA_PATH:
+    print("\033[33mWARNING: Path to yaffa is empty, something might break!\033[0m")
+
+from ROOT import gInterpreter
+gInterpreter.ProcessLine('#define DEBUG_LEVEL 0')
+gInterpreter.Declare(f'#include "{YAFFA_PATH}/src/cpp/SuperFitter.h"')
+
+# The checks that need the internals of the fitter are written in C++ and return a number that is tested here
+gInterpreter.Declare(r'''
+namespace test {
+
+// Toy correlation function with a bump on a slope, with 50 bins between 0 and 0.5 GeV/c
+TH1D* ToyCF(const char* name, double noise = 0) {
+    TH1D* hCF = new TH1D(name, "", 50, 0, 0.5);
+    for (int iBin = 1; iBin <= hCF->GetNbinsX(); iBin++) {
+        double x = hCF->GetBinCenter(iBin);
+        double value = 0.95 + 0.1 * x + 0.3 * std::exp(-0.5 * std::pow((x - 0.1) / 0.03, 2));
+        hCF->SetBinContent(iBin, value + noise * sf::CounterRNG(1234, iBin).Gaus());
+        hCF->SetBinError(iBin, 0.01);
+    }
+    return hCF;
+}
+
+// Largest difference between the derivatives of a recipe computed by EvaluateGradient and by central finite
+// differences, relative to the largest derivative, at the bin centres of the observable. The parameters are the ones
+// of the components in the order in which they are added, followed by the one of "raw"
+double MaxGradientError(std::string wfFile) {
+    SuperFitter fitter;
+    fitter.SetFitRange({{0, 0.5}});
+    fitter.AddObservable(new Observable(ToyCF("hGradientCF")));
+
+    TH1D* hTemplate = ToyCF("hGradientTemplate");
+    fitter.Add(0, "tmpl", hTemplate, {{"s", 0.8, 0, 2}});
+    fitter.Add(0, "pol", "pol2", {{"a0", 1, 0, 2}, {"a1", 0.2, -1, 1}, {"a2", -0.3, -1, 1}});
+    fitter.Add(0, "cheb", "cheb3", {{"c0", 1, 0, 2}, {"c1", 0.1, -1, 1}, {"c2", 0.05, -1, 1}, {"c3", -0.02, -1, 1}});
+    fitter.Add(0, "gaus", "gaus", {{"norm", 0.2, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.04, 0.01, 0.1}});
+    fitter.Add(0, "kp", "kp_gauss", wfFile, {{"r0", 1.2, 0.5, 3}});
+    std::vector<double> pars = {0.8, 1, 0.2, -0.3, 1, 0.1, 0.05, -0.02, 0.2, 0.1, 0.04, 1.2, 0.01};
+
+    // All the opcodes and kinds of components, including constants and the data
+    sf::tape tape = fitter.CompileRecipe(0, "(pol + cheb) * tmpl / (kp + 2) - gaus * raw + 0.5");
+    const int n = 50;
+    const int nPars = tape.nPars;
+    if (nPars != (int)pars.size()) return 1;
+
+    int maxPars = 1;
+    for (const auto& instr : tape.code) maxPars = std::max(maxPars, instr.nPars);
+    std::vector<double> buffer(tape.depth * n), dBuffer(tape.depth * nPars * n), jac(maxPars * n);
+    std::vector<double> values(n), derivatives(nPars * n), up(n), down(n);
+    std::vector<double> x(n);
+    for (int i = 0; i < n; i++) x[i] = 0.005 + 0.01 * i;
+    EvaluateGradient(tape, x.data(), n, pars.data(), buffer.data(), dBuffer.data(), jac.data(), values.data(),
+                     derivatives.data());
+
+    double maxDerivative = 0, maxError = 0;
+    for (int iPar = 0; iPar < nPars; iPar++) {
+        std::vector<double> shifted = pars;
+        const double step = 1e-6 * std::max(1., std::abs(pars[iPar]));
+        shifted[iPar] = pars[iPar] + step;
+        Evaluate(tape, x.data(), n, shifted.data(), buffer.data(), up.data());
+        shifted[iPar] = pars[iPar] - step;
+        Evaluate(tape, x.data(), n, shifted.data(), buffer.data(), down.data());
+        for (int i = 0; i < n; i++) {
+            const double numeric = (up[i] - down[i]) / (2 * step);
+            maxDerivative = std::max(maxDerivative, std::abs(numeric));
+            maxError = std::max(maxError, std::abs(derivatives[iPar * n + i] - numeric));
+        }
+    }
+    return maxError / maxDerivative;
+}
+
+// Values of a component with the given parameters at some points, evaluated in batch by the compiled recipe. The fit
+// range has a gap and its intervals are not in order, so that the polynomials of cheb and legendre are defined over
+// [0.1, 0.5]
+std::vector<double> ComponentValues(std::string func, std::vector<double> pars, std::vector<double> x) {
+    static int nCalls = 0;
+    SuperFitter fitter;
+    fitter.SetFitRange({{0.35, 0.5}, {0.1, 0.2}});
+    fitter.AddObservable(new Observable(ToyCF(Form("hValuesCF%d", nCalls++))));
+    std::vector<sf::parameter> parameters = {};
+    for (size_t iPar = 0; iPar < pars.size(); iPar++) parameters.push_back({Form("c%zu", iPar), pars[iPar], -100, 100});
+    fitter.Add(0, "poly", func, parameters);
+
+    sf::tape tape = fitter.CompileRecipe(0, "poly");
+    std::vector<double> buffer(tape.depth * x.size()), values(x.size());
+    Evaluate(tape, x.data(), x.size(), pars.data(), buffer.data(), values.data());
+    return values;
+}
+
+// Largest difference between the parameters, and between their uncertainties, of the fits of a toy with and without
+// variable projection, in units of the uncertainties
+double VarProDifference(bool uncertainties) {
+    std::vector<double> pars[2], errors[2];
+    for (int projected = 0; projected < 2; projected++) {
+        SuperFitter fitter;
+        fitter.SetFitRange({{0, 0.5}});
+        fitter.AddObservable(new Observable(ToyCF(Form("hVarProCF%d", projected), 0.01)));
+        fitter.Add(0, "bkg", "pol1", {{"p0", 1, 0, 2}, {"p1", 0, -1, 1}});
+        fitter.Add(0, "sig", "gaus", {{"norm", 0.1, 0, 1}, {"mean", 0.12, 0, 0.5}, {"sigma", 0.05, 0.01, 0.1}});
+        fitter.SetModel(0, "bkg + sig");
+        fitter.SetVariableProjection(projected);
+        fitter.Fit();
+        if (fitter.GetStatus() != 0) return 1e10;
+        pars[projected] = fitter.GetParameters();
+        errors[projected] = fitter.GetParErrors();
+    }
+
+    double difference = 0;
+    for (size_t iPar = 0; iPar < pars[0].size(); iPar++) {
+        double delta = uncertainties ? errors[1][iPar] - errors[0][iPar] : pars[1][iPar] - pars[0][iPar];
+        difference = std::max(difference, std::abs(delta) / errors[0][iPar]);
+    }
+    return difference;
+}
+
+// Parameters of the bootstrap replicas of a toy fit, one replica after the other, fitted on the given number of threads
+std::vector<double> BootstrapParameters(int nThreads, std::string mode) {
+    sf::ThreadPool::SetNThreads(nThreads);
+    SuperFitter fitter;
+    fitter.SetFitRange({{0, 0.5}});
+    fitter.AddObservable(new Observable(ToyCF(Form("hBootstrapCF%d%s", nThreads, mode.data()), 0.01)));
+    fitter.Add(0, "bkg", "pol1", {{"p0", 1, 0, 2}, {"p1", 0, -1, 1}});
+    fitter.Add(0, "sig", "gaus", {{"norm", 0.3, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.03, 0.01, 0.1}});
+    fitter.SetModel(0, "bkg + sig");
+    fitter.Fit();
+    fitter.Bootstrap(12, mode, 42);
+    sf::ThreadPool::SetNThreads(std::thread::hardware_concurrency());
+
+    std::vector<double> pars = {};
+    for (const auto& replica : fitter.GetBootstrapParameters()) pars.insert(pars.end(), replica.begin(), replica.end());
+    return pars;
+}
+
+// Uncertainty of the constant fitted to a toy whose bins are all negative, followed by the constants fitted to 50
+// bootstrap replicas of it
+std::vector<double> NegativeBootstrap(std::string mode) {
+    TH1D* hCF = new TH1D(Form("hNegativeCF%s", mode.data()), "", 50, 0, 0.5);
+    for (int iBin = 1; iBin <= hCF->GetNbinsX(); iBin++) {
+        hCF->SetBinContent(iBin, -1 + 0.01 * sf::CounterRNG(4321, iBin).Gaus());
+        hCF->SetBinError(iBin, 0.01);
+    }
+    SuperFitter fitter;
+    fitter.SetFitRange({{0, 0.5}});
+    fitter.AddObservable(new Observable(hCF));
+    fitter.Add(0, "bkg", "pol0", {{"p0", -0.5, -2, 2}});
+    fitter.SetModel(0, "bkg");
+    fitter.Fit();
+    fitter.Bootstrap(50, mode, 42);
+
+    std::vector<double> results = {fitter.GetParErrors()[0]};
+    for (const auto& replica : fitter.GetBootstrapParameters()) results.push_back(replica[0]);
+    return results;
+}
+
+// Largest difference between the uncertainties of the genuine correlation function of a toy fit and the ones of the
+// brute-force propagation J C J^T with the derivatives from finite differences, plus the uncertainty of the data for
+// the "raw" term, relative to the uncertainties. The template adds its uncertainties to the ones of the fitted data
+double GenuineBandDifference() {
+    SuperFitter fitter;
+    fitter.SetFitRange({{0, 0.5}});
+    fitter.AddObservable(new Observable(ToyCF("hBandCF", 0.01)));
+    fitter.Add(0, "tmpl", ToyCF("hBandTemplate"), {{"s", 0.9, 0, 2}});
+    fitter.Add(0, "bkg", "pol1", {{"p0", 0, -1, 1}, {"p1", 0, -1, 1}});
+    fitter.SetModel(0, "tmpl + bkg");
+    fitter.Fit();
+    if (fitter.GetStatus() != 0) return 1e10;
+
+    const std::string recipe = "raw - bkg";
+    TH1D* hGenCF = fitter.GetGenuineCF(0, recipe);
+    const TMatrixDSym covariance = fitter.GetCovarianceMatrix();
+    const int nFitPars = covariance.GetNrows();
+
+    sf::tape tape = fitter.CompileRecipe(0, recipe);
+    const int n = hGenCF->GetNbinsX();
+    std::vector<double> pars = fitter.GetParameters();
+    pars.push_back(0);
+    std::vector<double> buffer(tape.depth * n), up(n), down(n), derivatives((nFitPars + 1) * n);
+    std::vector<double> x(n);
+    for (int i = 0; i < n; i++) x[i] = hGenCF->GetBinCenter(i + 1);
+    for (int iPar = 0; iPar <= nFitPars; iPar++) {
+        std::vector<double> shifted = pars;
+        const double step = 1e-6 * std::max(1., std::abs(pars[iPar]));
+        shifted[iPar] = pars[iPar] + step;
+        Evaluate(tape, x.data(), n, shifted.data(), buffer.data(), up.data());
+        shifted[iPar] = pars[iPar] - step;
+        Evaluate(tape, x.data(), n, shifted.data(), buffer.data(), down.data());
+        for (int i = 0; i < n; i++) derivatives[iPar * n + i] = (up[i] - down[i]) / (2 * step);
+    }
+
+    double difference = 0;
+    for (int i = 0; i < n; i++) {
+        double variance = std::pow(derivatives[nFitPars * n + i] * 0.01, 2);
+        for (int a = 0; a < nFitPars; a++) {
+            for (int b = 0; b < nFitPars; b++) {
+                variance += derivatives[a * n + i] * covariance(a, b) * derivatives[b * n + i];
+            }
+        }
+        const double expected = std::sqrt(variance);
+        difference = std::max(difference, std::abs(hGenCF->GetBinError(i + 1) - expected) / expected);
+    }
+    delete hGenCF;
+    return difference;
+}
+
+// Toy fit of a bump on a background given by a function of degree 1, with its results cached in a directory
+SuperFitter* CachedFit(std::string directory, std::string background, std::string parName = "p") {
+    static int nFits = 0;
+    SuperFitter* fitter = new SuperFitter();
+    fitter->SetFitRange({{0, 0.5}});
+    fitter->SetCacheDirectory(directory);
+    fitter->AddObservable(new Observable(ToyCF(Form("hCacheCF%d", nFits++), 0.01)));
+    fitter->Add(0, "bkg", background, {{parName + "0", 1, 0, 2}, {parName + "1", 0, -1, 1}});
+    fitter->Add(0, "sig", "gaus", {{"norm", 0.3, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.03, 0.01, 0.1}});
+    fitter->SetModel(0, "bkg + sig");
+    return fitter;
+}
+
+// Dawson function in extended precision, from its Taylor series for |x| < 1 and otherwise from the sum of Rybicki,
+// D(x) = 1/sqrt(pi) sum_{n odd} exp(-(x - n h)^2) / n, whose error with h = 0.1 is of order exp(-(pi / 2h)^2)
+long double ReferenceDawson(long double x) {
+    const long double ax = std::fabs(x);
+    long double sum = 0;
+    if (ax < 1) {
+        long double term = ax;
+        for (int k = 0; k < 60; k++) {
+            sum += term;
+            term *= -2 * ax * ax / (2 * k + 3);
+        }
+    } else {
+        const long double h = 0.1L;
+        const int centre = ax / h;
+        for (int n = centre - 400; n <= centre + 400; n++) {
+            if (n % 2 == 0) continue;
+            sum += std::exp(-(ax - n * h) * (ax - n * h)) / n;
+        }
+        sum /= std::sqrt(3.141592653589793238462643383279502884L);
+    }
+    return x < 0 ? -sum : sum;
+}
+
+// Largest relative difference between sf::Dawson and the reference, on a grid that crosses all the intervals of the
+// table and the tail
+double MaxDawsonError() {
+    double maxError = 0;
+    std::vector<double> points = {50, 100, 1e3, 1e5};
+    for (double x = -30; x <= 30; x += 0.00731) points.push_back(x);
+    for (double x : points) {
+        const double reference = ReferenceDawson(x);
+        maxError = std::max(maxError, std::abs(sf::Dawson(x) - reference) / std::abs(reference));
+    }
+    return maxError;
+}
+
+// Largest relative difference between the Lednicky model evaluated in batch and the sum of the two Gaussian sources
+// computed point by point with GeneralLednicky
+double MaxLednickyBatchError(std::vector<double> par) {
+    const int n = 300;
+    std::vector<double> x(n), batch(n);
+    for (int i = 0; i < n; i++) x[i] = 0.002 * i;
+    LednickyBatch(x.data(), n, par.data(), batch.data());
+
+    double maxError = 0;
+    const std::complex<double> a0(par[0], par[1]);
+    for (int i = 0; i < n; i++) {
+        const double ll1 = GeneralLednicky(x[i], par[3], a0, par[2]);
+        const double ll2 = GeneralLednicky(x[i], par[4], a0, par[2]);
+        const double expected = par[6] * (par[5] * ll1 + (1 - par[5]) * ll2) + 1 - par[6];
+        maxError = std::max(maxError, std::abs(batch[i] - expected) / std::abs(expected));
+    }
+    return maxError;
+}
+
+// Correlation function of a Gaussian source with radius r0 at the given momenta in GeV/c, and its derivative if
+// derivative is true
+std::vector<double> KooninPrattGauss(std::string wfFile, double r0, std::vector<double> x, bool derivative = false) {
+    sf::KooninPratt kp(sf::WaveFunctionTable::Load(wfFile), sf::GaussSource, 1);
+    std::vector<double> values(x.size()), jac(x.size());
+    kp.Evaluate(x.data(), x.size(), &r0, values.data(), jac.data());
+    return derivative ? jac : values;
+}
+
+// Free squared wave function of identical bosons at the momentum k in MeV/c and the distance r in fm
+double FreeWaveFunction(double k, double r) {
+    const double x = 2 * k * r * 5.067731237e-3;
+    return x > 0 ? 1 + std::sin(x) / x : 2;
+}
+
+// Pair table of the free wave function with 6 momenta up to 100 MeV/c and a fine radial grid up to 16 fm
+std::shared_ptr<const sf::WaveFunctionTable> FreePairTable() {
+    std::vector<double> kStar, radius, width, values;
+    for (int iK = 0; iK < 6; iK++) kStar.push_back(20 * iK);
+    for (int iR = 0; iR < 3200; iR++) {
+        radius.push_back(0.0025 + 0.005 * iR);
+        width.push_back(0.005);
+    }
+    for (double k : kStar) {
+        for (double r : radius) values.push_back(FreeWaveFunction(k, r));
+    }
+    return std::make_shared<const sf::WaveFunctionTable>(kStar, radius, width, values);
+}
+
+// Largest relative difference between the pairwise-factorized three-body table and the angular average of the product
+// of the free pair wave functions, 1/2 psi^2(r12) int psi^2(r13) psi^2(r23) dcos, computed with Simpson's rule
+double MaxFactorizedError() {
+    const int nR = 10;
+    const double rMax = 10;
+    const auto table = sf::WaveFunction3BTable::Factorized(*FreePairTable(), rMax, nR, 16);
+    const auto& q3 = table.GetQ3();
+    const auto& r = table.GetR12();
+    if ((int)r.size() != nR || (int)table.GetR312().size() != nR || q3.size() != 6) return 1;
+
+    double maxError = 0;
+    std::vector<double> a(nR), b(nR);
+    for (int iQ = 0; iQ < (int)q3.size(); iQ++) {
+        const double k = q3[iQ] / (2 * std::sqrt(3));
+        for (int i12 = 0; i12 < nR; i12++) {
+            for (int i312 = 0; i312 < nR; i312++) {
+                // Single entry of the table, as the projection on two unit vectors
+                std::fill(a.begin(), a.end(), 0);
+                std::fill(b.begin(), b.end(), 0);
+                a[i12] = b[i312] = 1;
+                double value;
+                table.Project(iQ, a.data(), 1, b.data(), 1, &value);
+
+                const int nSteps = 2000;
+                double average = 0;
+                for (int iStep = 0; iStep <= nSteps; iStep++) {
+                    const double cosine = -1 + 2. * iStep / nSteps;
+                    const double base = r[i312] * r[i312] + 0.25 * r[i12] * r[i12];
+                    const double cross = r[i312] * r[i12] * cosine;
+                    const double weight = iStep == 0 || iStep == nSteps ? 1 : (iStep % 2 ? 4 : 2);
+                    average += weight * FreeWaveFunction(k, std::sqrt(base - cross)) *
+                               FreeWaveFunction(k, std::sqrt(base + cross));
+                }
+                average *= 2. / nSteps / 3;
+                const double expected = 0.5 * FreeWaveFunction(k, r[i12]) * average;
+                maxError = std::max(maxError, std::abs(value - expected) / expected);
+            }
+        }
+    }
+    return maxError;
+}
+
+// Three-body correlation function of a Gaussian source with radius r0 at the given momenta in GeV/c, with the table
+// factorized from the free pair wave function, and its derivative if derivative is true
+std::vector<double> KooninPratt3BGauss(double r0, std::vector<double> x, bool derivative = false) {
+    sf::KooninPratt3B kp(std::make_shared<const sf::WaveFunction3BTable>(
+        sf::WaveFunction3BTable::Factorized(*FreePairTable(), 20, 100, 16)));
+    std::vector<double> values(x.size()), jac(x.size());
+    kp.Evaluate(x.data(), x.size(), &r0, values.data(), jac.data());
+    return derivative ? jac : values;
+}
+
+// Largest difference between the derivative of the three-body correlation function with respect to r0 and the one
+// from central finite differences, relative to the largest derivative
+double MaxKooninPratt3BGradientError(double r0) {
+    std::vector<double> x;
+    for (int i = 0; i < 40; i++) x.push_back(0.0075 * i);
+    const std::vector<double> jac = KooninPratt3BGauss(r0, x, true);
+    const double step = 1e-5 * r0;
+    const std::vector<double> up = KooninPratt3BGauss(r0 + step, x);
+    const std::vector<double> down = KooninPratt3BGauss(r0 - step, x);
+
+    double maxDerivative = 0, maxError = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        const double numeric = (up[i] - down[i]) / (2 * step);
+        maxDerivative = std::max(maxDerivative, std::abs(numeric));
+        maxError = std::max(maxError, std::abs(jac[i] - numeric));
+    }
+    return maxError / maxDerivative;
+}
+
+// Fit of a toy with a straight line, and with a Gaussian on top of it if requested. The line alone is a linear model,
+// whose chi2 is quadratic in its parameters
+SuperFitter* ToyScanFitter(const char* name, bool signal) {
+    SuperFitter* fitter = new SuperFitter();
+    fitter->SetFitRange({{0, 0.5}});
+    fitter->AddObservable(new Observable(ToyCF(name, 0.01)));
+    fitter->Add(0, "bkg", "pol1", {{"p0", 1, -10, 10}, {"p1", 0, -10, 10}});
+    if (signal) fitter->Add(0, "sig", "gaus", {{"norm", 0.3, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.03, 0.01, 0.1}});
+    fitter->SetModel(0, signal ? "bkg + sig" : "bkg");
+    fitter->Fit();
+    return fitter;
+}
+
+// Names of the graphs of the terms of a toy fit sampled a second time with the recipes in the opposite order, which
+// must be the graphs cached by the first sampling
+std::vector<std::string> ResampledTermNames() {
+    SuperFitter fitter;
+    fitter.SetFitRange({{0, 0.5}});
+    fitter.SetDrawRange(0, 0.5);
+    fitter.AddObservable(new Observable(ToyCF("hTermNamesCF", 0.01)));
+    fitter.Add(0, "bkg", "pol1", {{"p0", 1, -10, 10}, {"p1", 0, -10, 10}});
+    fitter.Add(0, "sig", "gaus", {{"norm", 0.3, 0, 1}, {"mean", 0.1, 0, 0.5}, {"sigma", 0.03, 0.01, 0.1}});
+    fitter.SetModel(0, "bkg + sig");
+    fitter.Fit();
+
+    std::vector<TGraph*> first = fitter.SampleRecipes(0, {"bkg", "sig"});
+    std::vector<TGraph*> second = fitter.SampleRecipes(0, {"sig", "bkg"});
+    if (second[0] != first[1] || second[1] != first[0]) return {};
+    return {second[0]->GetName(), second[1]->GetName()};
+}
+
+// Chi2 of a scan of a grid of 5 x 5 points of the Gaussian of a toy on the given number of threads, followed by the
+// parameters at each point
+std::vector<double> ScanGridResults(int nThreads) {
+    sf::ThreadPool::SetNThreads(nThreads);
+    std::unique_ptr<SuperFitter> fitter(ToyScanFitter(Form("hScanThreadsCF%d", nThreads), true));
+    std::vector<double> results = fitter->ScanGrid({"mean", "sigma"}, {{0.08, 0.09, 0.1, 0.11, 0.12},
+                                                                       {0.02, 0.025, 0.03, 0.035, 0.04}});
+    sf::ThreadPool::SetNThreads(std::thread::hardware_concurrency());
+
+    for (const auto& pars : fitter->GetScanParameters()) results.insert(results.end(), pars.begin(), pars.end());
+    return results;
+}
+
+}  // namespace test
+''')
+from ROOT import test  # pylint: disable=ungrouped-imports
+
+
+def WriteWaveFunction(path):
+    '''Free wave function of identical bosons, |psi|^2 = 1 + sin(2 k r) / (2 k r), in the text format of
+    scripts/cats/ComputeWaveFunction.py'''
+    momenta = [2.5 + 5 * iK for iK in range(120)]
+    radii = [0.05 + 0.1 * iR for iR in range(300)]
+    with open(path, 'w') as file:
+        file.write('# radius ' + ' '.join(f'{k:.3f}' for k in momenta) + '\n')
+        for r in radii:
+            values = [1 + math.sin(2 * k * r * 5.067731237e-3) / (2 * k * r * 5.067731237e-3) for k in momenta]
+            file.write(f'{r:.4f} ' + ' '.join(f'{value:.12e}' for value in values) + '\n')
+    return str(path)
+
+
+def test_koonin_pratt(tmp_path):
+    # Same correlation function as scripts/KooninPratt.py at the momenta of the table, whose radial bins have the same
+    # width, and no correlation function for radii that are not positive
+    import sys
+    from ROOT import TFile
+    sys.path.insert(0, str(Path(__file__).resolve().parent.parent / 'scripts'))
+    import KooninPratt
+
+    wfFile = WriteWaveFunction(tmp_path / 'wf.dat')
+    KooninPratt.main(str(tmp_path / 'cf.root'), wfFile, 'gauss2b:1.3')
+    inFile = TFile(str(tmp_path / 'cf.root'))
+    gCF = inFile.Get('gCF')
+    momenta = [gCF.GetPointX(iPoint) for iPoint in range(gCF.GetN())]
+    expected = [gCF.GetPointY(iPoint) for iPoint in range(gCF.GetN())]
+    inFile.Close()
+
+    assert len(momenta) == 120
+    assert list(test.KooninPrattGauss(wfFile, 1.3, [k / 1000 for k in momenta])) == pytest.approx(expected, rel=1e-12)
+    assert all(math.isnan(value) for value in test.KooninPrattGauss(wfFile, -1.3, [0.01, 0.1]))
+    assert all(math.isnan(value) for value in test.KooninPrattGauss(wfFile, 0, [0.01, 0.1], True))
+
+
+def test_factorized_three_body_table():
+    # Limited by the linear interpolation of the pair table
+    assert test.MaxFactorizedError() < 1e-4
+
+
+@pytest.mark.parametrize('r0', [0.8, 1.5, 3])
+def test_koonin_pratt_three_body_gradient(r0):
+    assert test.MaxKooninPratt3BGradientError(r0) < 1e-6
+
+
+def test_koonin_pratt_three_body_radius():
+    assert all(math.isnan(value) for value in test.KooninPratt3BGauss(-1.5, [0.01, 0.1]))
+    assert all(math.isnan(value) for value in test.KooninPratt3BGauss(0, [0.01, 0.1], True))
+
+
+def test_gradient(tmp_path):
+    wfFile = WriteWaveFunction(tmp_path / 'wf.dat')
+    assert test.MaxGradientError(wfFile) < 1e-6
+
+
+def test_cache(tmp_path):
+    # The first fit is stored, the second one is restored from it
+    first = test.CachedFit(str(tmp_path), 'pol1')
+    first.Fit()
+    assert len(list(tmp_path.glob('*.fit'))) == 1
+    second = test.CachedFit(str(tmp_path), 'pol1')
+    second.Fit()
+    assert len(list(tmp_path.glob('*.fit'))) == 1
+    assert list(second.GetParameters()) == list(first.GetParameters())
+    assert second.GetNCalls() == first.GetNCalls()
+
+    # Another function that has the same values at the initial parameters is a different fit
+    other = test.CachedFit(str(tmp_path), 'cheb1')
+    other.Fit()
+    assert len(list(tmp_path.glob('*.fit'))) == 2
+
+    # A result is not restored into parameters with other names
+    renamed = test.CachedFit(str(tmp_path), 'pol1', 'q')
+    renamed.IndexParameters()
+    assert not renamed.LoadResult(str(next(tmp_path.glob('*.fit'))))
+
+    # Nor from a file with a corrupted number of parameters
+    for nDim in [-5, 2000000000]:
+        corrupted = tmp_path / f'corrupted{nDim}.txt'
+        corrupted.write_text(f'sf-fit-result 1 {nDim}\n')
+        assert not second.LoadResult(str(corrupted))
+
+
+def test_genuine_cf_band():
+    assert test.GenuineBandDifference() < 1e-6
+
+
+def test_term_names():
+    # The graphs are named after the position of their recipe, also when they come from the cache
+    assert list(test.ResampledTermNames()) == ['gTerm0_0', 'gTerm0_1']
+
+
+# Closed forms of the polynomials of degree 0 to 5
+CHEBYSHEV = [
+    lambda t: 1,
+    lambda t: t,
+    lambda t: 2 * t**2 - 1,
+    lambda t: 4 * t**3 - 3 * t,
+    lambda t: 8 * t**4 - 8 * t**2 + 1,
+    lambda t: 16 * t**5 - 20 * t**3 + 5 * t,
+]
+LEGENDRE = [
+    lambda t: 1,
+    lambda t: t,
+    lambda t: (3 * t**2 - 1) / 2,
+    lambda t: (5 * t**3 - 3 * t) / 2,
+    lambda t: (35 * t**4 - 30 * t**2 + 3) / 8,
+    lambda t: (63 * t**5 - 70 * t**3 + 15 * t) / 8,
+]
+
+
+@pytest.mark.parametrize('func, polynomials', [('cheb5', CHEBYSHEV), ('legendre5', LEGENDRE)])
+def test_orthogonal_polynomials(func, polynomials):
+    # Each coefficient multiplies its polynomial of x mapped from the hull of the fit range onto [-1, 1]
+    x = [0.1 + 0.02 * iPoint for iPoint in range(21)]
+    t = [(xi - 0.1) / 0.2 - 1 for xi in x]
+    for degree, polynomial in enumerate(polynomials):
+        pars = [1. if iPar == degree else 0. for iPar in range(6)]
+        expected = [polynomial(ti) for ti in t]
+        assert list(test.ComponentValues(func, pars, x)) == pytest.approx(expected, rel=1e-12, abs=1e-12)
+
+    # And the series is their linear combination
+    pars = [0.9, -0.4, 0.3, 0.2, -0.1, 0.05]
+    expected = [sum(par * polynomial(ti) for par, polynomial in zip(pars, polynomials)) for ti in t]
+    assert list(test.ComponentValues(func, pars, x)) == pytest.approx(expected, rel=1e-12, abs=1e-12)
+
+
+def test_pol9():
+    # The Horner scheme agrees with the sum of the powers of x, also far from the fit range
+    pars = [0.9, -1.3, 2.1, 0.4, -0.7, 1.1, -0.2, 0.05, -0.8, 0.3]
+    x = [-2 + 0.1 * iPoint for iPoint in range(41)]
+    expected = [sum(par * math.pow(xi, k) for k, par in enumerate(pars)) for xi in x]
+    assert list(test.ComponentValues('pol9', pars, x)) == pytest.approx(expected, rel=1e-12, abs=1e-12)
+
+
+def test_dawson():
+    assert test.MaxDawsonError() < 1e-15
+
+
+@pytest.mark.parametrize('par', [
+    [1.2, 0.3, 2.5, 1.1, 2.3, 0.6, 0.9],
+    [-0.8, 0.0, 0.0, 0.8, 0.8, 1.0, 1.0],
+    [5.0, 1.5, -3.0, 3.0, 1.5, 0.2, 0.5],
+])
+def test_lednicky_batch(par):
+    assert test.MaxLednickyBatchError(par) < 1e-13
+
+
+def BinMask(fitRange):
+    '''Bins of a histogram with 10 bins between 0 and 10, whose centres are exact, that are in the fit range'''
+    from ROOT import SuperFitter, TH1D
+    hist = TH1D('hMask', '', 10, 0, 10)
+    fitter = SuperFitter()
+    fitter.SetFitRange(fitRange)
+    mask = [iBin for iBin, included in enumerate(fitter.GetBinMask(hist)) if included]
+    hist.Delete()
+    return mask
+
+
+def test_variable_projection():
+    # Same minimum and uncertainties as the fit of all the parameters, within the tolerance of the minimizer
+    assert test.VarProDifference(False) < 0.02
+    assert test.VarProDifference(True) < 0.01
+
+
+def test_normal_equations():
+    from ROOT import SolveNormalEquations
+
+    # Well conditioned
+    assert list(SolveNormalEquations([4., 2., 2., 3.], [8., 7.], 2)) == pytest.approx([1.25, 1.5], rel=1e-14)
+
+    # Singular: the directions with a vanishing pivot are set to 0 and the rest still solves the system
+    assert list(SolveNormalEquations([1., 1., 1., 1.], [2., 2.], 2)) == pytest.approx([2, 0], abs=1e-14)
+    assert list(SolveNormalEquations([4., 0., 0., 0.], [8., 0.], 2)) == pytest.approx([2, 0], abs=1e-14)
+    assert list(SolveNormalEquations([0.] * 4, [0.] * 2, 2)) == [0, 0]
+
+    # Ill conditioned: Hilbert matrix of order 8, with a condition number of 1.5e10
+    n = 8
+    hilbert = [1 / (i + j + 1) for i in range(n) for j in range(n)]
+    expected = [1 + 0.1 * i for i in range(n)]
+    b = [sum(hilbert[i * n + j] * expected[j] for j in range(n)) for i in range(n)]
+    solution = list(SolveNormalEquations(hilbert, b, n))
+    assert solution == pytest.approx(expected, rel=1e-4)
+    residuals = [sum(hilbert[i * n + j] * solution[j] for j in range(n)) - b[i] for i in range(n)]
+    assert max(abs(r) for r in residuals) < 1e-12
+
+
+@pytest.mark.parametrize('mode', ['gaus', 'poisson'])
+def test_bootstrap_reproducibility(mode):
+    # Each point of each replica has its own random stream, so the replicas do not depend on the number of threads
+    serial = list(test.BootstrapParameters(1, mode))
+    parallel = list(test.BootstrapParameters(4, mode))
+    assert len(serial) == 12 * 5
+    assert serial == parallel
+    assert len(set(serial[::5])) == 12
+
+
+def test_bootstrap_negative_bins():
+    # The bins that are not positive have no counts, so they fluctuate like Gaussians also in the "poisson" mode
+    poisson = list(test.NegativeBootstrap('poisson'))
+    assert poisson == list(test.NegativeBootstrap('gaus'))
+    error, replicas = poisson[0], poisson[1:]
+    mean = sum(replicas) / len(replicas)
+    spread = math.sqrt(sum((replica - mean)**2 for replica in replicas) / (len(replicas) - 1))
+    assert spread == pytest.approx(error, rel=0.3)
+
+
+def test_bin_mask():
+    # The bin centres on the edges of a range are included
+    assert BinMask([[1.5, 3.5]]) == [1, 2, 3]
+    assert BinMask([[1, 2]]) == [1]
+
+    # Adjacent and overlapping ranges are merged
+    assert BinMask([[1.5, 2.5], [2.5, 3.5]]) == [1, 2, 3]
+    assert BinMask([[1.5, 3], [2, 4.5]]) == [1, 2, 3, 4]
+    assert BinMask([[1, 9], [3, 4]]) == list(range(1, 9))
+
+    # The gaps between the ranges are excluded, whatever their order
+    assert BinMask([[7.5, 8.5], [0.5, 1.5]]) == [0, 1, 7, 8]
+    assert BinMask([[6, 12], [-10, 1], [3, 4]]) == [0, 3, 6, 7, 8, 9]
+
+
+def test_multistart_arguments():
+    # At least one of the minima of the short fits is polished, whose result starts the fit
+    from ROOT import SuperFitter
+    fitter = SuperFitter()
+    fitter.SetMultiStart(10, 1)
+    with pytest.raises(Exception):
+        fitter.SetMultiStart(10, 0)
+
+
+def test_scan_grid_order():
+    # The grid is visited along a serpentine, but the results are in row-major order, with the last parameter changing
+    # fastest, and agree with the scan of the same points in that order
+    fitter = test.ToyScanFitter('hScanGridCF', True)
+    axes = [[0.09, 0.1, 0.11], [0.025, 0.03, 0.035, 0.04]]
+    chi2 = list(fitter.ScanGrid(['mean', 'sigma'], axes))
+    points = [[mean, sigma] for mean in axes[0] for sigma in axes[1]]
+    names = list(fitter.GetParameterNames())
+    iMean, iSigma = names.index('mean'), names.index('sigma')
+    assert [[pars[iMean], pars[iSigma]] for pars in fitter.GetScanParameters()] == points
+    assert list(fitter.GetScanStatus()) == [0] * len(points)
+    assert chi2 == pytest.approx(list(fitter.Scan(['mean', 'sigma'], points)), rel=1e-6, abs=1e-3)
+
+
+def test_scan_profile():
+    # The profile of the chi2 of a linear model is a parabola around the minimum, with the uncertainty as half width
+    fitter = test.ToyScanFitter('hScanProfileCF', False)
+    iP1 = list(fitter.GetParameterNames()).index('p1')
+    p1, error = fitter.GetParameters()[iP1], fitter.GetParErrors()[iP1]
+    shifts = [-3 + 0.5 * iShift for iShift in range(13)]
+    chi2 = list(fitter.Scan(['p1'], [[p1 + shift * error] for shift in shifts]))
+    assert chi2 == pytest.approx([fitter.GetChi2() + shift**2 for shift in shifts], abs=1e-3)
+
+
+def test_scan_reproducibility():
+    # The chains do not depend on the number of threads, so neither do the starting points and the results
+    assert list(test.ScanGridResults(1)) == list(test.ScanGridResults(4))